@@ -0,0 +1,913 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "../packet.h"
+#include "../compress.h"
+
+#define MODE_CHAT 0
+#define MODE_STORM 1
+
+#define CONNECTION_CONNECTING 0
+#define CONNECTION_LOGGING_IN 1
+#define CONNECTION_READY 2
+#define CONNECTION_LOGGING_OUT 3
+#define CONNECTION_CLOSED 4
+
+#define MAX_STEPS 32
+#define EPOLL_MAX_EVENTS 512
+//Room for a compressed packet, the largest the server sends
+#define READ_BUFFER_SIZE (2 * COMPRESS_BOUND)
+//Messages a connection holds while the server is not reading, anything past this is counted as blocked.
+#define WRITE_BUFFER_SIZE (64 * PACKET_MAX_SIZE)
+#define LOGIN_TIMEOUT 10.0 //Seconds
+
+//Benchmark chat messages start with this, followed by the send time in hex nanoseconds.
+#define BENCH_MAGIC '#'
+
+//Log-linear latency histogram in microseconds, values below 64 are exact and every power of two above is
+//split in 32 buckets, so percentiles are within about 3%.
+#define HISTOGRAM_SUB_BUCKETS 32
+#define HISTOGRAM_BUCKETS (2 * HISTOGRAM_SUB_BUCKETS + 48 * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct connection {
+    int fd;
+    int index;
+    int state;
+    //ID assigned by the server, known once our own login comes back. A session ID if the server accepted sessions.
+    unsigned id;
+    char name[16];
+    char channel;
+    //Stops reading once logged in, to exercise the server's slow consumer handling
+    int slow;
+    //FEATURE_ bits the server accepted
+    int features;
+    //Created with the first compressed packet, a new connection starts a new stream
+    Decompressor *decompressor;
+    double connectTime;
+    Byte readBuffer[READ_BUFFER_SIZE];
+    int readLength;
+    Byte writeBuffer[WRITE_BUFFER_SIZE];
+    int writeLength;
+} Connection;
+
+typedef struct histogram {
+    long counts[HISTOGRAM_BUCKETS];
+    long total;
+    long max;
+} Histogram;
+
+typedef struct step_result {
+    int connections;
+    int ready;
+    double seconds;
+    long sent;
+    long received;
+    long receivedBytes;
+    long blocked;
+    long logins;
+    long disconnects;
+    Histogram latency;
+} StepResult;
+
+int mode = MODE_CHAT, json = 0, slow_count = 0, features = 0, step_count = 0, steps[MAX_STEPS], epoll_fd;
+double rate = 1.0, duration = 10.0, warmup = 1.0, mix[3] = {10, 80, 10};
+const char *channels = "ia";
+struct sockaddr_in server_addr;
+
+Connection **connections;
+int connection_count, next_sender;
+double send_credit;
+
+//Counters for the current measurement window.
+int measuring;
+double measure_start;
+StepResult result;
+
+void usage(const char *prog);
+
+int parse_steps(char *arg);
+
+int int_compare(const int *a, const int *b);
+
+int parse_mix(char *arg);
+
+void raise_fd_limit(int wanted);
+
+double now_s();
+
+long long now_ns();
+
+void run_step(int count);
+
+void report_step(StepResult *step);
+
+void connection_open(Connection *connection);
+
+void connection_close(Connection *connection, int error);
+
+void connection_event(Connection *connection, unsigned events);
+
+void connection_read(Connection *connection);
+
+void connection_process(Connection *connection, Byte *packet);
+
+void connection_process_all(Connection *connection, Byte *data, int length);
+
+void connection_flush(Connection *connection);
+
+void connection_send(Connection *connection, Byte *packet, int length);
+
+void connection_login(Connection *connection);
+
+void send_due_chats(double elapsed);
+
+void send_chat(Connection *connection);
+
+Connection *random_ready_connection(Connection *except);
+
+void poll_events(int timeout_ms);
+
+void histogram_record(Histogram *histogram, long value);
+
+long histogram_percentile(Histogram *histogram, double percentile);
+
+int main(int argc, char **argv) {
+    char *host = "127.0.0.1";
+    int opt;
+
+    static struct option long_options[] = {
+            {"host",        required_argument, NULL, 'H'},
+            {"connections", required_argument, NULL, 'c'},
+            {"rate",        required_argument, NULL, 'r'},
+            {"duration",    required_argument, NULL, 'd'},
+            {"warmup",      required_argument, NULL, 'w'},
+            {"mix",         required_argument, NULL, 'm'},
+            {"channels",    required_argument, NULL, 'C'},
+            {"slow",        required_argument, NULL, 's'},
+            {"storm",       no_argument,       NULL, 'S'},
+            {"framed",      no_argument,       NULL, 'f'},
+            {"batch",       no_argument,       NULL, 'b'},
+            {"compress",    no_argument,       NULL, 'z'},
+            {"sessions",    no_argument,       NULL, 'i'},
+            {"roster",      no_argument,       NULL, 'R'},
+            {"json",        no_argument,       NULL, 'j'},
+            {"help",        no_argument,       NULL, 'h'},
+            {NULL, 0,                          NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "H:c:r:d:w:m:C:s:SfbziRjh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'H':
+                host = optarg;
+                break;
+            case 'c':
+                if (parse_steps(optarg) < 0) {
+                    fprintf(stderr, "Please input connection counts like 10,100,1000.\n");
+                    exit(0);
+                }
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'w':
+                warmup = atof(optarg);
+                break;
+            case 'm':
+                if (parse_mix(optarg) < 0) {
+                    fprintf(stderr, "Please input the message mix as global:channel:private weights.\n");
+                    exit(0);
+                }
+                break;
+            case 'C':
+                channels = optarg;
+                break;
+            case 's':
+                slow_count = atoi(optarg);
+                break;
+            case 'S':
+                mode = MODE_STORM;
+                break;
+            case 'f':
+                features |= FEATURE_FRAMED;
+                break;
+            case 'b':
+                features |= FEATURE_BATCH;
+                break;
+            case 'z':
+                if (!compress_available()) {
+                    fprintf(stderr, "Built without zlib, compression isn't available.\n");
+                    exit(EXIT_FAILURE);
+                }
+                features |= FEATURE_COMPRESS;
+                break;
+            case 'i':
+                features |= FEATURE_SESSIONS;
+                break;
+            case 'R':
+                features |= FEATURE_ROSTER;
+                break;
+            case 'j':
+                json = 1;
+                break;
+            default:
+                usage(argv[0]);
+                exit(0);
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Please input a port number.\n");
+        usage(argv[0]);
+        exit(0);
+    }
+
+    if (rate < 0 || duration <= 0 || warmup < 0 || strlen(channels) == 0) {
+        fprintf(stderr, "Please input a positive rate and duration and at least one channel.\n");
+        exit(0);
+    }
+
+    if (step_count == 0) {
+        char default_steps[] = "10,100,1000";
+        parse_steps(default_steps);
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons((uint16_t) atoi(argv[optind]));
+    if (inet_pton(AF_INET, host, &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "Please input an IPv4 address as the host.\n");
+        exit(0);
+    }
+
+    int largest = 0;
+    for (int i = 0; i < step_count; i++) {
+        largest = steps[i] > largest ? steps[i] : largest;
+    }
+
+    raise_fd_limit(largest + 16);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    connections = calloc((size_t) largest, sizeof(Connection *));
+    srand(42);
+
+    if (!json) {
+        printf("%-6s %8s %8s %10s %12s %10s %9s %9s %9s %9s %8s %11s\n", "mode", "conns", "ready",
+               mode == MODE_STORM ? "logins/s" : "sent/s", "received/s", "rx KB/s", "p50 us", "p99 us", "p999 us",
+               "max us", "blocked", "disconnects");
+    }
+
+    for (int i = 0; i < step_count; i++) {
+        run_step(steps[i]);
+    }
+
+    for (int i = 0; i < connection_count; i++) {
+        connection_close(connections[i], 0);
+        free(connections[i]);
+    }
+
+    free(connections);
+    close(epoll_fd);
+    return 0;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--host ip] [--connections n,n,...] [--rate msgs/s per connection]\n"
+                    "       [--duration s] [--warmup s] [--mix global:channel:private] [--channels chars]\n"
+                    "       [--slow n] [--storm] [--framed] [--batch] [--compress] [--sessions]\n"
+                    "       [--roster] [--json] <port>\n", prog);
+}
+
+//Connections are only ever added, so the steps run in ascending order.
+int parse_steps(char *arg) {
+    step_count = 0;
+
+    for (char *token = strtok(arg, ","); token != NULL; token = strtok(NULL, ",")) {
+        if (step_count == MAX_STEPS || atoi(token) <= 0)
+            return -1;
+
+        steps[step_count++] = atoi(token);
+    }
+
+    qsort(steps, (size_t) step_count, sizeof(int), (int (*)(const void *, const void *)) &int_compare);
+    return step_count == 0 ? -1 : 0;
+}
+
+int int_compare(const int *a, const int *b) {
+    return *a - *b;
+}
+
+int parse_mix(char *arg) {
+    if (sscanf(arg, "%lf:%lf:%lf", &mix[0], &mix[1], &mix[2]) != 3)
+        return -1;
+
+    if (mix[0] < 0 || mix[1] < 0 || mix[2] < 0 || mix[0] + mix[1] + mix[2] <= 0)
+        return -1;
+
+    return 0;
+}
+
+void raise_fd_limit(int wanted) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        perror("getrlimit");
+        return;
+    }
+
+    if (limit.rlim_cur >= (rlim_t) wanted)
+        return;
+
+    limit.rlim_cur = limit.rlim_max < (rlim_t) wanted ? limit.rlim_max : (rlim_t) wanted;
+
+    if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        perror("setrlimit");
+        return;
+    }
+
+    if (limit.rlim_cur < (rlim_t) wanted) {
+        fprintf(stderr, "Only %ld descriptors are available, some connections will fail.\n", (long) limit.rlim_cur);
+    }
+}
+
+double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//Grows to count connections, waits for them to log in, warms up and then measures for duration seconds.
+void run_step(int count) {
+    while (connection_count < count) {
+        Connection *connection = calloc(1, sizeof(Connection));
+        connection->index = connection_count;
+        connection->fd = -1;
+        connection->slow = connection_count < slow_count;
+        connections[connection_count++] = connection;
+        connection_open(connection);
+    }
+
+    double start = now_s();
+    int ready = 0;
+
+    //Storm connections never settle, they only need to have started.
+    while (mode == MODE_CHAT && now_s() - start < LOGIN_TIMEOUT) {
+        ready = 0;
+        for (int i = 0; i < connection_count; i++) {
+            ready += connections[i]->state == CONNECTION_READY;
+        }
+
+        if (ready + result.disconnects >= connection_count)
+            break;
+
+        poll_events(10);
+    }
+
+    measuring = 0;
+    start = now_s();
+    double last = start;
+
+    while (1) {
+        double now = now_s();
+
+        if (!measuring && now - start >= warmup) {
+            memset(&result, 0, sizeof(result));
+            measuring = 1;
+            measure_start = now;
+        }
+
+        if (measuring && now - measure_start >= duration)
+            break;
+
+        if (mode == MODE_CHAT) {
+            send_due_chats(now - last);
+        }
+
+        last = now;
+        poll_events(1);
+    }
+
+    measuring = 0;
+    result.connections = count;
+    result.seconds = now_s() - measure_start;
+    for (int i = 0; i < connection_count; i++) {
+        result.ready += connections[i]->state == CONNECTION_READY;
+    }
+
+    report_step(&result);
+}
+
+void report_step(StepResult *step) {
+    double sent = (mode == MODE_STORM ? step->logins : step->sent) / step->seconds;
+    double received = step->received / step->seconds;
+    double received_bytes = step->receivedBytes / step->seconds;
+    Histogram *latency = &step->latency;
+
+    if (json) {
+        printf("{\"mode\":\"%s\",\"connections\":%d,\"slow\":%d,\"ready\":%d,\"seconds\":%.3f,\"sent\":%ld,\"received\":%ld,"
+               "\"logins\":%ld,\"sent_per_s\":%.1f,\"received_per_s\":%.1f,\"received_bytes_per_s\":%.1f,"
+               "\"latency_us\":{\"samples\":%ld,"
+               "\"p50\":%ld,\"p99\":%ld,\"p999\":%ld,\"max\":%ld},\"blocked\":%ld,\"disconnects\":%ld}\n",
+               mode == MODE_STORM ? "storm" : "chat", step->connections,
+               slow_count < step->connections ? slow_count : step->connections, step->ready, step->seconds, step->sent,
+               step->received, step->logins, sent, received, received_bytes, latency->total, histogram_percentile(latency, 50),
+               histogram_percentile(latency, 99), histogram_percentile(latency, 99.9), latency->max, step->blocked,
+               step->disconnects);
+    } else {
+        printf("%-6s %8d %8d %10.0f %12.0f %10.1f %9ld %9ld %9ld %9ld %8ld %11ld\n",
+               mode == MODE_STORM ? "storm" : "chat", step->connections, step->ready, sent, received,
+               received_bytes / 1024, histogram_percentile(latency, 50),
+               histogram_percentile(latency, 99), histogram_percentile(latency, 99.9), latency->max, step->blocked,
+               step->disconnects);
+    }
+
+    fflush(stdout);
+}
+
+void connection_open(Connection *connection) {
+    struct epoll_event event;
+    int one = 1;
+
+    connection->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (connection->fd < 0) {
+        perror("socket");
+        connection->state = CONNECTION_CLOSED;
+        result.disconnects++;
+        return;
+    }
+
+    setsockopt(connection->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    connection->state = CONNECTION_CONNECTING;
+    connection->id = SESSION_SERVER;
+    connection->features = 0;
+    connection->readLength = 0;
+    connection->writeLength = 0;
+    connection->connectTime = now_s();
+    snprintf(connection->name, sizeof(connection->name), "bench%d", connection->index);
+    connection->channel = channels[connection->index % strlen(channels)];
+
+    if (connect(connection->fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS) {
+        perror("connect");
+        connection_close(connection, 1);
+        return;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = connection;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection->fd, &event) < 0) {
+        perror("epoll_ctl");
+        connection_close(connection, 1);
+    }
+}
+
+void connection_close(Connection *connection, int error) {
+    if (connection->state == CONNECTION_CLOSED)
+        return;
+
+    //Closing the descriptor also removes it from the epoll set.
+    close(connection->fd);
+    connection->fd = -1;
+    connection->state = CONNECTION_CLOSED;
+
+    if (connection->decompressor != NULL) {
+        decompressor_free(connection->decompressor);
+        connection->decompressor = NULL;
+    }
+
+    if (error) {
+        result.disconnects++;
+    }
+}
+
+void connection_event(Connection *connection, unsigned events) {
+    if (connection->state == CONNECTION_CONNECTING && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+
+        getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0) {
+            fprintf(stderr, "connect: %s\n", strerror(error));
+            connection_close(connection, 1);
+            return;
+        }
+
+        connection_login(connection);
+    }
+
+    if (events & EPOLLOUT) {
+        connection_flush(connection);
+    }
+
+    if (connection->state != CONNECTION_CLOSED && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        connection_read(connection);
+    }
+}
+
+void connection_login(Connection *connection) {
+    Byte packet[PACKET_MAX_SIZE];
+
+    if (features != 0) {
+        Byte request[4] = {FEATURES_PACKET, (Byte) features, 0, 0};
+        connection_send(connection, request, sizeof(request));
+    }
+
+    memset(packet, 0, sizeof(packet));
+    packet[0] = LOGIN_PACKET;
+    packet[1] = 0xFF;
+    memcpy(packet + 2, connection->name, strlen(connection->name));
+
+    connection->state = CONNECTION_LOGGING_IN;
+    connection_send(connection, packet, packet_size(LOGIN_PACKET));
+}
+
+//Edge-triggered, so read until the socket would block.
+void connection_read(Connection *connection) {
+    //A slow reader leaves everything in the socket once it knows its ID.
+    if (connection->slow && connection->state == CONNECTION_READY)
+        return;
+
+    while (connection->state != CONNECTION_CLOSED) {
+        int read_bytes = (int) read(connection->fd, connection->readBuffer + connection->readLength,
+                                    (size_t) (READ_BUFFER_SIZE - connection->readLength));
+
+        if (read_bytes < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                connection_close(connection, 1);
+            }
+
+            return;
+        }
+
+        if (read_bytes == 0) {
+            //In a storm the server closing after our logout completes a cycle, otherwise we were dropped.
+            if (connection->state == CONNECTION_LOGGING_OUT) {
+                connection_close(connection, 0);
+                connection_open(connection);
+            } else {
+                connection_close(connection, 1);
+            }
+
+            return;
+        }
+
+        connection->readLength += read_bytes;
+
+        if (measuring) {
+            result.receivedBytes += read_bytes;
+        }
+
+        int position = 0;
+        while (position < connection->readLength) {
+            int size = packet_length(connection->readBuffer + position, connection->readLength - position);
+
+            if (size < 0) {
+                fprintf(stderr, "Unknown packet 0x%02x from the server.\n", connection->readBuffer[position]);
+                connection_close(connection, 1);
+                return;
+            }
+
+            if (size == 0 || position + size > connection->readLength)
+                break;
+
+            connection_process(connection, connection->readBuffer + position);
+            position += size;
+
+            if (connection->state == CONNECTION_CLOSED)
+                return;
+        }
+
+        connection->readLength -= position;
+        memmove(connection->readBuffer, connection->readBuffer + position, (size_t) connection->readLength);
+    }
+}
+
+void connection_process(Connection *connection, Byte *packet) {
+    Byte logout[2];
+    Byte command[3];
+    Byte packets[COMPRESS_MAX_CONTENTS];
+    char stamp[32];
+    int offset, message, length, sessions;
+    unsigned contents;
+
+    switch (packet[0]) {
+        case CHAT_PACKET:
+        case FRAMED_CHAT_PACKET:
+        case SESSION_CHAT_PACKET:
+            length = packet_chat_fields(packet, &offset, &message);
+
+            if (length > 0 && packet[message] == BENCH_MAGIC && measuring) {
+                //Framed messages aren't terminated, copy the stamp out first.
+                length = length < (int) sizeof(stamp) ? length : (int) sizeof(stamp) - 1;
+                memcpy(stamp, packet + message + 1, (size_t) length - 1);
+                stamp[length - 1] = 0;
+
+                long long sent = strtoll(stamp, NULL, 16);
+                long long latency = now_ns() - sent;
+
+                //Messages sent before the window opened would skew it.
+                if (sent >= (long long) (measure_start * 1e9)) {
+                    result.received++;
+                    histogram_record(&result.latency, (long) (latency / 1000));
+                }
+            }
+            break;
+        case LOGIN_PACKET:
+        case SESSION_LOGIN_PACKET:
+            sessions = packet[0] == SESSION_LOGIN_PACKET;
+
+            if (connection->state != CONNECTION_LOGGING_IN ||
+                strncmp((char *) packet + (sessions ? 5 : 2), connection->name, sizeof(connection->name) - 1) != 0)
+                break;
+
+            connection->id = sessions ? session_get(packet + 1) : packet[1];
+
+            if (mode == MODE_STORM) {
+                if (measuring) {
+                    result.logins++;
+                    histogram_record(&result.latency, (long) ((now_s() - connection->connectTime) * 1e6));
+                }
+
+                logout[0] = LOGOUT_PACKET;
+                logout[1] = (Byte) connection->id;
+                connection->state = CONNECTION_LOGGING_OUT;
+                connection_send(connection, logout, sizeof(logout));
+                break;
+            }
+
+            connection->state = CONNECTION_READY;
+            if (connection->channel != GLOBAL_CHANNEL) {
+                command[0] = COMMAND_PACKET;
+                command[1] = SWITCH_COMMAND;
+                command[2] = (Byte) connection->channel;
+                connection_send(connection, command, sizeof(command));
+            }
+            break;
+        case FEATURES_PACKET:
+            connection->features = packet[1];
+            break;
+        case BATCH_PACKET:
+            offset = 1 + varint_get(packet + 1, VARINT_MAX_BYTES, &contents);
+            connection_process_all(connection, packet + offset, (int) contents);
+            break;
+        case COMPRESSED_PACKET:
+            offset = 1 + varint_get(packet + 1, VARINT_MAX_BYTES, &contents);
+
+            if (connection->decompressor == NULL) {
+                connection->decompressor = decompressor_create();
+            }
+
+            length = connection->decompressor == NULL ? -1 :
+                     decompressor_decompress(connection->decompressor, packet + offset, (int) contents, packets,
+                                             sizeof(packets));
+
+            if (length < 0) {
+                connection_close(connection, 1);
+                break;
+            }
+
+            connection_process_all(connection, packets, length);
+            break;
+        case LOGOUT_PACKET:
+            //The server turned us away, it is full.
+            if (packet[1] == 0xFF && connection->state == CONNECTION_LOGGING_IN) {
+                connection_close(connection, 1);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+//Processes the whole packets a batch or compressed packet carries.
+void connection_process_all(Connection *connection, Byte *data, int length) {
+    int offset = 0;
+
+    while (offset < length && connection->state != CONNECTION_CLOSED) {
+        int size = packet_length(data + offset, length - offset);
+
+        if (size <= 0 || offset + size > length) {
+            fprintf(stderr, "Malformed packet 0x%02x from the server.\n", data[offset]);
+            connection_close(connection, 1);
+            return;
+        }
+
+        connection_process(connection, data + offset);
+        offset += size;
+    }
+}
+
+void connection_send(Connection *connection, Byte *packet, int length) {
+    if (connection->writeLength + length > WRITE_BUFFER_SIZE) {
+        if (measuring) {
+            result.blocked++;
+        }
+        return;
+    }
+
+    memcpy(connection->writeBuffer + connection->writeLength, packet, (size_t) length);
+    connection->writeLength += length;
+
+    if (connection->state != CONNECTION_CONNECTING) {
+        connection_flush(connection);
+    }
+}
+
+void connection_flush(Connection *connection) {
+    int position = 0;
+
+    while (position < connection->writeLength) {
+        int write_bytes = (int) send(connection->fd, connection->writeBuffer + position,
+                                     (size_t) (connection->writeLength - position), MSG_NOSIGNAL);
+
+        if (write_bytes < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                connection_close(connection, 1);
+                return;
+            }
+
+            break;
+        }
+
+        position += write_bytes;
+    }
+
+    connection->writeLength -= position;
+    memmove(connection->writeBuffer, connection->writeBuffer + position, (size_t) connection->writeLength);
+}
+
+//Spreads rate messages per second per connection evenly over time, round robin across the senders.
+void send_due_chats(double elapsed) {
+    int senders = connection_count - (slow_count < connection_count ? slow_count : connection_count);
+
+    if (senders == 0 || rate == 0)
+        return;
+
+    send_credit += elapsed * rate * senders;
+
+    //After a stall don't try to catch up with more than a tenth of a second worth of messages.
+    if (send_credit > rate * senders / 10 + 1) {
+        send_credit = rate * senders / 10 + 1;
+    }
+
+    for (int tries = 0; send_credit >= 1 && tries < connection_count; tries++) {
+        Connection *connection = connections[next_sender];
+        next_sender = (next_sender + 1) % connection_count;
+
+        if (connection->state != CONNECTION_READY || connection->slow)
+            continue;
+
+        send_chat(connection);
+        send_credit--;
+        tries = 0;
+    }
+}
+
+void send_chat(Connection *connection) {
+    Byte packet[1 + VARINT_MAX_BYTES + SESSION_CHAT_FIELDS + CHAT_MESSAGE_SIZE];
+    char msg[CHAT_MESSAGE_SIZE];
+    double pick = (double) rand() / RAND_MAX * (mix[0] + mix[1] + mix[2]);
+    Connection *target = NULL;
+    char channel;
+    unsigned to = SESSION_SERVER;
+
+    if (pick < mix[0]) {
+        channel = GLOBAL_CHANNEL;
+    } else if (pick < mix[0] + mix[1]) {
+        channel = connection->channel;
+    } else {
+        target = random_ready_connection(connection);
+        if (target == NULL)
+            return;
+
+        channel = PRIVATE_CHANNEL;
+        to = target->id;
+    }
+
+    int length = snprintf(msg, sizeof(msg), "%c%llx", BENCH_MAGIC, now_ns());
+
+    if (measuring) {
+        result.sent++;
+    }
+
+    if (connection->features & FEATURE_SESSIONS) {
+        connection_send(connection, packet,
+                        packet_session_chat_encode(packet, channel, SESSION_SERVER, to, msg, length));
+    } else if (connection->features & FEATURE_FRAMED) {
+        connection_send(connection, packet,
+                        packet_framed_chat_encode(packet, channel, 0xFF, (Byte) to, msg, length));
+    } else {
+        packet_chat_encode(packet, channel, 0xFF, (Byte) to, msg, length);
+        connection_send(connection, packet, packet_size(CHAT_PACKET));
+    }
+}
+
+Connection *random_ready_connection(Connection *except) {
+    for (int tries = 0; tries < 8; tries++) {
+        Connection *connection = connections[rand() % connection_count];
+
+        if (connection != except && connection->state == CONNECTION_READY && !connection->slow)
+            return connection;
+    }
+
+    return NULL;
+}
+
+void poll_events(int timeout_ms) {
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    int selected = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, timeout_ms);
+
+    if (selected < 0) {
+        if (errno != EINTR) {
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+
+    for (int i = 0; i < selected; i++) {
+        connection_event(events[i].data.ptr, events[i].events);
+    }
+}
+
+void histogram_record(Histogram *histogram, long value) {
+    int index;
+
+    if (value < 0) {
+        value = 0;
+    }
+
+    if (value < 2 * HISTOGRAM_SUB_BUCKETS) {
+        index = (int) value;
+    } else {
+        int shift = 63 - __builtin_clzl((unsigned long) value) - 5;
+        index = HISTOGRAM_SUB_BUCKETS * shift + (int) (value >> shift);
+    }
+
+    if (index >= HISTOGRAM_BUCKETS) {
+        index = HISTOGRAM_BUCKETS - 1;
+    }
+
+    histogram->counts[index]++;
+    histogram->total++;
+
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+//Returns the upper bound of the bucket holding the given percentile.
+long histogram_percentile(Histogram *histogram, double percentile) {
+    long wanted = (long) (histogram->total * percentile / 100.0 + 0.5);
+    long seen = 0;
+
+    if (histogram->total == 0)
+        return 0;
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+
+        if (seen >= wanted && histogram->counts[i] != 0) {
+            if (i < 2 * HISTOGRAM_SUB_BUCKETS)
+                return i;
+
+            int shift = i / HISTOGRAM_SUB_BUCKETS - 1;
+            long value = ((long) (i - HISTOGRAM_SUB_BUCKETS * shift) + 1) << shift;
+            return value - 1 < histogram->max ? value - 1 : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
@@ -0,0 +1,557 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../list.h"
+#include "../packet.h"
+#include "../pool.h"
+#include "../server/client.h"
+#include "../server/client_table.h"
+#include "../server/timer.h"
+
+#define LOOKUPS 1000000
+//Total nodes walked by the list benchmark, so large lists don't take minutes.
+#define LIST_WORK 5000000
+//Operations per packet measurement, and bytes put per buffer size.
+#define BUFFER_WORK 1000000
+//Buffers created per timed batch, so the clock reads don't dominate a single create.
+#define BUFFER_BATCH 256
+//Timers are due at random within this many milliseconds, like client deadlines of up to a minute.
+#define TIMER_SPREAD 60000
+
+int sizes[] = {10, 100, 1000, 10000, 50000};
+
+//The four pooled packet sizes plus two that fall through to malloc.
+int buffer_sizes[] = {2, 3, 17, 44, 128, 4096};
+
+//Time and allocations spent between measure_begin and measure_end, so setup work isn't counted.
+typedef struct measure {
+    double ns;
+    long mallocs;
+    long poolAllocs;
+    double start;
+    long startMallocs;
+    long startPoolAllocs;
+} Measure;
+
+//Heap allocations, counted by the --wrap'd allocator functions below.
+long malloc_count = 0;
+//Timers fired by the timer benchmark
+long timers_fired = 0;
+
+void *__real_malloc(size_t size);
+
+void *__real_calloc(size_t count, size_t size);
+
+void *__real_realloc(void *ptr, size_t size);
+
+double now_ns();
+
+void measure_begin(Measure *measure);
+
+void measure_end(Measure *measure);
+
+void measure_report(const char *name, int n, Measure *measure, double ops);
+
+int section_enabled(int argc, char **argv, const char *name);
+
+void bench_client_table(int n);
+
+void bench_client_list(int n);
+
+void bench_queues(int n);
+
+void bench_list_ops(int n);
+
+void bench_buffers(int size);
+
+void bench_packets();
+
+void bench_timers(int n);
+
+void timer_count_expired(Timer *timer);
+
+int client_equals(Client *client, int *id);
+
+int int_equals(int *a, int *b);
+
+int main(int argc, char **argv) {
+    int count = sizeof(sizes) / sizeof(sizes[0]);
+    int buffer_count = sizeof(buffer_sizes) / sizeof(buffer_sizes[0]);
+
+    printf("%-28s %8s %12s %12s %12s\n", "benchmark", "n", "ns/op", "mallocs/op", "pool/op");
+
+    if (section_enabled(argc, argv, "table")) {
+        for (int i = 0; i < count; i++) {
+            bench_client_table(sizes[i]);
+        }
+
+        for (int i = 0; i < count; i++) {
+            bench_client_list(sizes[i]);
+        }
+    }
+
+    if (section_enabled(argc, argv, "queue")) {
+        for (int i = 0; i < count; i++) {
+            bench_queues(sizes[i]);
+        }
+    }
+
+    if (section_enabled(argc, argv, "list")) {
+        for (int i = 0; i < count; i++) {
+            bench_list_ops(sizes[i]);
+        }
+    }
+
+    if (section_enabled(argc, argv, "buffer")) {
+        for (int i = 0; i < buffer_count; i++) {
+            bench_buffers(buffer_sizes[i]);
+        }
+    }
+
+    if (section_enabled(argc, argv, "packet")) {
+        bench_packets();
+    }
+
+    if (section_enabled(argc, argv, "timer")) {
+        for (int i = 0; i < count; i++) {
+            bench_timers(sizes[i]);
+        }
+    }
+
+    return 0;
+}
+
+void *__wrap_malloc(size_t size) {
+    malloc_count++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    malloc_count++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    malloc_count++;
+    return __real_realloc(ptr, size);
+}
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void measure_begin(Measure *measure) {
+    measure->startMallocs = malloc_count;
+    measure->startPoolAllocs = pool_total_allocs();
+    measure->start = now_ns();
+}
+
+void measure_end(Measure *measure) {
+    measure->ns += now_ns() - measure->start;
+    measure->mallocs += malloc_count - measure->startMallocs;
+    measure->poolAllocs += pool_total_allocs() - measure->startPoolAllocs;
+}
+
+void measure_report(const char *name, int n, Measure *measure, double ops) {
+    printf("%-28s %8d %12.2f %12.3f %12.3f\n", name, n, measure->ns / ops, measure->mallocs / ops,
+           measure->poolAllocs / ops);
+}
+
+//With no arguments every section runs, otherwise only the named ones: table, queue, list, buffer, packet, timer.
+int section_enabled(int argc, char **argv, const char *name) {
+    if (argc < 2) {
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], name) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+//Lookup, remove and re-add clients with fds 3..n+2 and sessions 1..n in a random order, like events arriving on
+//random sockets.
+void bench_client_table(int n) {
+    ClientTable *table = client_table_create(n);
+    int *fds = malloc(LOOKUPS * sizeof(int));
+    long sink = 0;
+    int wrong = 0;
+    Measure lookup = {0}, churn = {0}, iterate = {0};
+
+    for (int i = 0; i < n; i++) {
+        Client *client = client_create(i + 3);
+        client->session = (unsigned) i + 1;
+        client_table_add(table, client);
+    }
+
+    srand(42);
+    for (int i = 0; i < LOOKUPS; i++) {
+        fds[i] = rand() % n + 3;
+    }
+
+    measure_begin(&lookup);
+    for (int i = 0; i < LOOKUPS; i++) {
+        sink += client_table_get(table, fds[i])->id;
+    }
+    measure_end(&lookup);
+
+    measure_begin(&churn);
+    for (int i = 0; i < LOOKUPS; i++) {
+        Client *client = client_table_remove(table, fds[i]);
+        client_table_add(table, client);
+    }
+    measure_end(&churn);
+
+    measure_begin(&iterate);
+    for (int round = 0; round < LOOKUPS / n + 1; round++) {
+        for (int i = 0; i < table->size; i++) {
+            sink += table->clients[i]->channel;
+        }
+    }
+    measure_end(&iterate);
+
+    measure_report("client_table_get", n, &lookup, LOOKUPS);
+    measure_report("client_table_remove+add", n, &churn, LOOKUPS);
+    measure_report("client_table iterate", n, &iterate, (double) (LOOKUPS / n + 1) * n);
+
+    //After the churn every client is still found by its session, and no longer once half of them are removed.
+    for (int fd = 3; fd < n + 3; fd++) {
+        wrong += client_table_get_session(table, (unsigned) fd - 2) != client_table_get(table, fd);
+    }
+
+    for (int fd = 3; fd < n + 3; fd += 2) {
+        Client *client = client_table_remove(table, fd);
+        if (client == NULL) {
+            wrong++;
+            continue;
+        }
+
+        wrong += client_table_get_session(table, (unsigned) fd - 2) != NULL;
+        client_free(client);
+    }
+
+    for (int fd = 4; fd < n + 3; fd += 2) {
+        Client *client = client_table_get_session(table, (unsigned) fd - 2);
+        wrong += client == NULL || client->id != fd;
+    }
+
+    if (wrong != 0) {
+        printf("%d session lookups or removals found the wrong client.\n", wrong);
+    }
+
+    if (sink == 0) {
+        printf("\n");
+    }
+
+    client_table_free(table, &client_free);
+    free(fds);
+}
+
+//The old client_get: list_contains followed by list_get.
+void bench_client_list(int n) {
+    List *list = list_create();
+    long sink = 0;
+    Measure lookup = {0};
+
+    for (int i = 0; i < n; i++) {
+        list_add(list, client_create(i + 3));
+    }
+
+    int lookups = LIST_WORK / n;
+
+    srand(42);
+    measure_begin(&lookup);
+    for (int i = 0; i < lookups; i++) {
+        int fd = rand() % n + 3;
+        int index = list_contains(list, &fd, (int (*)(void *, void *)) &client_equals);
+        sink += ((Client *) list_get(list, index))->id;
+    }
+    measure_end(&lookup);
+
+    measure_report("list client_get (old)", n, &lookup, lookups);
+
+    if (sink == 0) {
+        printf("\n");
+    }
+
+    list_free(list, (void (*)(void *)) &client_free);
+}
+
+//Enqueue, iterate and dequeue n elements, per element costs should not depend on n.
+void bench_queues(int n) {
+    int rounds = LOOKUPS / n + 1;
+    long sink = 0;
+    Measure add = {0}, iterate = {0}, iterate_get = {0}, push = {0}, iterate_deque = {0}, pop = {0};
+
+    for (int round = 0; round < rounds; round++) {
+        List *list = list_create();
+        Deque *deque = deque_create(8);
+
+        measure_begin(&add);
+        for (int i = 0; i < n; i++) {
+            list_add(list, &sizes[0]);
+        }
+        measure_end(&add);
+
+        measure_begin(&iterate);
+        ListIterator iterator = list_iterator(list);
+        while (list_has_next(&iterator)) {
+            sink += *(int *) list_next(&iterator);
+        }
+        measure_end(&iterate);
+
+        //Indexed iteration walks from the head every time, only time it where it finishes.
+        if (n <= 1000) {
+            measure_begin(&iterate_get);
+            for (int i = 0; i < n; i++) {
+                sink += *(int *) list_get(list, i);
+            }
+            measure_end(&iterate_get);
+        }
+
+        measure_begin(&push);
+        for (int i = 0; i < n; i++) {
+            deque_push_back(deque, &sizes[0]);
+        }
+        measure_end(&push);
+
+        measure_begin(&iterate_deque);
+        for (int i = 0; i < deque->size; i++) {
+            sink += *(int *) deque_get(deque, i);
+        }
+        measure_end(&iterate_deque);
+
+        measure_begin(&pop);
+        while (deque->size != 0) {
+            sink += *(int *) deque_pop_front(deque);
+        }
+        measure_end(&pop);
+
+        list_free(list, NULL);
+        deque_free(deque, NULL);
+    }
+
+    double ops = (double) rounds * n;
+    measure_report("list_add", n, &add, ops);
+    measure_report("list iterator", n, &iterate, ops);
+    if (n <= 1000) {
+        measure_report("list_get iterate (old)", n, &iterate_get, ops);
+    }
+    measure_report("deque_push_back", n, &push, ops);
+    measure_report("deque_get iterate", n, &iterate_deque, ops);
+    measure_report("deque_pop_front", n, &pop, ops);
+
+    if (sink == 0) {
+        printf("\n");
+    }
+}
+
+//Random access and removal by value on a list of n ints, both walk the list so the cost grows with n.
+void bench_list_ops(int n) {
+    int *values = malloc(n * sizeof(int));
+    int lookups = LIST_WORK / n + 1;
+    long sink = 0;
+    Measure get = {0}, remove = {0};
+    List *list = list_create();
+
+    for (int i = 0; i < n; i++) {
+        values[i] = i;
+        list_add(list, &values[i]);
+    }
+
+    srand(42);
+    measure_begin(&get);
+    for (int i = 0; i < lookups; i++) {
+        sink += *(int *) list_get(list, rand() % n);
+    }
+    measure_end(&get);
+
+    //Remove a random value and put it back at the tail, so the list keeps its length.
+    measure_begin(&remove);
+    for (int i = 0; i < lookups; i++) {
+        int value = rand() % n;
+        int *removed = list_remove_value(list, &value, (int (*)(void *, void *)) &int_equals);
+        list_add(list, removed);
+    }
+    measure_end(&remove);
+
+    measure_report("list_get random", n, &get, lookups);
+    measure_report("list_remove_value+add", n, &remove, lookups);
+
+    if (sink == 0) {
+        printf("\n");
+    }
+
+    list_free(list, NULL);
+    free(values);
+}
+
+//Create, fill byte by byte, copy and free batches of buffers of the given size.
+void bench_buffers(int size) {
+    Buffer *buffers[BUFFER_BATCH];
+    Buffer *copies[BUFFER_BATCH];
+    int rounds = BUFFER_WORK / (BUFFER_BATCH * size) + 1;
+    long sink = 0;
+    Measure create = {0}, put = {0}, copy = {0}, destroy = {0};
+
+    for (int round = 0; round < rounds; round++) {
+        measure_begin(&create);
+        for (int i = 0; i < BUFFER_BATCH; i++) {
+            buffers[i] = buffer_create(size);
+        }
+        measure_end(&create);
+
+        measure_begin(&put);
+        for (int i = 0; i < BUFFER_BATCH; i++) {
+            for (int j = 0; j < size; j++) {
+                buffer_put(buffers[i], (Byte) j);
+            }
+        }
+        measure_end(&put);
+
+        measure_begin(&copy);
+        for (int i = 0; i < BUFFER_BATCH; i++) {
+            copies[i] = buffer_copy(buffers[i]);
+        }
+        measure_end(&copy);
+
+        measure_begin(&destroy);
+        for (int i = 0; i < BUFFER_BATCH; i++) {
+            sink += copies[i]->buffer[size - 1];
+            buffer_free(copies[i]);
+            buffer_free(buffers[i]);
+        }
+        measure_end(&destroy);
+    }
+
+    double ops = (double) rounds * BUFFER_BATCH;
+    measure_report("buffer_create", size, &create, ops);
+    measure_report("buffer_put", size, &put, ops * size);
+    measure_report("buffer_copy", size, &copy, ops);
+    measure_report("buffer_free", size, &destroy, 2 * ops);
+
+    if (sink == 0) {
+        printf("\n");
+    }
+}
+
+//Each builder followed by buffer_free, the cost of producing one packet from scratch.
+void bench_packets() {
+    const char *msg = "The quick brown fox jumps over the lazy";
+    const char *name = "benchmark";
+    long sink = 0;
+    Measure chat = {0}, server = {0}, login = {0}, nid = {0};
+
+    measure_begin(&chat);
+    for (int i = 0; i < BUFFER_WORK; i++) {
+        Buffer *packet = packet_chat_create(GLOBAL_CHANNEL, msg);
+        sink += packet->limit;
+        buffer_free(packet);
+    }
+    measure_end(&chat);
+
+    measure_begin(&server);
+    for (int i = 0; i < BUFFER_WORK; i++) {
+        Buffer *packet = packet_server_message_create(msg);
+        sink += packet->limit;
+        buffer_free(packet);
+    }
+    measure_end(&server);
+
+    measure_begin(&login);
+    for (int i = 0; i < BUFFER_WORK; i++) {
+        Buffer *packet = packet_login_create(name);
+        sink += packet->limit;
+        buffer_free(packet);
+    }
+    measure_end(&login);
+
+    measure_begin(&nid);
+    for (int i = 0; i < BUFFER_WORK; i++) {
+        Buffer *packet = packet_nid_create((Byte) i, name);
+        sink += packet->limit;
+        buffer_free(packet);
+    }
+    measure_end(&nid);
+
+    measure_report("packet_chat_create", PACKET_MAX_SIZE, &chat, BUFFER_WORK);
+    measure_report("packet_server_message_create", PACKET_MAX_SIZE, &server, BUFFER_WORK);
+    measure_report("packet_login_create", 17, &login, BUFFER_WORK);
+    measure_report("packet_nid_create", 17, &nid, BUFFER_WORK);
+
+    if (sink == 0) {
+        printf("\n");
+    }
+}
+
+//Schedule n timers, move each further out like a client that was heard from, then fire them all. Per timer costs
+//should not depend on n.
+void bench_timers(int n) {
+    int rounds = LOOKUPS / n + 1;
+    Measure schedule = {0}, reschedule = {0}, fire = {0};
+    TimerWheel *wheel = malloc(sizeof(TimerWheel));
+    Timer *timers = malloc(n * sizeof(Timer));
+    long *due = malloc(n * sizeof(long));
+
+    srand((unsigned) n);
+    for (int i = 0; i < n; i++) {
+        due[i] = 1 + rand() % TIMER_SPREAD;
+    }
+
+    timers_fired = 0;
+
+    for (int round = 0; round < rounds; round++) {
+        timer_wheel_init(wheel, 0);
+
+        for (int i = 0; i < n; i++) {
+            timer_init(&timers[i], &timer_count_expired);
+        }
+
+        measure_begin(&schedule);
+        for (int i = 0; i < n; i++) {
+            timer_schedule(wheel, &timers[i], due[i]);
+        }
+        measure_end(&schedule);
+
+        measure_begin(&reschedule);
+        for (int i = 0; i < n; i++) {
+            timer_schedule(wheel, &timers[i], due[i] + TIMER_SPREAD / 2);
+        }
+        measure_end(&reschedule);
+
+        measure_begin(&fire);
+        timer_wheel_advance(wheel, 2 * TIMER_SPREAD);
+        measure_end(&fire);
+    }
+
+    double ops = (double) rounds * n;
+    measure_report("timer_schedule", n, &schedule, ops);
+    measure_report("timer_schedule (move)", n, &reschedule, ops);
+    measure_report("timer_wheel_advance per fire", n, &fire, ops);
+
+    if (timers_fired != (long) rounds * n) {
+        printf("Only %ld of %ld timers fired.\n", timers_fired, (long) rounds * n);
+    }
+
+    free(due);
+    free(timers);
+    free(wheel);
+}
+
+void timer_count_expired(Timer *timer) {
+    timers_fired++;
+}
+
+int client_equals(Client *client, int *id) {
+    return client->id == *id;
+}
+
+int int_equals(int *a, int *b) {
+    return *a == *b;
+}
@@ -2,10 +2,26 @@
 #include <malloc.h>
 #include <stdio.h>
 #include "buffer.h"
+#include "pool.h"
 
+#define BUFFER_SLAB_OBJECTS 256
+
+//Function Declarations
+Pool *buffer_pool(int size);
+
+//Size classes for the fixed packet sizes, the header and the bytes share one allocation.
+__thread Pool buffer_pools[] = {
+        POOL_INITIALIZER("buffer-2", sizeof(Buffer) + 2, BUFFER_SLAB_OBJECTS),
+        POOL_INITIALIZER("buffer-3", sizeof(Buffer) + 3, BUFFER_SLAB_OBJECTS),
+        POOL_INITIALIZER("buffer-17", sizeof(Buffer) + 17, BUFFER_SLAB_OBJECTS),
+        POOL_INITIALIZER("buffer-44", sizeof(Buffer) + 44, BUFFER_SLAB_OBJECTS)
+};
+
+//Function Implementations
 Buffer *buffer_create(int size) {
-    Buffer *buffer = malloc(sizeof(Buffer));
-    buffer->buffer = malloc(size * sizeof(Byte));
+    Pool *pool = buffer_pool(size);
+    Buffer *buffer = pool != NULL ? pool_alloc(pool) : malloc(sizeof(Buffer) + size * sizeof(Byte));
+    buffer->buffer = (Byte *) (buffer + 1);
     memset(buffer->buffer, 0, size * sizeof(Byte));
     buffer->size = size;
     buffer->position = 0;
@@ -72,10 +88,26 @@ void buffer_reset(Buffer *buffer) {
 
 void buffer_free(Buffer *buffer) {
     if(buffer) {
-        free(buffer->buffer);
-        free(buffer);
+        Pool *pool = buffer_pool(buffer->size);
+
+        if (pool != NULL) {
+            pool_free(pool, buffer);
+        } else {
+            free(buffer);
+        }
     }
 }
 
+//"private" functions
+Pool *buffer_pool(int size) {
+    for (int i = 0; i < sizeof(buffer_pools) / sizeof(buffer_pools[0]); i++) {
+        if (buffer_pools[i].objectSize == sizeof(Buffer) + size) {
+            return &buffer_pools[i];
+        }
+    }
+
+    return NULL;
+}
+
 
 
@@ -2,7 +2,8 @@
 #define CHATSERVER_CLIENT_H
 
 typedef struct client {
-    int id;
+    //Session ID once the server accepted sessions, the one byte ID before that
+    unsigned id;
     char name[16];
 } Client;
 #endif //CHATSERVER_CLIENT_H
@@ -0,0 +1,152 @@
+#include <memory.h>
+#include <malloc.h>
+#include <stdio.h>
+#include "client_cache.h"
+
+//Function Declarations
+int client_cache_grow(ClientCache *cache);
+
+int client_cache_slot(ClientCache *cache, unsigned id);
+
+//Function Implementations
+ClientCache *client_cache_create(int capacity) {
+    ClientCache *cache = malloc(sizeof(ClientCache));
+
+    if (cache == NULL) {
+        fprintf(stderr, "Out of memory (client_cache_create).\n");
+        return NULL;
+    }
+
+    cache->bits = 4;
+    while ((1 << cache->bits) < capacity * 2) {
+        cache->bits++;
+    }
+
+    cache->size = 0;
+    cache->slots = calloc((size_t) 1 << cache->bits, sizeof(Client));
+
+    if (cache->slots == NULL) {
+        fprintf(stderr, "Out of memory (client_cache_create).\n");
+        free(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+//Fibonacci hashing, the top bits of the product depend on every bit of the ID.
+int client_cache_slot(ClientCache *cache, unsigned id) {
+    return (int) ((id * 2654435769u) >> (32 - cache->bits));
+}
+
+Client *client_cache_get(ClientCache *cache, unsigned id) {
+    int mask = (1 << cache->bits) - 1;
+
+    if (id == 0) {
+        return NULL;
+    }
+
+    for (int i = client_cache_slot(cache, id); cache->slots[i].id != 0; i = (i + 1) & mask) {
+        if (cache->slots[i].id == id) {
+            return &cache->slots[i];
+        }
+    }
+
+    return NULL;
+}
+
+//Adds the client or renames it in place. Returns -1 if it couldn't be added.
+int client_cache_put(ClientCache *cache, unsigned id, const char *name) {
+    if (id == 0) {
+        return -1;
+    }
+
+    if ((cache->size + 1) * 2 > 1 << cache->bits && client_cache_grow(cache) < 0) {
+        return -1;
+    }
+
+    int mask = (1 << cache->bits) - 1;
+    int i = client_cache_slot(cache, id);
+
+    while (cache->slots[i].id != 0 && cache->slots[i].id != id) {
+        i = (i + 1) & mask;
+    }
+
+    if (cache->slots[i].id == 0) {
+        cache->slots[i].id = id;
+        cache->size++;
+    }
+
+    strncpy(cache->slots[i].name, name, 15);
+    cache->slots[i].name[15] = 0;
+    return 0;
+}
+
+//Removes the client, copying it to removed first. Shifts the rest of the probe run back into the hole instead of
+//leaving a tombstone, so lookups never slow down. Returns 0 if the client wasn't cached.
+int client_cache_remove(ClientCache *cache, unsigned id, Client *removed) {
+    int mask = (1 << cache->bits) - 1;
+    Client *hole = client_cache_get(cache, id);
+
+    if (hole == NULL) {
+        return 0;
+    }
+
+    *removed = *hole;
+    int h = (int) (hole - cache->slots);
+
+    for (int i = (h + 1) & mask; cache->slots[i].id != 0; i = (i + 1) & mask) {
+        int home = client_cache_slot(cache, cache->slots[i].id);
+
+        //An entry can move back to the hole unless its home lies after the hole in the run.
+        if (((i - home) & mask) >= ((i - h) & mask)) {
+            cache->slots[h] = cache->slots[i];
+            h = i;
+        }
+    }
+
+    cache->slots[h].id = 0;
+    cache->size--;
+    return 1;
+}
+
+int client_cache_grow(ClientCache *cache) {
+    Client *old = cache->slots;
+    int old_capacity = 1 << cache->bits;
+    Client *slots = calloc((size_t) old_capacity * 2, sizeof(Client));
+
+    if (slots == NULL) {
+        fprintf(stderr, "Out of memory (client_cache_grow).\n");
+        return -1;
+    }
+
+    cache->slots = slots;
+    cache->bits++;
+
+    int mask = (1 << cache->bits) - 1;
+
+    for (int i = 0; i < old_capacity; i++) {
+        if (old[i].id != 0) {
+            int j = client_cache_slot(cache, old[i].id);
+
+            while (slots[j].id != 0) {
+                j = (j + 1) & mask;
+            }
+
+            slots[j] = old[i];
+        }
+    }
+
+    free(old);
+    return 0;
+}
+
+void client_cache_free(ClientCache *cache) {
+    if (cache == NULL) {
+        fprintf(stderr, "Passed in cache was NULL (client_cache_free).\n");
+        return;
+    }
+
+    free(cache->slots);
+    free(cache);
+}
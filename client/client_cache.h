@@ -0,0 +1,25 @@
+#ifndef CHATSERVER_CLIENT_CACHE_H
+#define CHATSERVER_CLIENT_CACHE_H
+
+#include "client.h"
+
+//Names of the other clients by ID, stored in the slots themselves so a lookup touches one cache line and a rename
+//doesn't allocate. Open addressing with linear probing, a power of two slots kept at most half full. A slot with ID 0
+//is empty, the server never names a client 0.
+typedef struct client_cache {
+    Client *slots;
+    int bits;
+    int size;
+} ClientCache;
+
+ClientCache *client_cache_create(int capacity);
+
+Client *client_cache_get(ClientCache *cache, unsigned id);
+
+int client_cache_put(ClientCache *cache, unsigned id, const char *name);
+
+int client_cache_remove(ClientCache *cache, unsigned id, Client *removed);
+
+void client_cache_free(ClientCache *cache);
+
+#endif //CHATSERVER_CLIENT_CACHE_H
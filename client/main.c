@@ -1,60 +1,90 @@
 #include <stdio.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
 #include <stdbool.h>
+#include <time.h>
 #include <unistd.h>
 #include "../list.h"
 #include "../buffer.h"
-#include "client.h"
-
-#define CHAT_PACKET 0x00
-#define LOGIN_PACKET 0x01
-#define LOGOUT_PACKET 0x02
-#define COMMAND_PACKET 0x03
-#define NID_PACKET 0x04
-
-#define SWITCH_COMMAND 0x00
-#define LIST_COMMAND 0x01
-
-#define GLOBAL_CHANNEL 'g'
-#define IOS_CHANNEL 'i'
-#define ANDROID_CHANNEL 'a'
-#define PRIVATE_CHANNEL 'p'
-#define SERVER_CHANNEL 's'
-
-fd_set wfd;
+#include "../packet.h"
+#include "../compress.h"
+#include "client_cache.h"
+
+//Packets are read from the server in blocks of up to this many bytes, a history chunk's packets are the largest.
+#define READ_BLOCK_SIZE (64 * 1024)
+//Lines are read from stdin in blocks of up to this many bytes in pipe mode
+#define INPUT_BLOCK_SIZE (64 * 1024)
+#define WRITEV_MAX_PACKETS 256
+//A pipe stops reading stdin while more than this is waiting to be written
+#define PIPE_QUEUE_MAX (1024 * 1024)
+
+fd_set rfd, wfd;
 int sock, running = 1;
+struct sockaddr_in server_addr;
+//Negotiated with the server, until it answers chat messages use fixed size packets
+int features = 0, max_message = CHAT_MESSAGE_SIZE;
+//Set until the server answers our features. Input waits for the answer, a server that answers anything else is from
+//before features and misread them and the login after them.
+int negotiating = 1;
+//Set once the server turned out to be from before features, we log in again once it closed the first connection
+int legacy = 0;
+//--pipe, for scripts: stdin is read in blocks of lines and stdout only gets events, see pipe_print_chat
+int pipe_mode = 0, stdin_open = 1;
+//Bytes of the packets in write_queue not written yet
+int queued_bytes = 0;
+//Where notices for the user go, stderr in pipe mode
+FILE *notices;
+Byte read_block[READ_BLOCK_SIZE];
+int read_length = 0;
+char input_block[INPUT_BLOCK_SIZE];
+int input_length = 0;
 char channel = GLOBAL_CHANNEL;
+//Messages of history asked for on login and on each channel switch, 0 for none
+unsigned long history_count = 0;
 char *name;
 List *write_queue;
-List *client_cache;
+ClientCache *client_cache;
 Buffer *read_packet;
+//Our half of the server's compressed stream, created with the first compressed packet
+Decompressor *decompressor;
 
 void handle_input(char *input);
 
 bool starts_with(const char *pre, const char *str);
 
-Buffer *packet_login_create(char *name);
+void client_quit();
 
-void packet_write(Buffer *packet);
+void server_connect();
+
+void server_fallback();
+
+void packet_queue(Buffer *packet);
 
 void do_write();
 
 void do_read();
 
-Buffer *packet_buffer_create(Byte packetId);
+void pipe_read_input();
+
+void pipe_print_field(const char *str, int length);
 
-void packet_read(Buffer *packet);
+void pipe_print_chat(char chat_channel, unsigned from_id, Client *client, const char *msg, int length);
 
 void packet_process(Buffer *packet);
 
 void process_login_packet();
 
-int client_id_equals(Client *c, int *id);
+unsigned packet_client_id(Buffer *packet);
+
+char *packet_client_name(Buffer *packet);
 
 void process_logout_packet();
 
@@ -62,26 +92,65 @@ void process_chat_packet() ;
 
 void process_nid_packet() ;
 
-Buffer *packet_chat_create(char *msg) ;
+void client_cache_login(unsigned id, const char *client_name);
+
+void client_cache_logout(unsigned id);
+
+void process_presence_packet();
+
+void process_features_packet();
+
+void process_batch_packet();
+
+void process_compressed_packet();
+
+void process_history_packet();
+
+void history_request(Byte mode, unsigned long value);
+
+void packets_process(Byte *data, int length);
+
+Buffer *chat_packet_create(char packet_channel, unsigned to, char *msg);
 
 int main(int argc, char **argv) {
-    fd_set rfd, copy_rfd, copy_wfd;
+    fd_set copy_rfd, copy_wfd;
     char *host;
     char buffer[512];
-    int port;
-    struct sockaddr_in addr;
+    int port, opt;
+
+    static struct option long_options[] = {
+            {"pipe", no_argument, NULL, 'p'},
+            {NULL, 0,             NULL, 0}
+    };
 
     write_queue = list_create();
-    client_cache = list_create();
+    client_cache = client_cache_create(64);
+    notices = stdout;
+
+    while ((opt = getopt_long(argc, argv, "p", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'p':
+                pipe_mode = 1;
+                notices = stderr;
+                break;
+            default:
+                exit(0);
+        }
+    }
 
-    if (argc < 4) {
-        printf("Please input a host, a port, and a name.\n");
+    if (argc - optind < 3) {
+        printf("Usage: %s [--pipe] <host> <port> <name> [history count]\n", argv[0]);
+        printf("Please input a host, a port, a name and optionally how many messages of history to show.\n");
         exit(0);
     }
 
-    host = argv[1];
-    port = atoi(argv[2]);
-    name = argv[3];
+    host = argv[optind];
+    port = atoi(argv[optind + 1]);
+    name = argv[optind + 2];
+
+    if (argc - optind > 3) {
+        history_count = strtoul(argv[optind + 3], NULL, 10);
+    }
 
     if (port == 0) {
         printf("Please input a valid port.");
@@ -93,29 +162,43 @@ int main(int argc, char **argv) {
         exit(0);
     }
 
-    sock = socket(AF_INET, SOCK_STREAM, 0);
+    bzero((char *) &server_addr, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons((uint16_t) port);
+    server_addr.sin_addr.s_addr = inet_addr(host);
 
-    bzero((char *) &addr, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons((uint16_t) port);
-    addr.sin_addr.s_addr = inet_addr(host);
+    FD_ZERO(&rfd);
+    FD_ZERO(&wfd);
+    server_connect();
 
-    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
-        perror("connect");
-        exit(EXIT_FAILURE);
+    //Events are flushed once per block read from the server rather than per line.
+    if (pipe_mode) {
+        setvbuf(stdout, NULL, _IOFBF, READ_BLOCK_SIZE);
     }
 
-    FD_ZERO(&rfd);
-    FD_ZERO(&wfd);
-    FD_SET(0, &rfd);
-    FD_SET(sock, &rfd);
-    FD_SET(sock, &wfd);
+    packet_queue(packet_features_create(FEATURE_FRAMED | FEATURE_BATCH | FEATURE_SESSIONS | FEATURE_ROSTER |
+                                        FEATURE_PRESENCE | FEATURE_HEARTBEAT |
+                                        (compress_available() ? FEATURE_COMPRESS : 0), 0));
+    packet_queue(packet_login_create(name));
 
-    list_add(write_queue, packet_login_create(name));
+    if (history_count != 0) {
+        packet_queue(packet_replay_create(channel, REPLAY_LAST, history_count));
+    }
 
-    printf("Client started and connected!\n");
+    fprintf(notices, "Client started and connected!\n");
 
     while (running) {
+        //A pipe stops reading input while the server is behind, and quits once its input ended and was all sent.
+        if (stdin_open && !negotiating && (!pipe_mode || queued_bytes <= PIPE_QUEUE_MAX)) {
+            FD_SET(0, &rfd);
+        } else {
+            FD_CLR(0, &rfd);
+        }
+
+        if (pipe_mode && !stdin_open && write_queue->size == 0) {
+            client_quit();
+        }
+
         copy_rfd = rfd;
         copy_wfd = wfd;
 
@@ -128,9 +211,14 @@ int main(int argc, char **argv) {
 
         //STDIN Read
         if (FD_ISSET(0, &copy_rfd)) {
-            fgets((char *) &buffer, sizeof(buffer), stdin);
-            buffer[strcspn(buffer, "\n")] = 0;
-            handle_input(buffer);
+            if (pipe_mode) {
+                pipe_read_input();
+            } else if (fgets((char *) &buffer, sizeof(buffer), stdin) == NULL) {
+                stdin_open = 0;
+            } else {
+                buffer[strcspn(buffer, "\n")] = 0;
+                handle_input(buffer);
+            }
         }
 
         //Server Read
@@ -145,78 +233,210 @@ int main(int argc, char **argv) {
     }
 }
 
+void server_connect() {
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (connect(sock, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
+        perror("connect");
+        exit(EXIT_FAILURE);
+    }
+
+    FD_SET(sock, &rfd);
+}
+
+//Starts over without features with a server from before them. What was queued was only for a server that knows
+//them. The first connection is closed from our end only once the server has, it would still be answering the bytes
+//it misread and such a server quits on a failed write.
+void server_fallback() {
+    fprintf(notices, "[NOTICE] The server doesn't support features, logging in again without them.\n");
+
+    if (history_count != 0) {
+        fprintf(notices, "[NOTICE] The server has no history to show.\n");
+    }
+
+    FD_CLR(sock, &wfd);
+    shutdown(sock, SHUT_WR);
+    list_free(write_queue, (void (*)(void *)) &buffer_free);
+    write_queue = list_create();
+    queued_bytes = 0;
+    read_length = 0;
+    legacy = 1;
+}
+
+void client_quit() {
+    fprintf(notices, "Quiting...\n");
+    list_free(write_queue, (void (*)(void *)) &buffer_free);
+    client_cache_free(client_cache);
+    exit(0);
+}
+
+//Reads whatever the server sent and processes every whole packet in it, a partial one waits for the next read.
 void do_read() {
-    if (read_packet == NULL) {
-        Byte packetId = 0x00;
-        int read_bytes = (int) read(sock, &packetId, sizeof(Byte));
+    int read_bytes = (int) read(sock, read_block + read_length, (size_t) (READ_BLOCK_SIZE - read_length));
+    int offset = 0;
 
-        if (read_bytes < 0) {
-            perror("read");
-            exit(EXIT_FAILURE);
-        }
+    if (read_bytes < 0) {
+        perror("read");
+        exit(EXIT_FAILURE);
+    }
 
+    //Whatever the first connection to a server from before features sends is about the bytes it misread.
+    if (legacy && negotiating) {
         if (read_bytes == 0) {
-            printf("Server disconnected! Quiting...\n");
-            exit(0);
+            FD_CLR(sock, &rfd);
+            close(sock);
+            server_connect();
+            packet_queue(packet_login_create(name));
+            negotiating = 0;
         }
 
-        read_packet = packet_buffer_create(packetId);
+        return;
+    }
 
-        if (read_packet == NULL)
-            return;
+    if (read_bytes == 0) {
+        fprintf(notices, "Server disconnected! Quiting...\n");
+        exit(0);
     }
 
-    packet_read(read_packet);
+    read_length += read_bytes;
+
+    while (offset < read_length) {
+        int size = packet_length(read_block + offset, read_length - offset);
+
+        //Skip bytes that don't start a known packet.
+        if (size < 0) {
+            offset++;
+            continue;
+        }
+
+        if (size > READ_BLOCK_SIZE) {
+            fprintf(notices, "Received a malformed packet! Quiting...\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (size == 0 || offset + size > read_length)
+            break;
 
-    if (read_packet->position == read_packet->limit) {
-        buffer_flip(read_packet);
+        //The answer may come in a batch, possibly compressed, with what follows the login.
+        if (negotiating && read_block[offset] != FEATURES_PACKET && read_block[offset] != BATCH_PACKET &&
+            read_block[offset] != COMPRESSED_PACKET) {
+            server_fallback();
+            return;
+        }
+
+        negotiating = 0;
+        Buffer packet = {size, read_block + offset, 0, size};
+        read_packet = &packet;
         packet_process(read_packet);
-        buffer_free(read_packet);
-        read_packet = NULL;
+        offset += size;
+    }
+
+    read_packet = NULL;
+    memmove(read_block, read_block + offset, (size_t) (read_length - offset));
+    read_length -= offset;
+
+    if (pipe_mode) {
+        fflush(stdout);
     }
 }
 
+//Queues a packet for the server, do_write sends everything queued together.
+void packet_queue(Buffer *packet) {
+    list_add(write_queue, packet);
+    queued_bytes += packet->limit - packet->position;
+    FD_SET(sock, &wfd);
+}
+
+//Writes as much of the queue as the socket takes in one gathered write.
 void do_write() {
+    struct iovec iov[WRITEV_MAX_PACKETS];
+    struct msghdr msg;
+    ListIterator iterator = list_iterator(write_queue);
+    int count = 0;
+
     if (write_queue->size == 0) {
         FD_CLR(sock, &wfd);
         return;
     }
 
-    Buffer *packet = list_get(write_queue, 0);
-    packet_write(packet);
+    while (count < WRITEV_MAX_PACKETS && list_has_next(&iterator)) {
+        Buffer *packet = list_next(&iterator);
+        iov[count].iov_base = packet->buffer + packet->position;
+        iov[count].iov_len = (size_t) (packet->limit - packet->position);
+        count++;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t) count;
+
+    int write_bytes = (int) sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    if (write_bytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+
+        perror("sendmsg");
+        exit(EXIT_FAILURE);
+    }
+
+    queued_bytes -= write_bytes;
+
+    //The first packet not written whole keeps its place.
+    while (write_bytes > 0) {
+        Buffer *packet = list_get(write_queue, 0);
+        int remaining = packet->limit - packet->position;
+
+        if (write_bytes < remaining) {
+            packet->position += write_bytes;
+            break;
+        }
 
-    if (packet->position == packet->limit) {
+        write_bytes -= remaining;
         buffer_free(list_remove(write_queue, 0));
     }
 }
 
-void packet_read(Buffer *packet) {
-    int read_bytes;
-
-    read_bytes = (int) read(sock, packet->buffer + packet->position, (size_t) (packet->limit - packet->position));
+//Handles every whole line of a block of stdin, the last partial line waits for the next block. The end of input
+//sends what is left of it as a line.
+void pipe_read_input() {
+    int read_bytes = (int) read(0, input_block + input_length, (size_t) (INPUT_BLOCK_SIZE - 1 - input_length));
+    int start = 0;
 
     if (read_bytes < 0) {
         perror("read");
         exit(EXIT_FAILURE);
     }
 
-    if (read_bytes == 0 && packet->limit != packet->position) {
-        printf("Server disconnected! Quiting...\n");
-        exit(0);
+    if (read_bytes == 0) {
+        stdin_open = 0;
+        input_block[input_length++] = '\n';
     }
 
-    packet->position += read_bytes;
-}
+    input_length += read_bytes;
 
-void packet_write(Buffer *packet) {
-    int write_bytes = (int) write(sock, packet->buffer + packet->position, (size_t) (packet->limit - packet->position));
+    for (char *end; (end = memchr(input_block + start, '\n', (size_t) (input_length - start))) != NULL;
+         start = (int) (end - input_block) + 1) {
+        *end = 0;
 
-    if (write_bytes < 0) {
-        perror("write");
-        exit(EXIT_FAILURE);
+        if (end > input_block + start && end[-1] == '\r') {
+            end[-1] = 0;
+        }
+
+        //Blank lines aren't sent.
+        if (input_block[start] != 0) {
+            handle_input(input_block + start);
+        }
     }
 
-    packet->position += write_bytes;
+    //A line that fills the whole block is too long to send anyway.
+    if (start == 0 && input_length == INPUT_BLOCK_SIZE - 1) {
+        fprintf(notices, "[NOTICE] Dropped a line longer than %d characters.\n", INPUT_BLOCK_SIZE);
+        start = input_length;
+    }
+
+    memmove(input_block, input_block + start, (size_t) (input_length - start));
+    input_length -= start;
 }
 
 void packet_process(Buffer *packet) {
@@ -224,62 +444,90 @@ void packet_process(Buffer *packet) {
 
     switch (packetId) {
         case CHAT_PACKET:
+        case FRAMED_CHAT_PACKET:
+        case SESSION_CHAT_PACKET:
             process_chat_packet();
             break;
         case LOGIN_PACKET:
+        case SESSION_LOGIN_PACKET:
             process_login_packet();
             break;
         case LOGOUT_PACKET:
+        case SESSION_LOGOUT_PACKET:
             process_logout_packet();
             break;
         case COMMAND_PACKET: //Client shouldn't be receiving a command packet.
             break;
         case NID_PACKET:
+        case SESSION_NID_PACKET:
+        case ROSTER_PACKET:
             process_nid_packet();
             break;
+        case FEATURES_PACKET:
+            process_features_packet();
+            break;
+        case BATCH_PACKET:
+            process_batch_packet();
+            break;
+        case COMPRESSED_PACKET:
+            process_compressed_packet();
+            break;
+        case PRESENCE_PACKET:
+            process_presence_packet();
+            break;
+        case HISTORY_PACKET:
+            process_history_packet();
+            break;
+        case PING_PACKET: //The server checking we are still here.
+            packet_queue(packet_ping_create());
+            break;
         default:
             break;
     }
 }
 
 void process_chat_packet() {
-    Client *client = NULL;
-    char channel = buffer_get_at(read_packet, 1);
-    int from_id = buffer_get_at(read_packet, 2);
-    char *msg = (char *) (read_packet->buffer + 4);
+    int offset, message;
+    int length = packet_chat_fields(read_packet->buffer, &offset, &message);
+    char channel = buffer_get_at(read_packet, offset);
+    unsigned from_id = buffer_get_at(read_packet, 0) == SESSION_CHAT_PACKET ?
+                       session_get(read_packet->buffer + offset + 1) : buffer_get_at(read_packet, offset + 1);
+    char *msg = (char *) (read_packet->buffer + message);
 
-    int index = list_contains(client_cache, &from_id, (int (*)(void *, void *)) &client_id_equals);
+    Client *client = client_cache_get(client_cache, from_id);
 
-    if (index > -1)
-        client = list_get(client_cache, index);
+    if (pipe_mode) {
+        pipe_print_chat(channel, from_id, client, msg, length);
+        return;
+    }
 
     switch (channel) {
         case PRIVATE_CHANNEL:
             if (client != NULL)
-                printf("%s(%d)->%s : %s\n", client->name, client->id, name, msg);
+                printf("%s(%u)->%s : %.*s\n", client->name, client->id, name, length, msg);
             else
-                printf("%d->%s : %s\n", from_id, name, msg);
+                printf("%u->%s : %.*s\n", from_id, name, length, msg);
             break;
         case GLOBAL_CHANNEL:
             if (client != NULL)
-                printf("[GLOBAL] %s(%d) : %s\n", client->name, client->id, msg);
+                printf("[GLOBAL] %s(%u) : %.*s\n", client->name, client->id, length, msg);
             else
-                printf("[GLOBAL] %d : %s\n", from_id, msg);
+                printf("[GLOBAL] %u : %.*s\n", from_id, length, msg);
             break;
         case ANDROID_CHANNEL:
             if (client != NULL)
-                printf("[Android] %s(%d) : %s\n", client->name, client->id, msg);
+                printf("[Android] %s(%u) : %.*s\n", client->name, client->id, length, msg);
             else
-                printf("[Android] %d : %s\n", from_id, msg);
+                printf("[Android] %u : %.*s\n", from_id, length, msg);
             break;
         case IOS_CHANNEL:
             if (client != NULL)
-                printf("[iOS] %s(%d) : %s\n", client->name, client->id, msg);
+                printf("[iOS] %s(%u) : %.*s\n", client->name, client->id, length, msg);
             else
-                printf("[iOS] %d : %s\n", from_id, msg);
+                printf("[iOS] %u : %.*s\n", from_id, length, msg);
             break;
         case SERVER_CHANNEL:
-            printf("[SERVER] : %s\n", msg);
+            printf("[SERVER] : %.*s\n", length, msg);
             break;
         default:
             break;
@@ -287,149 +535,235 @@ void process_chat_packet() {
 }
 
 void process_login_packet() {
-    Byte client_id = buffer_get_at(read_packet, 1);
-    char *client_name = (char *) (read_packet->buffer + 2);
+    client_cache_login(packet_client_id(read_packet), packet_client_name(read_packet));
+}
+
+void process_logout_packet() {
+    client_cache_logout(packet_client_id(read_packet));
+}
+
+//The logins and logouts of one presence window.
+void process_presence_packet() {
+    unsigned length, session;
+    int online;
+    Byte id;
+    char client_name[16];
 
-    Client *client = malloc(sizeof(Client));
-    memset(client, 0, sizeof(Client));
+    int offset = 1 + varint_get(read_packet->buffer + 1, VARINT_MAX_BYTES, &length);
+    int end = offset + (int) length;
 
-    client->id = client_id;
+    while (offset < end) {
+        int size = packet_presence_entry_get(read_packet->buffer + offset, end - offset, &online, &session, &id,
+                                             client_name);
+
+        if (size < 0) {
+            fprintf(notices, "Received a malformed packet! Quiting...\n");
+            exit(EXIT_FAILURE);
+        }
 
-    for (int i = 0; i < 15; i++) {
-        client->name[i] = client_name[i];
+        if (online) {
+            client_cache_login(features & FEATURE_SESSIONS ? session : id, client_name);
+        } else {
+            client_cache_logout(features & FEATURE_SESSIONS ? session : id);
+        }
+
+        offset += size;
     }
+}
 
-    int index = list_contains(client_cache, &client->id, (int (*)(void *, void *)) &client_id_equals);
+//Takes a single NID packet or a whole roster snapshot.
+void process_nid_packet() {
+    unsigned length, session;
+    Byte id;
+    char client_name[16];
 
-    if (index > -1) {
-        Client *client2 = list_remove(client_cache, index);
-        free(client2);
+    if (buffer_get_at(read_packet, 0) != ROSTER_PACKET) {
+        client_cache_put(client_cache, packet_client_id(read_packet), packet_client_name(read_packet));
+        return;
     }
 
-    list_add(client_cache, client);
-    printf("[NOTICE] %s logged in.\n", client->name);
-}
+    int offset = 1 + varint_get(read_packet->buffer + 1, VARINT_MAX_BYTES, &length);
+    int end = offset + (int) length;
 
-void process_logout_packet() {
-    int client_id = buffer_get_at(read_packet, 1);
+    while (offset < end) {
+        int size = packet_roster_entry_get(read_packet->buffer + offset, end - offset, &session, &id, client_name);
 
-    int index = list_contains(client_cache, &client_id, (int (*)(void *, void *)) &client_id_equals);
+        if (size < 0) {
+            fprintf(notices, "Received a malformed packet! Quiting...\n");
+            exit(EXIT_FAILURE);
+        }
 
-    if (index > -1) {
-        Client *client = list_remove(client_cache, index);
-        printf("[NOTICE] %s logged out.\n", client->name);
-        free(client);
+        client_cache_put(client_cache, features & FEATURE_SESSIONS ? session : id, client_name);
+        offset += size;
     }
 }
 
-void process_nid_packet() {
-    Byte client_id = buffer_get_at(read_packet, 1);
-    char *client_name = (char *) (read_packet->buffer + 2);
+//Caches the client, or renames it if it logged in again.
+void client_cache_login(unsigned id, const char *client_name) {
+    client_cache_put(client_cache, id, client_name);
+
+    if (pipe_mode) {
+        printf("login\t%u", id);
+        pipe_print_field(client_name, (int) strnlen(client_name, 15));
+        putchar('\n');
+    } else {
+        printf("[NOTICE] %.15s logged in.\n", client_name);
+    }
+}
 
-    Client *client = malloc(sizeof(Client));
-    memset(client, 0, sizeof(Client));
+void client_cache_logout(unsigned id) {
+    Client client;
 
-    client->id = client_id;
+    if (!client_cache_remove(client_cache, id, &client))
+        return;
 
-    for (int i = 0; i < 15; i++) {
-        client->name[i] = client_name[i];
+    if (pipe_mode) {
+        printf("logout\t%u", id);
+        pipe_print_field(client.name, (int) strlen(client.name));
+        putchar('\n');
+    } else {
+        printf("[NOTICE] %s logged out.\n", client.name);
     }
+}
 
-    int index = list_contains(client_cache, &client->id, (int (*)(void *, void *)) &client_id_equals);
+void process_features_packet() {
+    features = buffer_get_at(read_packet, 1);
 
-    if (index > -1) {
-        Client *client2 = list_remove(client_cache, index);
-        free(client2);
+    if (features & (FEATURE_FRAMED | FEATURE_SESSIONS)) {
+        max_message = buffer_get_at(read_packet, 2) << 8 | buffer_get_at(read_packet, 3);
     }
-
-    list_add(client_cache, client); 
 }
 
-int client_id_equals(Client *c, int *id) {
-    if (c->id == *id)
-        return 1;
-    return 0;
+void process_batch_packet() {
+    unsigned length;
+    int offset = 1 + varint_get(read_packet->buffer + 1, VARINT_MAX_BYTES, &length);
+
+    packets_process(read_packet->buffer + offset, (int) length);
 }
 
-Buffer *packet_buffer_create(Byte packetId) {
-    Buffer *result;
+void process_compressed_packet() {
+    Byte packets[COMPRESS_MAX_CONTENTS];
+    unsigned length;
+    int offset = 1 + varint_get(read_packet->buffer + 1, VARINT_MAX_BYTES, &length);
+    int size = -1;
 
-    switch (packetId) {
-        case CHAT_PACKET: //Chat Message
-            result = buffer_create(44);
-            buffer_put(result, packetId);
-            return result;
-        case LOGIN_PACKET: //Login
-            result = buffer_create(17);
-            buffer_put(result, packetId);
-            return result;
-        case LOGOUT_PACKET: //Logout
-            result = buffer_create(2);
-            buffer_put(result, packetId);
-            return result;
-        case COMMAND_PACKET: //Command
-            result = buffer_create(3);
-            buffer_put(result, packetId);
-            return result;
-        case NID_PACKET: //Name/ID Request/Reply
-            result = buffer_create(17);
-            buffer_put(result, packetId);
-            return result;
-        default:
-            return NULL;
+    if (decompressor == NULL)
+        decompressor = decompressor_create();
+
+    if (decompressor != NULL)
+        size = decompressor_decompress(decompressor, read_packet->buffer + offset, (int) length, packets,
+                                       sizeof(packets));
+
+    if (size < 0) {
+        fprintf(notices, "Received a malformed packet! Quiting...\n");
+        exit(EXIT_FAILURE);
     }
 
-    return NULL;
+    packets_process(packets, size);
 }
 
-Buffer *packet_login_create(char *name) {
-    Buffer *packet = packet_buffer_create(LOGIN_PACKET);
-    buffer_put(packet, 0xFF);
-
-    int name_len = (int) strlen(name);
+//A logged chat message, shown after its sequence number and the time it was sent.
+void process_history_packet() {
+    unsigned length;
+    char stamp[16];
+    int offset = 1 + varint_get(read_packet->buffer + 1, VARINT_MAX_BYTES, &length);
 
-    for (int i = 0; i < name_len; i++) {
-        buffer_put(packet, (Byte) name[i]);
+    if (length < HISTORY_FIELDS) {
+        fprintf(notices, "Received a malformed packet! Quiting...\n");
+        exit(EXIT_FAILURE);
     }
 
-    if (name_len < 15) {
-        for (int i = name_len; i < 15; i++) {
-            buffer_put(packet, 0x00);
-        }
+    if (pipe_mode) {
+        printf("history\t%lu\t%lu\t", u64_get(read_packet->buffer + offset), u64_get(read_packet->buffer + offset + 8));
+    } else {
+        time_t sent = (time_t) (u64_get(read_packet->buffer + offset + 8) / 1000);
+        strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&sent));
+        printf("#%lu %s ", u64_get(read_packet->buffer + offset), stamp);
     }
 
-    buffer_flip(packet);
-
-    return packet;
+    packets_process(read_packet->buffer + offset + HISTORY_FIELDS, (int) length - HISTORY_FIELDS);
 }
 
-Buffer *packet_private_chat_create(char *msg, int id) {
-    Buffer *packet = packet_chat_create(msg);
-    buffer_set(packet, 1, (Byte) PRIVATE_CHANNEL);
-    buffer_set(packet, 3, (Byte) id);
-    return packet;
+//A received message as one line of tab separated fields on stdout: chat, the channel, the sender's ID, its name (empty
+//if unknown) and the message. Logins and logouts are printed as login or logout, the ID and the name, history as
+//history, the sequence number and milliseconds since the epoch followed by the chat fields.
+void pipe_print_chat(char chat_channel, unsigned from_id, Client *client, const char *msg, int length) {
+    printf("chat\t%c\t%u", chat_channel, from_id);
+    pipe_print_field(client != NULL ? client->name : "", client != NULL ? (int) strlen(client->name) : 0);
+    pipe_print_field(msg, length);
+    putchar('\n');
 }
 
-Buffer *packet_chat_create(char *msg) {
-    Buffer *packet = packet_buffer_create(CHAT_PACKET);
-    buffer_put(packet, (Byte) channel);
-    buffer_put(packet, 0xFF);
-    buffer_put(packet, 0xFF);
+//Prints a tab and then str with tabs, newlines and backslashes escaped, so a field never splits a line.
+void pipe_print_field(const char *str, int length) {
+    int start = 0;
 
-    int msg_len = (int) strlen(msg);
+    putchar('\t');
 
-    for (int i = 0; i < msg_len; i++) {
-        buffer_put(packet, (Byte) msg[i]);
+    for (int i = 0; i < length; i++) {
+        const char *escape = str[i] == '\t' ? "\\t" : str[i] == '\n' ? "\\n" : str[i] == '\\' ? "\\\\" : NULL;
+
+        if (escape != NULL) {
+            fwrite(str + start, 1, (size_t) (i - start), stdout);
+            fputs(escape, stdout);
+            start = i + 1;
+        }
     }
 
-    if (msg_len < 40) {
-        for (int i = msg_len; i < 40; i++) {
-            buffer_put(packet, 0x00);
+    fwrite(str + start, 1, (size_t) (length - start), stdout);
+}
+
+//Processes each of the whole packets in data as if it had been read on its own.
+void packets_process(Byte *data, int length) {
+    Buffer *outer = read_packet;
+    int offset = 0;
+
+    while (offset < length) {
+        int size = packet_length(data + offset, length - offset);
+
+        if (size <= 0 || offset + size > length) {
+            fprintf(notices, "Received a malformed packet! Quiting...\n");
+            exit(EXIT_FAILURE);
         }
+
+        Buffer packet = {size, data + offset, 0, size};
+        read_packet = &packet;
+        packet_process(read_packet);
+        offset += size;
     }
 
-    buffer_flip(packet);
+    read_packet = outer;
+}
+
+//The ID a login, NID or logout packet is about, a session ID in the session variants.
+unsigned packet_client_id(Buffer *packet) {
+    Byte packetId = buffer_get_at(packet, 0);
+
+    if (packetId == SESSION_LOGIN_PACKET || packetId == SESSION_NID_PACKET || packetId == SESSION_LOGOUT_PACKET)
+        return session_get(packet->buffer + 1);
+
+    return buffer_get_at(packet, 1);
+}
+
+//The name that follows the ID in a login or NID packet.
+char *packet_client_name(Buffer *packet) {
+    Byte packetId = buffer_get_at(packet, 0);
+    return (char *) (packet->buffer + (packetId == SESSION_LOGIN_PACKET || packetId == SESSION_NID_PACKET ? 5 : 2));
+}
+
+//Framed once the server accepted it, so messages are only as long as they need to be. to is SESSION_SERVER for
+//channel messages.
+Buffer *chat_packet_create(char packet_channel, unsigned to, char *msg) {
+    if (features & FEATURE_SESSIONS) {
+        return packet_session_chat_create(packet_channel, to, msg, (int) strlen(msg));
+    }
 
+    if (features & FEATURE_FRAMED) {
+        return packet_framed_chat_create(packet_channel, (Byte) to, msg, (int) strlen(msg));
+    }
+
+    Buffer *packet = packet_chat_create(packet_channel, msg);
+    buffer_set(packet, 3, (Byte) to);
     return packet;
 }
 
@@ -443,17 +777,9 @@ Buffer *packet_command_create(Byte commandId, char channelId) {
     return packet;
 }
 
-void client_free(Client *client) {
-    free(client);
-}
-
 void handle_input(char *input) {
     if (starts_with("/quit", input)) {
-        printf("Quiting...\n");
-        list_free(write_queue, (void (*)(void *)) &buffer_free);
-        list_free(client_cache, (void (*)(void *)) &client_free);
-        buffer_free(read_packet);
-        exit(0);
+        client_quit();
     }
 
     if(starts_with("/msg", input)) {
@@ -461,24 +787,22 @@ void handle_input(char *input) {
         char *str_id = strsep(&input, " ");
 
         if(str_id == NULL) {
-            printf("[NOTICE] Usage: /msg [id] [msg]\n");
+            fprintf(notices, "[NOTICE] Usage: /msg [id] [msg]\n");
             return;
         }
 
-        int id = atoi(str_id);
+        unsigned id = (unsigned) strtoul(str_id, NULL, 10);
 
         if(id == 0) {
-            printf("[NOTICE] Usage: /msg [id] [msg]\n");
+            fprintf(notices, "[NOTICE] Usage: /msg [id] [msg]\n");
             return;
         }
 
-        if(strlen(input) > 40) {
-            printf("[NOTICE] You can only send messages of 40 characters of length.\n");
+        if(strlen(input) > max_message) {
+            fprintf(notices, "[NOTICE] You can only send messages of %d characters of length.\n", max_message);
         } else {
-            Buffer *packet = packet_private_chat_create(input, id);
-            list_add(write_queue, packet);
-            if(!FD_ISSET(sock, &wfd))
-                FD_SET(sock, &wfd);
+            Buffer *packet = chat_packet_create(PRIVATE_CHANNEL, id, input);
+            packet_queue(packet);
         }
 
         return;
@@ -489,42 +813,64 @@ void handle_input(char *input) {
         char *input_channel = strsep(&input, " ");
 
         if(input_channel == NULL) {
-            printf("[NOTICE] Usage: /channel [channel]\n");
+            fprintf(notices, "[NOTICE] Usage: /channel [channel]\n");
             return;
         }
 
         if(input_channel[0] != GLOBAL_CHANNEL && input_channel[0] != ANDROID_CHANNEL && input_channel[0] != IOS_CHANNEL) {
-            printf("[NOTICE] Valid channels names: g, i, and a.\n");
+            fprintf(notices, "[NOTICE] Valid channels names: g, i, and a.\n");
             return;
         }
 
         Buffer *packet = packet_command_create(SWITCH_COMMAND, input_channel[0]);
         channel = input_channel[0];
-        list_add(write_queue, packet);
-        if(!FD_ISSET(sock, &wfd))
-            FD_SET(sock, &wfd);
-        printf("[NOTICE] Channel switched to %c\n", input_channel[0]);
+        packet_queue(packet);
+        fprintf(notices, "[NOTICE] Channel switched to %c\n", input_channel[0]);
+
+        if(history_count != 0)
+            history_request(REPLAY_LAST, history_count);
+        return;
+    }
+
+    if(starts_with("/history", input)) {
+        strsep(&input, " ");
+        char *count = strsep(&input, " ");
+
+        if(count != NULL && strcmp(count, "since") == 0) {
+            char *seq = strsep(&input, " ");
+
+            if(seq == NULL) {
+                fprintf(notices, "[NOTICE] Usage: /history [count] or /history since [seq]\n");
+                return;
+            }
+
+            history_request(REPLAY_SINCE, strtoul(seq, NULL, 10));
+        } else {
+            history_request(REPLAY_LAST, count == NULL ? 20 : strtoul(count, NULL, 10));
+        }
+
         return;
     }
 
     if(starts_with("/list", input)) {
         Buffer *packet = packet_command_create(LIST_COMMAND, channel);
-        list_add(write_queue, packet);
-        if(!FD_ISSET(sock, &wfd))
-            FD_SET(sock, &wfd);
+        packet_queue(packet);
         return;
     }
 
-    if(strlen(input) > 40) {
-        printf("[NOTICE] You can only send messages of 40 characters of length.\n");
+    if(strlen(input) > max_message) {
+        fprintf(notices, "[NOTICE] You can only send messages of %d characters of length.\n", max_message);
     } else {
-        Buffer *packet = packet_chat_create(input);
-        list_add(write_queue, packet);
-        if(!FD_ISSET(sock, &wfd))
-            FD_SET(sock, &wfd);
+        Buffer *packet = chat_packet_create(channel, SESSION_SERVER, input);
+        packet_queue(packet);
     }
 }
 
+//Asks for history of the current channel, see REPLAY_LAST and REPLAY_SINCE.
+void history_request(Byte mode, unsigned long value) {
+    packet_queue(packet_replay_create(channel, mode, value));
+}
+
 bool starts_with(const char *pre, const char *str) {
     size_t lenpre = strlen(pre), lenstr = strlen(str);
     return lenstr < lenpre ? false : strncmp(pre, str, lenpre) == 0;
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//zlib declares its own Byte, it has to come before the Byte macro in buffer.h.
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "compress.h"
+
+#ifdef HAVE_ZLIB
+
+//A 4KB window and small hash tables keep a stream to about 40KB, there is one per connection.
+#define COMPRESS_WINDOW_BITS 12
+#define COMPRESS_MEM_LEVEL 5
+#define COMPRESS_LEVEL 6
+
+struct compressor {
+    z_stream stream;
+};
+
+struct decompressor {
+    z_stream stream;
+};
+
+//Every sync flush ends with this empty stored block, it is left off the wire and put back before inflating.
+static const Byte flush_tail[4] = {0x00, 0x00, 0xFF, 0xFF};
+
+//Text both ends expect to see often, deflate reaches the end of the dictionary with the shortest distances so the
+//most common goes last. Both ends must use the same bytes, changing them needs a new feature bit.
+static const char dictionary[] =
+        "http://https://www. .com .org .net :) :( :D lol haha thanks thank you please sorry okay "
+        "what when where which would could should because about there their they them this that with from have "
+        "just like know think really right going good great time people today tomorrow yesterday morning night "
+        "hello hi hey bye see you later anyone everyone here ios android global private server "
+        "logged in. logged out. is not online. Send Login Packet "
+        "\x00g\xff\xff\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
+        "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x06g\xff\xff"
+        " the a to and of is it in I you for on";
+
+int compress_available() {
+    return 1;
+}
+
+Compressor *compressor_create() {
+    Compressor *compressor = malloc(sizeof(Compressor));
+    memset(compressor, 0, sizeof(Compressor));
+
+    if (deflateInit2(&compressor->stream, COMPRESS_LEVEL, Z_DEFLATED, -COMPRESS_WINDOW_BITS, COMPRESS_MEM_LEVEL,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "Failed to set up deflate (compressor_create).\n");
+        free(compressor);
+        return NULL;
+    }
+
+    deflateSetDictionary(&compressor->stream, (const Bytef *) dictionary, sizeof(dictionary) - 1);
+    return compressor;
+}
+
+//Compresses data as the next part of the stream, returns the bytes written to out or -1. After a failure the
+//stream no longer matches the other end's.
+int compressor_compress(Compressor *compressor, const Byte *data, int length, Byte *out, int out_size) {
+    z_stream *stream = &compressor->stream;
+
+    stream->next_in = (Bytef *) data;
+    stream->avail_in = (uInt) length;
+    stream->next_out = out;
+    stream->avail_out = (uInt) out_size;
+
+    //Running out of output space could leave the flush unfinished.
+    if (deflate(stream, Z_SYNC_FLUSH) != Z_OK || stream->avail_in != 0 || stream->avail_out == 0) {
+        fprintf(stderr, "Failed to compress %d bytes (compressor_compress).\n", length);
+        return -1;
+    }
+
+    return out_size - (int) stream->avail_out - (int) sizeof(flush_tail);
+}
+
+void compressor_free(Compressor *compressor) {
+    if (compressor == NULL) {
+        fprintf(stderr, "Passed in compressor was NULL (compressor_free).\n");
+        return;
+    }
+
+    deflateEnd(&compressor->stream);
+    free(compressor);
+}
+
+Decompressor *decompressor_create() {
+    Decompressor *decompressor = malloc(sizeof(Decompressor));
+    memset(decompressor, 0, sizeof(Decompressor));
+
+    if (inflateInit2(&decompressor->stream, -COMPRESS_WINDOW_BITS) != Z_OK) {
+        fprintf(stderr, "Failed to set up inflate (decompressor_create).\n");
+        free(decompressor);
+        return NULL;
+    }
+
+    //A raw stream takes its dictionary up front.
+    inflateSetDictionary(&decompressor->stream, (const Bytef *) dictionary, sizeof(dictionary) - 1);
+    return decompressor;
+}
+
+//Decompresses the next part of the stream, returns the bytes written to out or -1 if it is corrupt or doesn't fit.
+int decompressor_decompress(Decompressor *decompressor, const Byte *data, int length, Byte *out, int out_size) {
+    z_stream *stream = &decompressor->stream;
+    const Byte *inputs[2] = {data, flush_tail};
+    int lengths[2] = {length, sizeof(flush_tail)};
+
+    stream->next_out = out;
+    stream->avail_out = (uInt) out_size;
+
+    for (int i = 0; i < 2; i++) {
+        stream->next_in = (Bytef *) inputs[i];
+        stream->avail_in = (uInt) lengths[i];
+
+        int result = inflate(stream, Z_SYNC_FLUSH);
+
+        if ((result != Z_OK && result != Z_BUF_ERROR) || stream->avail_in != 0) {
+            fprintf(stderr, "Failed to decompress %d bytes (decompressor_decompress).\n", length);
+            return -1;
+        }
+    }
+
+    return out_size - (int) stream->avail_out;
+}
+
+void decompressor_free(Decompressor *decompressor) {
+    if (decompressor == NULL) {
+        fprintf(stderr, "Passed in decompressor was NULL (decompressor_free).\n");
+        return;
+    }
+
+    inflateEnd(&decompressor->stream);
+    free(decompressor);
+}
+
+#else
+
+int compress_available() {
+    return 0;
+}
+
+Compressor *compressor_create() {
+    return NULL;
+}
+
+int compressor_compress(Compressor *compressor, const Byte *data, int length, Byte *out, int out_size) {
+    return -1;
+}
+
+void compressor_free(Compressor *compressor) {
+
+}
+
+Decompressor *decompressor_create() {
+    return NULL;
+}
+
+int decompressor_decompress(Decompressor *decompressor, const Byte *data, int length, Byte *out, int out_size) {
+    return -1;
+}
+
+void decompressor_free(Decompressor *decompressor) {
+
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef CHATSERVER_COMPRESS_H
+#define CHATSERVER_COMPRESS_H
+
+#include "buffer.h"
+
+//Largest packet that is compressed, whatever a compressed packet holds fits in a buffer of this size.
+#define COMPRESS_MAX_CONTENTS 4096
+//Deflate output for COMPRESS_MAX_CONTENTS bytes is never larger than this.
+#define COMPRESS_BOUND (COMPRESS_MAX_CONTENTS + 64)
+
+//One direction of a connection's compressed stream, every packet continues the previous one so repeated text is
+//sent once. Both ends start from the same built in dictionary. Without zlib the create functions return NULL.
+typedef struct compressor Compressor;
+typedef struct decompressor Decompressor;
+
+int compress_available();
+
+Compressor *compressor_create();
+
+int compressor_compress(Compressor *compressor, const Byte *data, int length, Byte *out, int out_size);
+
+void compressor_free(Compressor *compressor);
+
+Decompressor *decompressor_create();
+
+int decompressor_decompress(Decompressor *decompressor, const Byte *data, int length, Byte *out, int out_size);
+
+void decompressor_free(Decompressor *decompressor);
+
+#endif //CHATSERVER_COMPRESS_H
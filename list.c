@@ -2,11 +2,16 @@
 #include <malloc.h>
 #include <stdio.h>
 #include "list.h"
+#include "pool.h"
 
 //Function Declarations
 Node *node_create();
 
-Node *list_get_last_node(List *list);
+void node_free(Node *node);
+
+void deque_grow(Deque *deque);
+
+__thread Pool node_pool = POOL_INITIALIZER("node", sizeof(Node), 1024);
 
 //Function Implementations
 List *list_create() {
@@ -24,10 +29,10 @@ void list_add(List *list, void *value) {
     if (list->size == 0) {
         list->head = node;
     } else {
-        Node *last = list_get_last_node(list);
-        last->next = node;
+        list->tail->next = node;
     }
 
+    list->tail = node;
     list->size++;
 }
 
@@ -84,9 +89,13 @@ void *list_remove(List *list, int index) {
         prev->next = cur->next;
     }
 
+    if (cur == list->tail) {
+        list->tail = prev;
+    }
+
     list->size--;
     void *result = cur->value;
-    free(cur);
+    node_free(cur);
     return result;
 }
 
@@ -107,9 +116,13 @@ void *list_remove_value(List *list, void *value, int (*equals)(void *, void *))
                 prev->next = cur->next;
             }
 
+            if (cur == list->tail) {
+                list->tail = prev;
+            }
+
             list->size--;
             void *result = cur->value;
-            free(cur);
+            node_free(cur);
             return result;
         }
 
@@ -131,9 +144,26 @@ void list_for_each(List *list, void (*apply)(void *)) {
         if(cur->value) {
             apply(cur->value);
         }
+
+        cur = cur->next;
     }
 }
 
+ListIterator list_iterator(List *list) {
+    ListIterator iterator = {list->size == 0 ? NULL : list->head};
+    return iterator;
+}
+
+int list_has_next(ListIterator *iterator) {
+    return iterator->next != NULL;
+}
+
+void *list_next(ListIterator *iterator) {
+    Node *cur = iterator->next;
+    iterator->next = cur->next;
+    return cur->value;
+}
+
 void list_free(List *list, void (*free_value)(void *)) {
     if (list->size == 0) {
         free(list);
@@ -149,30 +179,176 @@ void list_free(List *list, void (*free_value)(void *)) {
 
         prev = cur;
         cur = cur->next;
-        free(prev);
+        node_free(prev);
     }
 
     free(list);
 }
 
+Deque *deque_create(int capacity) {
+    Deque *deque = malloc(sizeof(Deque));
+
+    //Capacity is kept a power of two so indexes wrap with a mask.
+    deque->capacity = 4;
+    while (deque->capacity < capacity) {
+        deque->capacity *= 2;
+    }
+
+    deque->items = malloc(deque->capacity * sizeof(void *));
+    deque->head = 0;
+    deque->size = 0;
+    return deque;
+}
+
+void deque_push_back(Deque *deque, void *value) {
+    if (deque->size == deque->capacity) {
+        deque_grow(deque);
+    }
+
+    deque->items[(deque->head + deque->size) & (deque->capacity - 1)] = value;
+    deque->size++;
+}
+
+void deque_push_front(Deque *deque, void *value) {
+    if (deque->size == deque->capacity) {
+        deque_grow(deque);
+    }
+
+    deque->head = (deque->head - 1) & (deque->capacity - 1);
+    deque->items[deque->head] = value;
+    deque->size++;
+}
+
+void *deque_peek_front(Deque *deque) {
+    if (deque->size == 0) {
+        return NULL;
+    }
+
+    return deque->items[deque->head];
+}
+
+void *deque_pop_front(Deque *deque) {
+    if (deque->size == 0) {
+        fprintf(stderr, "The deque is empty (deque_pop_front).\n");
+        return NULL;
+    }
+
+    void *result = deque->items[deque->head];
+    deque->head = (deque->head + 1) & (deque->capacity - 1);
+    deque->size--;
+    return result;
+}
+
+void *deque_pop_back(Deque *deque) {
+    if (deque->size == 0) {
+        fprintf(stderr, "The deque is empty (deque_pop_back).\n");
+        return NULL;
+    }
+
+    deque->size--;
+    return deque->items[(deque->head + deque->size) & (deque->capacity - 1)];
+}
+
+void *deque_get(Deque *deque, int index) {
+    if (deque->size <= index) {
+        fprintf(stderr, "The passed in index is out of bounds (deque_get).\n");
+        return NULL;
+    }
+
+    return deque->items[(deque->head + index) & (deque->capacity - 1)];
+}
+
+void deque_set(Deque *deque, int index, void *value) {
+    if (deque->size <= index) {
+        fprintf(stderr, "The passed in index is out of bounds (deque_set).\n");
+        return;
+    }
+
+    deque->items[(deque->head + index) & (deque->capacity - 1)] = value;
+}
+
+//Removes the item at index by shifting whichever side of it is shorter, O(n).
+void *deque_remove(Deque *deque, int index) {
+    if (deque->size <= index) {
+        fprintf(stderr, "The passed in index is out of bounds (deque_remove).\n");
+        return NULL;
+    }
+
+    int mask = deque->capacity - 1;
+    void *value = deque->items[(deque->head + index) & mask];
+
+    if (index < deque->size / 2) {
+        for (int i = index; i > 0; i--) {
+            deque->items[(deque->head + i) & mask] = deque->items[(deque->head + i - 1) & mask];
+        }
+
+        deque->head = (deque->head + 1) & mask;
+    } else {
+        for (int i = index; i < deque->size - 1; i++) {
+            deque->items[(deque->head + i) & mask] = deque->items[(deque->head + i + 1) & mask];
+        }
+    }
+
+    deque->size--;
+    return value;
+}
+
+void deque_free(Deque *deque, void (*free_value)(void *)) {
+    if (free_value != NULL) {
+        for (int i = 0; i < deque->size; i++) {
+            free_value(deque_get(deque, i));
+        }
+    }
+
+    free(deque->items);
+    free(deque);
+}
+
+//An unlinked Link points at itself, so removing it again is harmless.
+void link_init(Link *link) {
+    link->prev = link;
+    link->next = link;
+}
+
+void link_add_tail(Link *head, Link *link) {
+    link->prev = head->prev;
+    link->next = head;
+    head->prev->next = link;
+    head->prev = link;
+}
+
+void link_remove(Link *link) {
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link_init(link);
+}
+
+int link_is_linked(Link *link) {
+    return link->next != link;
+}
+
 //"private" functions
 Node *node_create() {
-    Node *node = malloc(sizeof(Node));
+    Node *node = pool_alloc(&node_pool);
     memset(node, 0, sizeof(Node));
     return node;
 }
 
-Node *list_get_last_node(List *list) {
-    if (list->size == 0) {
-        fprintf(stderr, "The list is empty (list_get_last_node)\n.");
-        return NULL;
-    }
+void node_free(Node *node) {
+    pool_free(&node_pool, node);
+}
 
-    Node *cur = list->head;
+void deque_grow(Deque *deque) {
+    int capacity = deque->capacity * 2;
+    void **items = malloc(capacity * sizeof(void *));
 
-    for (int i = 1; i < list->size; i++) {
-        cur = cur->next;
+    //Unwrap the ring so the items start at index 0 again.
+    for (int i = 0; i < deque->size; i++) {
+        items[i] = deque->items[(deque->head + i) & (deque->capacity - 1)];
     }
 
-    return cur;
+    free(deque->items);
+    deque->items = items;
+    deque->head = 0;
+    deque->capacity = capacity;
 }
@@ -1,6 +1,8 @@
 #ifndef CHATSERVER_LIST_H
 #define CHATSERVER_LIST_H
 
+#include <stddef.h>
+
 typedef struct list_node {
     struct list_node *next;
     void *value;
@@ -8,9 +10,32 @@ typedef struct list_node {
 
 typedef struct linked_list {
     Node *head;
+    Node *tail;
     int size;
 } List;
 
+typedef struct list_iterator {
+    Node *next;
+} ListIterator;
+
+//Growable ring buffer, O(1) at both ends.
+typedef struct deque {
+    void **items;
+    int head;
+    int size;
+    int capacity;
+} Deque;
+
+//Intrusive doubly linked list, embed a Link in the element and use a Link as the list head.
+typedef struct link {
+    struct link *prev;
+    struct link *next;
+} Link;
+
+#define link_entry(link, type, member) ((type *) ((char *) (link) - offsetof(type, member)))
+
+#define link_for_each(cur, head) for ((cur) = (head)->next; (cur) != (head); (cur) = (cur)->next)
+
 List *list_create();
 
 void list_add(List *list, void *value);
@@ -25,6 +50,40 @@ void *list_remove_value(List *list, void *value, int (*equals)(void *, void *));
 
 void list_for_each(List *list, void (*apply)(void *));
 
+ListIterator list_iterator(List *list);
+
+int list_has_next(ListIterator *iterator);
+
+void *list_next(ListIterator *iterator);
+
 void list_free(List *list, void (*free_value)(void *));
 
+Deque *deque_create(int capacity);
+
+void deque_push_back(Deque *deque, void *value);
+
+void deque_push_front(Deque *deque, void *value);
+
+void *deque_peek_front(Deque *deque);
+
+void *deque_pop_front(Deque *deque);
+
+void *deque_pop_back(Deque *deque);
+
+void *deque_get(Deque *deque, int index);
+
+void deque_set(Deque *deque, int index, void *value);
+
+void *deque_remove(Deque *deque, int index);
+
+void deque_free(Deque *deque, void (*free_value)(void *));
+
+void link_init(Link *link);
+
+void link_add_tail(Link *head, Link *link);
+
+void link_remove(Link *link);
+
+int link_is_linked(Link *link);
+
 #endif //CHATSERVER_LIST_H
@@ -0,0 +1,375 @@
+#include <stdio.h>
+#include <string.h>
+#include "packet.h"
+
+int packet_size(Byte packetId) {
+    switch (packetId) {
+        case CHAT_PACKET: //Chat Message
+            return 44;
+        case LOGIN_PACKET: //Login
+            return 17;
+        case LOGOUT_PACKET: //Logout
+            return 2;
+        case COMMAND_PACKET: //Command
+            return 3;
+        case NID_PACKET: //Name/ID Request/Reply
+            return 17;
+        case FEATURES_PACKET: //Features Request/Reply
+            return 4;
+        case SESSION_LOGIN_PACKET: //Login with a session ID
+        case SESSION_NID_PACKET: //Name/Session ID Reply
+            return 20;
+        case SESSION_LOGOUT_PACKET: //Logout with a session ID
+            return 5;
+        case REPLAY_PACKET: //History Request
+            return 11;
+        case PING_PACKET: //Heartbeat
+            return 1;
+        default:
+            return -1;
+    }
+}
+
+//Size of the packet starting at data, length prefixed packets included. Returns 0 if more bytes are needed to tell and -1
+//if data doesn't start a valid packet.
+int packet_length(const Byte *data, int available) {
+    unsigned length;
+
+    if (available < 1) {
+        return 0;
+    }
+
+    if (!packet_is_prefixed(data[0])) {
+        return packet_size(data[0]);
+    }
+
+    int header = varint_get(data + 1, available - 1, &length);
+
+    if (header <= 0) {
+        return header;
+    }
+
+    //Channel, from and to come before a chat's payload.
+    if (data[0] == FRAMED_CHAT_PACKET) {
+        return 1 + header + 3 + (int) length;
+    }
+
+    if (data[0] == SESSION_CHAT_PACKET) {
+        return 1 + header + SESSION_CHAT_FIELDS + (int) length;
+    }
+
+    return 1 + header + (int) length;
+}
+
+int packet_is_chat(Byte packetId) {
+    return packetId == CHAT_PACKET || packetId == FRAMED_CHAT_PACKET || packetId == SESSION_CHAT_PACKET;
+}
+
+//Packets whose length follows the packet ID as a varint.
+int packet_is_prefixed(Byte packetId) {
+    return packetId == FRAMED_CHAT_PACKET || packetId == BATCH_PACKET || packetId == COMPRESSED_PACKET ||
+           packetId == SESSION_CHAT_PACKET || packetId == ROSTER_PACKET || packetId == PRESENCE_PACKET ||
+           packetId == HISTORY_PACKET;
+}
+
+//Little endian base 128, 7 bits per byte and the high bit set on every byte but the last.
+int varint_put(Byte *out, unsigned value) {
+    int count = 0;
+
+    while (value >= 0x80) {
+        out[count++] = (Byte) (value | 0x80);
+        value >>= 7;
+    }
+
+    out[count++] = (Byte) value;
+    return count;
+}
+
+//Returns the bytes used, 0 if the varint is incomplete or -1 if it is longer than VARINT_MAX_BYTES.
+int varint_get(const Byte *data, int available, unsigned *value) {
+    *value = 0;
+
+    for (int i = 0; i < VARINT_MAX_BYTES; i++) {
+        if (i == available) {
+            return 0;
+        }
+
+        *value |= (unsigned) (data[i] & 0x7F) << (7 * i);
+
+        if ((data[i] & 0x80) == 0) {
+            return i + 1;
+        }
+    }
+
+    return -1;
+}
+
+//Finds the fields of a complete chat packet of any encoding: channel, from and to start at *offset and the message at
+//*message. Returns the message length.
+int packet_chat_fields(const Byte *data, int *offset, int *message) {
+    unsigned length;
+
+    if (data[0] == FRAMED_CHAT_PACKET || data[0] == SESSION_CHAT_PACKET) {
+        *offset = 1 + varint_get(data + 1, VARINT_MAX_BYTES, &length);
+        *message = *offset + (data[0] == SESSION_CHAT_PACKET ? SESSION_CHAT_FIELDS : 3);
+        return (int) length;
+    }
+
+    *offset = 1;
+    *message = 4;
+    return (int) strnlen((const char *) data + 4, CHAT_MESSAGE_SIZE);
+}
+
+int packet_framed_chat_size(int length) {
+    Byte header[VARINT_MAX_BYTES];
+    return 1 + varint_put(header, (unsigned) length) + 3 + length;
+}
+
+//Writes a framed chat packet to out, which must have packet_framed_chat_size(length) bytes. Returns that size.
+int packet_framed_chat_encode(Byte *out, char channel, Byte from, Byte to, const char *msg, int length) {
+    int position = 0;
+
+    out[position++] = FRAMED_CHAT_PACKET;
+    position += varint_put(out + position, (unsigned) length);
+    out[position++] = (Byte) channel;
+    out[position++] = from;
+    out[position++] = to;
+    memcpy(out + position, msg, (size_t) length);
+    return position + length;
+}
+
+//Writes a fixed size chat packet to out, messages longer than CHAT_MESSAGE_SIZE are cut short.
+void packet_chat_encode(Byte *out, char channel, Byte from, Byte to, const char *msg, int length) {
+    if (length > CHAT_MESSAGE_SIZE) {
+        length = CHAT_MESSAGE_SIZE;
+    }
+
+    out[0] = CHAT_PACKET;
+    out[1] = (Byte) channel;
+    out[2] = from;
+    out[3] = to;
+    memcpy(out + 4, msg, (size_t) length);
+    memset(out + 4 + length, 0, (size_t) (CHAT_MESSAGE_SIZE - length));
+}
+
+void session_put(Byte *out, unsigned session) {
+    out[0] = (Byte) (session >> 24);
+    out[1] = (Byte) (session >> 16);
+    out[2] = (Byte) (session >> 8);
+    out[3] = (Byte) session;
+}
+
+unsigned session_get(const Byte *data) {
+    return (unsigned) data[0] << 24 | (unsigned) data[1] << 16 | (unsigned) data[2] << 8 | data[3];
+}
+
+int packet_session_chat_size(int length) {
+    Byte header[VARINT_MAX_BYTES];
+    return 1 + varint_put(header, (unsigned) length) + SESSION_CHAT_FIELDS + length;
+}
+
+//Writes a session chat packet to out, which must have packet_session_chat_size(length) bytes. Returns that size.
+int packet_session_chat_encode(Byte *out, char channel, unsigned from, unsigned to, const char *msg, int length) {
+    int position = 0;
+
+    out[position++] = SESSION_CHAT_PACKET;
+    position += varint_put(out + position, (unsigned) length);
+    out[position++] = (Byte) channel;
+    session_put(out + position, from);
+    session_put(out + position + 4, to);
+    position += 8;
+    memcpy(out + position, msg, (size_t) length);
+    return position + length;
+}
+
+Buffer *packet_buffer_create(Byte packetId) {
+    int size = packet_size(packetId);
+
+    if (size < 0) {
+        return NULL;
+    }
+
+    Buffer *result = buffer_create(size);
+    buffer_put(result, packetId);
+    return result;
+}
+
+//Writes a string into a fixed width field, zero padding the remainder.
+static void packet_put_string(Buffer *packet, const char *str, int width) {
+    int len = (int) strnlen(str, (size_t) width);
+
+    for (int i = 0; i < len; i++) {
+        buffer_put(packet, (Byte) str[i]);
+    }
+
+    for (int i = len; i < width; i++) {
+        buffer_put(packet, 0x00);
+    }
+}
+
+Buffer *packet_chat_create(char channel, const char *msg) {
+    Buffer *packet = packet_buffer_create(CHAT_PACKET);
+    buffer_put(packet, (Byte) channel); //Channel
+    buffer_put(packet, 0xFF); //From
+    buffer_put(packet, 0xFF); //To
+    packet_put_string(packet, msg, 40); //Message
+    buffer_flip(packet); //Flip for writing
+    return packet;
+}
+
+Buffer *packet_server_message_create(const char *msg) {
+    if (strlen(msg) > 40) {
+        fprintf(stderr, "Message was truncated. Was: %s | Now: %.40s | (packet_server_message_create)\n", msg, msg);
+    }
+
+    return packet_chat_create(SERVER_CHANNEL, msg);
+}
+
+Buffer *packet_login_create(const char *name) {
+    Buffer *packet = packet_buffer_create(LOGIN_PACKET);
+    buffer_put(packet, 0xFF);
+    packet_put_string(packet, name, 15);
+    buffer_flip(packet);
+    return packet;
+}
+
+Buffer *packet_nid_create(Byte id, const char *name) {
+    Buffer *packet = packet_buffer_create(NID_PACKET);
+    buffer_put(packet, id);
+    packet_put_string(packet, name, 15);
+    buffer_flip(packet);
+    return packet;
+}
+
+Buffer *packet_framed_chat_create(char channel, Byte to, const char *msg, int length) {
+    Buffer *packet = buffer_create(packet_framed_chat_size(length));
+    packet_framed_chat_encode(packet->buffer, channel, 0xFF, to, msg, length);
+    return packet;
+}
+
+Buffer *packet_session_chat_create(char channel, unsigned to, const char *msg, int length) {
+    Buffer *packet = buffer_create(packet_session_chat_size(length));
+    packet_session_chat_encode(packet->buffer, channel, SESSION_SERVER, to, msg, length);
+    return packet;
+}
+
+//A SESSION_LOGIN_PACKET or SESSION_NID_PACKET naming session.
+Buffer *packet_session_id_create(Byte packetId, unsigned session, const char *name) {
+    Buffer *packet = packet_buffer_create(packetId);
+    session_put(packet->buffer + packet->position, session);
+    packet->position += 4;
+    packet_put_string(packet, name, 15);
+    buffer_flip(packet);
+    return packet;
+}
+
+Buffer *packet_session_logout_create(unsigned session) {
+    Buffer *packet = packet_buffer_create(SESSION_LOGOUT_PACKET);
+    session_put(packet->buffer + packet->position, session);
+    packet->position += 4;
+    buffer_flip(packet);
+    return packet;
+}
+
+//Writes one roster entry to out, which must have ROSTER_ENTRY_MAX bytes. Returns the bytes written.
+int packet_roster_entry_put(Byte *out, unsigned session, Byte id, const char *name) {
+    int length = (int) strnlen(name, 15);
+
+    session_put(out, session);
+    out[4] = id;
+    out[5] = (Byte) length;
+    memcpy(out + 6, name, (size_t) length);
+    return 6 + length;
+}
+
+//Reads the roster entry at data, name needs 16 bytes and is terminated. Returns the bytes read, -1 if the entry is
+//cut short or malformed.
+int packet_roster_entry_get(const Byte *data, int available, unsigned *session, Byte *id, char *name) {
+    if (available < 6 || data[5] > 15 || available < 6 + data[5]) {
+        return -1;
+    }
+
+    *session = session_get(data);
+    *id = data[4];
+    memcpy(name, data + 6, data[5]);
+    name[data[5]] = 0;
+    return 6 + data[5];
+}
+
+//Writes one presence entry to out, which must have PRESENCE_ENTRY_MAX bytes. Returns the bytes written.
+int packet_presence_entry_put(Byte *out, int online, unsigned session, Byte id, const char *name) {
+    out[0] = (Byte) (online != 0);
+    return 1 + packet_roster_entry_put(out + 1, session, id, online ? name : "");
+}
+
+//Reads the presence entry at data like packet_roster_entry_get, *online is 1 for a login.
+int packet_presence_entry_get(const Byte *data, int available, int *online, unsigned *session, Byte *id,
+                              char *name) {
+    if (available < 1) {
+        return -1;
+    }
+
+    int size = packet_roster_entry_get(data + 1, available - 1, session, id, name);
+    *online = data[0];
+    return size < 0 ? -1 : 1 + size;
+}
+
+//Writes a presence packet of length bytes of entries to out, which must have PRESENCE_HEADER_MAX + length bytes.
+//Returns the packet's size.
+int packet_presence_put(Byte *out, const Byte *entries, int length) {
+    out[0] = PRESENCE_PACKET;
+    int header = 1 + varint_put(out + 1, (unsigned) length);
+    memcpy(out + header, entries, (size_t) length);
+    return header + length;
+}
+
+void u64_put(Byte *out, unsigned long value) {
+    session_put(out, (unsigned) (value >> 32));
+    session_put(out + 4, (unsigned) value);
+}
+
+unsigned long u64_get(const Byte *data) {
+    return (unsigned long) session_get(data) << 32 | session_get(data + 4);
+}
+
+int packet_history_size(int length) {
+    Byte header[VARINT_MAX_BYTES];
+    return 1 + varint_put(header, (unsigned) (HISTORY_FIELDS + length)) + HISTORY_FIELDS + length;
+}
+
+//Writes a history packet holding the length byte packet to out, which must have packet_history_size(length) bytes.
+//Returns that size.
+int packet_history_put(Byte *out, unsigned long seq, unsigned long time, const Byte *packet, int length) {
+    out[0] = HISTORY_PACKET;
+    int position = 1 + varint_put(out + 1, (unsigned) (HISTORY_FIELDS + length));
+    u64_put(out + position, seq);
+    u64_put(out + position + 8, time);
+    position += HISTORY_FIELDS;
+    memcpy(out + position, packet, (size_t) length);
+    return position + length;
+}
+
+Buffer *packet_replay_create(char channel, Byte mode, unsigned long value) {
+    Buffer *packet = packet_buffer_create(REPLAY_PACKET);
+    buffer_put(packet, (Byte) channel);
+    buffer_put(packet, mode);
+    u64_put(packet->buffer + packet->position, value);
+    packet->position += 8;
+    buffer_flip(packet);
+    return packet;
+}
+
+Buffer *packet_ping_create() {
+    Buffer *packet = packet_buffer_create(PING_PACKET);
+    buffer_flip(packet);
+    return packet;
+}
+
+Buffer *packet_features_create(Byte features, int max_payload) {
+    Buffer *packet = packet_buffer_create(FEATURES_PACKET);
+    buffer_put(packet, features);
+    buffer_put(packet, (Byte) (max_payload >> 8));
+    buffer_put(packet, (Byte) max_payload);
+    buffer_flip(packet);
+    return packet;
+}
@@ -0,0 +1,169 @@
+#ifndef CHATSERVER_PACKET_H
+#define CHATSERVER_PACKET_H
+
+#include "buffer.h"
+
+#define CHAT_PACKET 0x00
+#define LOGIN_PACKET 0x01
+#define LOGOUT_PACKET 0x02
+#define COMMAND_PACKET 0x03
+#define NID_PACKET 0x04
+#define FEATURES_PACKET 0x05
+#define FRAMED_CHAT_PACKET 0x06
+#define BATCH_PACKET 0x07
+#define COMPRESSED_PACKET 0x08
+#define SESSION_CHAT_PACKET 0x09
+#define SESSION_LOGIN_PACKET 0x0A
+#define SESSION_NID_PACKET 0x0B
+#define SESSION_LOGOUT_PACKET 0x0C
+#define ROSTER_PACKET 0x0D
+#define PRESENCE_PACKET 0x0E
+#define HISTORY_PACKET 0x0F
+#define REPLAY_PACKET 0x10
+#define PING_PACKET 0x11
+
+//Bits of a features packet, sent by the client with its login. The server answers with the bits it accepted
+//and the largest framed chat payload it takes, a server that doesn't answer supports none of them.
+#define FEATURE_FRAMED 0x01
+#define FEATURE_BATCH 0x02
+#define FEATURE_COMPRESS 0x04
+#define FEATURE_SESSIONS 0x08
+#define FEATURE_ROSTER 0x10
+#define FEATURE_PRESENCE 0x20
+#define FEATURE_HEARTBEAT 0x40
+
+#define GLOBAL_CHANNEL 'g'
+#define IOS_CHANNEL 'i'
+#define ANDROID_CHANNEL 'a'
+#define PRIVATE_CHANNEL 'p'
+#define SERVER_CHANNEL 's'
+
+#define SWITCH_COMMAND 0x00
+#define LIST_COMMAND 0x01
+
+//Modes of a replay packet
+#define REPLAY_LAST 0x00 //The last n messages of the channel
+#define REPLAY_SINCE 0x01 //Messages from sequence number n on
+
+//Size of the largest fixed size packet, including the packet ID.
+#define PACKET_MAX_SIZE 44
+//Chat message bytes of a fixed size chat packet, zero padded.
+#define CHAT_MESSAGE_SIZE 40
+
+//A framed chat packet is the packet ID, the payload length as a varint, channel, from, to and the payload.
+#define VARINT_MAX_BYTES 3
+#define FRAMED_CHAT_HEADER_MAX (1 + VARINT_MAX_BYTES + 3)
+#define FRAMED_CHAT_MAX_PAYLOAD 0xFFFF
+
+//A batch packet is the packet ID, the length of its contents as a varint, then whole packets back to back. The server
+//sends one in place of the packets a client was sent during one loop iteration, small enough for a 4KB read buffer.
+#define BATCH_HEADER_MAX (1 + VARINT_MAX_BYTES)
+#define BATCH_MAX_CONTENTS (4096 - BATCH_HEADER_MAX)
+
+//With the sessions feature clients are named by 32 bit big endian session IDs instead of one byte IDs, in the session
+//variants of the chat, login, NID and logout packets. A session ID is never reused while the server runs, the one
+//byte IDs are descriptors and are. SESSION_SERVER stands for the server or nobody, like 0xFF does.
+#define SESSION_SERVER 0xFFFFFFFFu
+//A session chat packet is the packet ID, the payload length as a varint, channel, from, to and the payload.
+#define SESSION_CHAT_FIELDS 9
+#define SESSION_CHAT_HEADER_MAX (1 + VARINT_MAX_BYTES + SESSION_CHAT_FIELDS)
+
+//A roster packet is the packet ID, the length of its entries as a varint, then entries of session ID, one byte ID,
+//name length and name. With the roster feature each shard answers a login with roster packets of the clients
+//logged in on it instead of a NID packet per client, later logins and logouts are sent as usual.
+#define ROSTER_HEADER_MAX (1 + VARINT_MAX_BYTES)
+#define ROSTER_MAX_CONTENTS (4096 - ROSTER_HEADER_MAX)
+#define ROSTER_ENTRY_MAX (4 + 1 + 1 + 15)
+
+//A presence packet is laid out like a roster packet with a byte before each entry, 1 for a login and 0 for a
+//logout, which has no name. A server with a presence window sends the logins and logouts of each window together,
+//as presence packets to clients with the presence feature.
+#define PRESENCE_HEADER_MAX ROSTER_HEADER_MAX
+#define PRESENCE_MAX_CONTENTS ROSTER_MAX_CONTENTS
+#define PRESENCE_ENTRY_MAX (1 + ROSTER_ENTRY_MAX)
+
+//A history packet is the packet ID, the length of what follows as a varint, the channel's 64 bit big endian sequence
+//number of the message, milliseconds since the epoch it was logged at, both big endian, then the message as a session
+//chat packet. A server keeping history answers a replay packet (packet ID, channel, mode and a 64 bit big endian
+//count or sequence number) with history packets, oldest first. A replay is cut short after about a write queue's
+//worth and a server message says where to continue from.
+#define HISTORY_FIELDS 16
+
+//A ping packet is just the packet ID. With the heartbeat feature the server pings a client that has been quiet for a
+//heartbeat interval and the client pings back, one that sends nothing for another interval is disconnected.
+
+//A compressed packet is the packet ID, the length of its contents as a varint, then the next part of the
+//connection's deflate stream, which inflates to whole packets. See compress.h.
+
+int packet_size(Byte packetId);
+
+int packet_length(const Byte *data, int available);
+
+int packet_is_chat(Byte packetId);
+
+int packet_is_prefixed(Byte packetId);
+
+int varint_put(Byte *out, unsigned value);
+
+int varint_get(const Byte *data, int available, unsigned *value);
+
+int packet_chat_fields(const Byte *data, int *offset, int *message);
+
+int packet_framed_chat_size(int length);
+
+int packet_framed_chat_encode(Byte *out, char channel, Byte from, Byte to, const char *msg, int length);
+
+void packet_chat_encode(Byte *out, char channel, Byte from, Byte to, const char *msg, int length);
+
+void session_put(Byte *out, unsigned session);
+
+unsigned session_get(const Byte *data);
+
+int packet_session_chat_size(int length);
+
+int packet_session_chat_encode(Byte *out, char channel, unsigned from, unsigned to, const char *msg, int length);
+
+Buffer *packet_buffer_create(Byte packetId);
+
+Buffer *packet_chat_create(char channel, const char *msg);
+
+Buffer *packet_server_message_create(const char *msg);
+
+Buffer *packet_login_create(const char *name);
+
+Buffer *packet_nid_create(Byte id, const char *name);
+
+Buffer *packet_framed_chat_create(char channel, Byte to, const char *msg, int length);
+
+Buffer *packet_features_create(Byte features, int max_payload);
+
+Buffer *packet_session_chat_create(char channel, unsigned to, const char *msg, int length);
+
+Buffer *packet_session_id_create(Byte packetId, unsigned session, const char *name);
+
+Buffer *packet_session_logout_create(unsigned session);
+
+int packet_roster_entry_put(Byte *out, unsigned session, Byte id, const char *name);
+
+int packet_roster_entry_get(const Byte *data, int available, unsigned *session, Byte *id, char *name);
+
+int packet_presence_entry_put(Byte *out, int online, unsigned session, Byte id, const char *name);
+
+int packet_presence_entry_get(const Byte *data, int available, int *online, unsigned *session, Byte *id,
+                              char *name);
+
+int packet_presence_put(Byte *out, const Byte *entries, int length);
+
+void u64_put(Byte *out, unsigned long value);
+
+unsigned long u64_get(const Byte *data);
+
+int packet_history_size(int length);
+
+int packet_history_put(Byte *out, unsigned long seq, unsigned long time, const Byte *packet, int length);
+
+Buffer *packet_replay_create(char channel, Byte mode, unsigned long value);
+
+Buffer *packet_ping_create();
+
+#endif //CHATSERVER_PACKET_H
@@ -0,0 +1,118 @@
+#include <malloc.h>
+#include "pool.h"
+
+#define POOL_ALIGN 16
+
+//Function Declarations
+int pool_grow(Pool *pool);
+
+size_t pool_stride(Pool *pool);
+
+//Its address identifies the calling thread as a pool's owner.
+__thread char pool_thread_tag;
+
+//Every pool of this thread that has allocated a slab, for pool_print_stats.
+__thread Pool *pool_registry = NULL;
+
+//Function Implementations
+void *pool_alloc(Pool *pool) {
+    if (pool->freeList == NULL) {
+        pool->freeList = __atomic_exchange_n(&pool->remoteFree, NULL, __ATOMIC_ACQUIRE);
+    }
+
+    if (pool->freeList == NULL) {
+        pool->misses++;
+
+        if (pool_grow(pool) < 0) {
+            return NULL;
+        }
+    }
+
+    void *object = pool->freeList;
+    pool->freeList = *(void **) object;
+    pool->allocs++;
+    return object;
+}
+
+void pool_free(Pool *pool, void *object) {
+    if (object == NULL) {
+        return;
+    }
+
+    if (pool->owner == &pool_thread_tag) {
+        *(void **) object = pool->freeList;
+        pool->freeList = object;
+        pool->frees++;
+        return;
+    }
+
+    //Freed by another thread, hand it back to the owner.
+    void *head = __atomic_load_n(&pool->remoteFree, __ATOMIC_RELAXED);
+    do {
+        *(void **) object = head;
+    } while (!__atomic_compare_exchange_n(&pool->remoteFree, &head, object, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_add_fetch(&pool->remoteFrees, 1, __ATOMIC_RELAXED);
+}
+
+size_t pool_footprint(Pool *pool) {
+    return pool->slabCount * (POOL_ALIGN + pool->slabObjects * pool_stride(pool));
+}
+
+void pool_print_stats(FILE *out) {
+    for (Pool *pool = pool_registry; pool != NULL; pool = pool->next) {
+        long remoteFrees = __atomic_load_n(&pool->remoteFrees, __ATOMIC_RELAXED);
+        double hitRate = pool->allocs == 0 ? 0.0 : 100.0 * (pool->allocs - pool->misses) / pool->allocs;
+        fprintf(out, "Pool %s: size %zu, in use %ld, allocs %ld, hit rate %.2f%%, slabs %ld, footprint %zu bytes\n",
+                pool->name, pool->objectSize, pool->allocs - pool->frees - remoteFrees, pool->allocs, hitRate,
+                pool->slabCount, pool_footprint(pool));
+    }
+}
+
+//Objects handed out by every pool of this thread, the micro benchmarks use it to count allocations.
+long pool_total_allocs() {
+    long total = 0;
+
+    for (Pool *pool = pool_registry; pool != NULL; pool = pool->next) {
+        total += pool->allocs;
+    }
+
+    return total;
+}
+
+//"private" functions
+int pool_grow(Pool *pool) {
+    size_t stride = pool_stride(pool);
+    char *slab = malloc(POOL_ALIGN + pool->slabObjects * stride);
+
+    if (slab == NULL) {
+        fprintf(stderr, "Out of memory (pool_grow).\n");
+        return -1;
+    }
+
+    //The slab header links every slab of the pool.
+    *(void **) slab = pool->slabs;
+    pool->slabs = slab;
+    pool->slabCount++;
+
+    char *objects = slab + POOL_ALIGN;
+
+    for (int i = pool->slabObjects - 1; i >= 0; i--) {
+        void *object = objects + i * stride;
+        *(void **) object = pool->freeList;
+        pool->freeList = object;
+    }
+
+    if (!pool->registered) {
+        pool->owner = &pool_thread_tag;
+        pool->next = pool_registry;
+        pool_registry = pool;
+        pool->registered = 1;
+    }
+
+    return 0;
+}
+
+size_t pool_stride(Pool *pool) {
+    size_t size = pool->objectSize < sizeof(void *) ? sizeof(void *) : pool->objectSize;
+    return (size + POOL_ALIGN - 1) & ~((size_t) POOL_ALIGN - 1);
+}
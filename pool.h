@@ -0,0 +1,41 @@
+#ifndef CHATSERVER_POOL_H
+#define CHATSERVER_POOL_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+//Fixed size object allocator that carves objects out of larger slabs and recycles them through a free list.
+//Pools are meant to be thread local. Objects freed by another thread go on a lock free list that the owning
+//thread takes back when its own free list runs out.
+typedef struct pool {
+    const char *name;
+    size_t objectSize;
+    int slabObjects;
+    void *freeList;
+    void *remoteFree;
+    void *slabs;
+    void *owner;
+    struct pool *next;
+    int registered;
+    //Counters
+    long allocs;
+    long misses;
+    long frees;
+    long remoteFrees;
+    long slabCount;
+} Pool;
+
+#define POOL_INITIALIZER(name, objectSize, slabObjects) \
+    {name, objectSize, slabObjects, NULL, NULL, NULL, NULL, NULL, 0, 0, 0, 0, 0, 0}
+
+void *pool_alloc(Pool *pool);
+
+void pool_free(Pool *pool, void *object);
+
+size_t pool_footprint(Pool *pool);
+
+void pool_print_stats(FILE *out);
+
+long pool_total_allocs();
+
+#endif //CHATSERVER_POOL_H
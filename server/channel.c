@@ -0,0 +1,38 @@
+#include "channel.h"
+#include "metrics.h"
+
+//One slot per possible channel byte, initialized on first use.
+__thread Channel channels[256];
+
+Channel *channel_get(char id) {
+    Channel *channel = &channels[(Byte) id];
+
+    if (channel->members.next == NULL) {
+        channel->id = id;
+        channel->size = 0;
+        link_init(&channel->members);
+    }
+
+    return channel;
+}
+
+void channel_join(Client *client, char id) {
+    channel_leave(client);
+
+    Channel *channel = channel_get(id);
+    link_add_tail(&channel->members, &client->channelLink);
+    channel->size++;
+    client->channel = id;
+    METRIC_SET(metrics->channelClients[(Byte) id], channel->size);
+}
+
+void channel_leave(Client *client) {
+    if (!link_is_linked(&client->channelLink)) {
+        return;
+    }
+
+    Channel *channel = channel_get(client->channel);
+    link_remove(&client->channelLink);
+    channel->size--;
+    METRIC_SET(metrics->channelClients[(Byte) client->channel], channel->size);
+}
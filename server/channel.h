@@ -0,0 +1,20 @@
+#ifndef CHATSERVER_CHANNEL_H
+#define CHATSERVER_CHANNEL_H
+
+#include "../list.h"
+#include "client.h"
+
+//The logged in clients currently switched to a channel.
+typedef struct channel {
+    char id;
+    int size;
+    Link members;
+} Channel;
+
+Channel *channel_get(char id);
+
+void channel_join(Client *client, char id);
+
+void channel_leave(Client *client);
+
+#endif //CHATSERVER_CHANNEL_H
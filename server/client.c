@@ -3,15 +3,40 @@
 #include <stdio.h>
 #include "../list.h"
 #include "../buffer.h"
+#include "../pool.h"
+#include "../packet.h"
 #include "client.h"
 
+__thread Pool client_pool = POOL_INITIALIZER("client", sizeof(Client), 64);
+
 Client *client_create(int socket_fd) {
-    Client *client = malloc(sizeof(Client));
+    Client *client = pool_alloc(&client_pool);
     client->id = socket_fd;
+    client->session = 0;
     client->channel = DEFAULT_CHANNEL;
     memset(client->name, 0, sizeof(client->name));
+    client->features = 0;
+    client->compressor = NULL;
+    client->readBuffer = buffer_create(CLIENT_READ_BUFFER_SIZE);
     client->readPacket = NULL;
-    client->writeQueue = list_create();
+    client->writeQueue = deque_create(8);
+    client->writeOffset = 0;
+    client->writeBytes = 0;
+    client->writeChatFrames = 0;
+    client->writeState = WRITE_HEALTHY;
+    client->tableIndex = -1;
+    client->presenceIndex = -1;
+    link_init(&client->pendingLink);
+    link_init(&client->channelLink);
+    client->writeBlocked = 0;
+    client->receiving = 0;
+    client->sendsInFlight = 0;
+    client->sendingFrames = 0;
+    timer_init(&client->timer, NULL);
+    client->acceptedAt = 0;
+    client->lastActive = 0;
+    client->pinged = 0;
+    client->generation = 0;
     return client;
 }
 
@@ -22,24 +47,178 @@ void client_set_name(Client *client, char *name) {
     }
 
     memset(client->name, 0, sizeof(client->name));
-    strcpy(client->name, name);
+    strncpy(client->name, name, 15);
+    client->name[15] = 0;
+}
+
+void client_add_write(Client *client, Frame *frame) {
+    deque_push_back(client->writeQueue, frame_retain(frame));
+    client->writeBytes += frame->length;
+
+    if (packet_is_chat(frame->data[0]))
+        client->writeChatFrames++;
 }
 
-void client_add_write(Client *client, Buffer *buffer) {
-    Buffer *writeBuffer = buffer_copy(buffer);
-    list_add(client->writeQueue, writeBuffer);
+Frame *client_peek_write(Client *client) {
+    return deque_peek_front(client->writeQueue);
 }
 
-Buffer *client_peek_write(Client *client) {
-    return list_get(client->writeQueue, 0);
+Frame *client_poll_write(Client *client) {
+    Frame *frame = deque_pop_front(client->writeQueue);
+    client->writeOffset = 0;
+    client->writeBytes -= frame->length;
+
+    if (packet_is_chat(frame->data[0]))
+        client->writeChatFrames--;
+
+    if (client->sendingFrames > 0)
+        client->sendingFrames--;
+
+    return frame;
 }
 
-Buffer *client_poll_write(Client *client) {
-    return list_remove(client->writeQueue, 0);
+//Fills iov with the unsent part of up to max_iov queued frames starting at index first,
+//returns the number of iovecs filled.
+int client_gather_write(Client *client, int first, struct iovec *iov, int max_iov) {
+    int count = 0;
+
+    for (int i = first; i < client->writeQueue->size && count < max_iov; i++) {
+        Frame *frame = deque_get(client->writeQueue, i);
+        int offset = i == 0 ? client->writeOffset : 0;
+        iov[count].iov_base = frame->data + offset;
+        iov[count].iov_len = (size_t) (frame->length - offset);
+        count++;
+    }
+
+    return count;
+}
+
+//Consumes bytes written from the front of the queue, returns the number of frames completed.
+int client_advance_write(Client *client, int bytes) {
+    int completed = 0;
+
+    while (bytes > 0 && client->writeQueue->size != 0) {
+        Frame *frame = client_peek_write(client);
+        int remaining = frame->length - client->writeOffset;
+
+        if (bytes < remaining) {
+            client->writeOffset += bytes;
+            break;
+        }
+
+        bytes -= remaining;
+        frame_release(client_poll_write(client));
+        completed++;
+    }
+
+    return completed;
+}
+
+//Index of the first queued frame that is not being sent and can still be changed.
+int client_unsent_index(Client *client) {
+    //A partly written frame has to be finished or the stream loses its framing.
+    if (client->sendingFrames == 0 && client->writeOffset != 0)
+        return 1;
+
+    return client->sendingFrames;
+}
+
+//Swaps the unsent frame at index for one carrying the same packets, the queue takes over the caller's reference.
+void client_replace_write(Client *client, int index, Frame *frame) {
+    Frame *old = deque_get(client->writeQueue, index);
+    client->writeBytes += frame->length - old->length;
+
+    if (packet_is_chat(old->data[0]))
+        client->writeChatFrames--;
+
+    if (packet_is_chat(frame->data[0]))
+        client->writeChatFrames++;
+
+    deque_set(client->writeQueue, index, frame);
+    frame_release(old);
+}
+
+//Drops the oldest queued chat frame that is not being sent, returns 0 if there is none.
+//Other packets are never evicted, losing a login or logout would corrupt the client's roster.
+int client_evict_write(Client *client) {
+    for (int i = client_unsent_index(client); i < client->writeQueue->size; i++) {
+        Frame *frame = deque_get(client->writeQueue, i);
+
+        if (packet_is_chat(frame->data[0])) {
+            deque_remove(client->writeQueue, i);
+            client->writeBytes -= frame->length;
+            client->writeChatFrames--;
+            frame_release(frame);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+//Replaces each run of two or more unsent frames that fits in max_contents bytes with one batch frame, returns the
+//number of batches made. Batches aren't chat frames so they are never evicted, only coalesce while the client keeps up.
+int client_coalesce_write(Client *client, int max_contents) {
+    Deque *queue = client->writeQueue;
+    int batches = 0;
+    int kept = client_unsent_index(client);
+    int i = kept;
+
+    while (i < queue->size) {
+        int end = i;
+        int contents = 0;
+
+        while (end < queue->size) {
+            Frame *frame = deque_get(queue, end);
+
+            //The client inflates compressed packets in the order they were compressed, batching one could reorder it.
+            if (contents + frame->length > max_contents || frame->data[0] == COMPRESSED_PACKET)
+                break;
+
+            contents += frame->length;
+            end++;
+        }
+
+        if (end - i < 2) {
+            deque_set(queue, kept++, deque_get(queue, i));
+            i++;
+            continue;
+        }
+
+        Byte header[BATCH_HEADER_MAX];
+        header[0] = BATCH_PACKET;
+        int header_length = 1 + varint_put(header + 1, (unsigned) contents);
+
+        Frame *batch = frame_alloc(header_length + contents);
+        memcpy(batch->data, header, (size_t) header_length);
+        int position = header_length;
+
+        for (; i < end; i++) {
+            Frame *frame = deque_get(queue, i);
+            memcpy(batch->data + position, frame->data, (size_t) frame->length);
+            position += frame->length;
+
+            if (packet_is_chat(frame->data[0]))
+                client->writeChatFrames--;
+
+            frame_release(frame);
+        }
+
+        client->writeBytes += header_length;
+        deque_set(queue, kept++, batch);
+        batches++;
+    }
+
+    //The slots past kept hold frames that were moved forward or released.
+    while (queue->size > kept) {
+        deque_pop_back(queue);
+    }
+
+    return batches;
 }
 
 void client_print(Client *client) {
-    printf("Client: {id: %d, name: %s, buffer: %p, writeQueue: %p}\n", client->id, client->name, client->readPacket,
+    printf("Client: {id: %d, name: %s, buffer: %p, writeQueue: %p}\n", client->id, client->name, client->readBuffer,
            client->writeQueue);
 }
 
@@ -49,13 +228,17 @@ void client_free(Client *client) {
         return;
     }
 
-    if (client->readPacket != NULL) {
-        buffer_free(client->readPacket);
+    if (client->readBuffer != NULL) {
+        buffer_free(client->readBuffer);
     }
 
     if (client->writeQueue != NULL) {
-        list_free(client->writeQueue, (void (*)(void *)) &buffer_free);
+        deque_free(client->writeQueue, (void (*)(void *)) &frame_release);
+    }
+
+    if (client->compressor != NULL) {
+        compressor_free(client->compressor);
     }
 
-    free(client);
+    pool_free(&client_pool, client);
 }
\ No newline at end of file
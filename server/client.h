@@ -2,33 +2,94 @@
 #define CHATSERVER_CLIENT_H
 
 #define DEFAULT_CHANNEL GLOBAL_CHANNEL
-#define GLOBAL_CHANNEL 'g'
-#define IOS_CHANNEL 'i'
-#define ANDROID_CHANNEL 'a'
-#define PRIVATE_CHANNEL 'p'
-#define SERVER_CHANNEL 's'
 
+#define CLIENT_READ_BUFFER_SIZE 4096
+
+//Slow consumer states, see write_apply_policy
+#define WRITE_HEALTHY 0
+#define WRITE_SLOW 1
+#define WRITE_CLOSING 2
+
+#include <sys/uio.h>
 #include "../list.h"
 #include "../buffer.h"
+#include "../packet.h"
+#include "../compress.h"
+#include "frame.h"
+#include "timer.h"
 
 typedef struct client {
     //Also the File Descriptor
     int id;
+    //Never reused while the server runs, unlike the descriptor. The owning shard is session % shard count.
+    unsigned session;
     char channel;
-    char name[15];
+    //Up to 15 characters and always NUL terminated
+    char name[16];
+    //FEATURE_ bits negotiated with a features packet
+    int features;
+    //This client's half of the compressed stream, created with its first compressed packet
+    Compressor *compressor;
+    //Bytes received but not yet parsed, only a trailing partial packet is kept between reads
+    Buffer *readBuffer;
+    //The packet being processed, points into readBuffer
     Buffer *readPacket;
-    List *writeQueue;
+    //Frames waiting to be sent, writeOffset bytes of the first one are already sent
+    Deque *writeQueue;
+    int writeOffset;
+    //Bytes and chat frames in writeQueue, used for the watermarks
+    int writeBytes;
+    int writeChatFrames;
+    //Went over the high watermark and has not drained below the low one yet
+    int writeState;
+    //Slot in the client table's dense array
+    int tableIndex;
+    //Slot of this client's login in the presence events while it waits to be published, -1 otherwise
+    int presenceIndex;
+    //Linked while queued for the end of loop flush
+    Link pendingLink;
+    //Linked into the members of channel once logged in
+    Link channelLink;
+    //Last write hit EAGAIN, wait for EPOLLOUT
+    int writeBlocked;
+    //A multishot io_uring receive is armed
+    int receiving;
+    //io_uring sends submitted and not completed yet
+    int sendsInFlight;
+    //Frames at the front of writeQueue referenced by those sends, they cannot be evicted
+    int sendingFrames;
+    //Runs out at the client's next login, heartbeat or idle deadline
+    Timer timer;
+    //Milliseconds the connection was accepted at and last received anything at
+    long acceptedAt;
+    long lastActive;
+    //Pinged since lastActive
+    int pinged;
+    //Tells this client's io_uring completions apart from those of an earlier client with the same descriptor
+    unsigned generation;
 } Client;
 
 Client *client_create(int socket_fd);
 
 void client_set_name(Client *client, char *name);
 
-void client_add_write(Client *client, Buffer *buffer);
+void client_add_write(Client *client, Frame *frame);
+
+Frame *client_peek_write(Client *client);
+
+Frame *client_poll_write(Client *client);
+
+int client_gather_write(Client *client, int first, struct iovec *iov, int max_iov);
+
+int client_advance_write(Client *client, int bytes);
+
+int client_unsent_index(Client *client);
+
+void client_replace_write(Client *client, int index, Frame *frame);
 
-Buffer *client_peek_write(Client *client);
+int client_evict_write(Client *client);
 
-Buffer *client_poll_write(Client *client);
+int client_coalesce_write(Client *client, int max_contents);
 
 void client_print(Client *client);
 
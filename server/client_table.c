@@ -0,0 +1,212 @@
+#include <memory.h>
+#include <malloc.h>
+#include <stdio.h>
+#include "client_table.h"
+
+//Function Declarations
+int client_table_grow_fds(ClientTable *table, int fd);
+
+int client_table_grow_sessions(ClientTable *table);
+
+int session_slot(ClientTable *table, unsigned session);
+
+void session_insert(ClientTable *table, Client *client);
+
+void session_delete(ClientTable *table, unsigned session);
+
+//Function Implementations
+ClientTable *client_table_create(int capacity) {
+    if (capacity < 16) {
+        capacity = 16;
+    }
+
+    ClientTable *table = malloc(sizeof(ClientTable));
+    table->fdCapacity = capacity;
+    table->byFd = calloc((size_t) table->fdCapacity, sizeof(Client *));
+    table->capacity = capacity;
+    table->clients = malloc(table->capacity * sizeof(Client *));
+    table->size = 0;
+
+    table->sessionBits = 1;
+    while ((1 << table->sessionBits) < capacity * 2) {
+        table->sessionBits++;
+    }
+    table->bySession = calloc((size_t) 1 << table->sessionBits, sizeof(Client *));
+    return table;
+}
+
+int client_table_add(ClientTable *table, Client *client) {
+    if (client->id < 0) {
+        fprintf(stderr, "Client has an invalid id (client_table_add).\n");
+        return -1;
+    }
+
+    if (client->id >= table->fdCapacity && client_table_grow_fds(table, client->id) < 0) {
+        return -1;
+    }
+
+    if (table->byFd[client->id] != NULL) {
+        fprintf(stderr, "Client %d is already in the table (client_table_add).\n", client->id);
+        return -1;
+    }
+
+    if ((table->size + 1) * 2 > 1 << table->sessionBits && client_table_grow_sessions(table) < 0) {
+        return -1;
+    }
+
+    if (table->size == table->capacity) {
+        Client **clients = realloc(table->clients, table->capacity * 2 * sizeof(Client *));
+
+        if (clients == NULL) {
+            fprintf(stderr, "Out of memory (client_table_add).\n");
+            return -1;
+        }
+
+        table->clients = clients;
+        table->capacity *= 2;
+    }
+
+    client->tableIndex = table->size;
+    table->clients[table->size++] = client;
+    table->byFd[client->id] = client;
+    session_insert(table, client);
+    return 0;
+}
+
+Client *client_table_get(ClientTable *table, int fd) {
+    if (fd < 0 || fd >= table->fdCapacity) {
+        return NULL;
+    }
+
+    return table->byFd[fd];
+}
+
+Client *client_table_remove(ClientTable *table, int fd) {
+    Client *client = client_table_get(table, fd);
+
+    if (client == NULL) {
+        return NULL;
+    }
+
+    //Move the last client into the hole to keep the array dense.
+    Client *last = table->clients[table->size - 1];
+    table->clients[client->tableIndex] = last;
+    last->tableIndex = client->tableIndex;
+    table->size--;
+
+    table->byFd[fd] = NULL;
+    session_delete(table, client->session);
+    client->tableIndex = -1;
+    return client;
+}
+
+Client *client_table_get_session(ClientTable *table, unsigned session) {
+    int mask = (1 << table->sessionBits) - 1;
+
+    for (int i = session_slot(table, session); table->bySession[i] != NULL; i = (i + 1) & mask) {
+        if (table->bySession[i]->session == session) {
+            return table->bySession[i];
+        }
+    }
+
+    return NULL;
+}
+
+void client_table_free(ClientTable *table, void (*free_value)(Client *)) {
+    if (free_value != NULL) {
+        for (int i = 0; i < table->size; i++) {
+            free_value(table->clients[i]);
+        }
+    }
+
+    free(table->byFd);
+    free(table->bySession);
+    free(table->clients);
+    free(table);
+}
+
+//"private" functions
+int client_table_grow_fds(ClientTable *table, int fd) {
+    int capacity = table->fdCapacity * 2;
+
+    if (capacity <= fd) {
+        capacity = fd + 1;
+    }
+
+    Client **byFd = realloc(table->byFd, capacity * sizeof(Client *));
+
+    if (byFd == NULL) {
+        fprintf(stderr, "Out of memory (client_table_grow_fds).\n");
+        return -1;
+    }
+
+    memset(byFd + table->fdCapacity, 0, (capacity - table->fdCapacity) * sizeof(Client *));
+    table->byFd = byFd;
+    table->fdCapacity = capacity;
+    return 0;
+}
+
+int client_table_grow_sessions(ClientTable *table) {
+    Client **old = table->bySession;
+    int old_capacity = 1 << table->sessionBits;
+    Client **bySession = calloc((size_t) old_capacity * 2, sizeof(Client *));
+
+    if (bySession == NULL) {
+        fprintf(stderr, "Out of memory (client_table_grow_sessions).\n");
+        return -1;
+    }
+
+    table->bySession = bySession;
+    table->sessionBits++;
+
+    for (int i = 0; i < old_capacity; i++) {
+        if (old[i] != NULL) {
+            session_insert(table, old[i]);
+        }
+    }
+
+    free(old);
+    return 0;
+}
+
+//Fibonacci hashing, the top bits of the product depend on every bit of the session.
+int session_slot(ClientTable *table, unsigned session) {
+    return (int) ((session * 2654435769u) >> (32 - table->sessionBits));
+}
+
+void session_insert(ClientTable *table, Client *client) {
+    int mask = (1 << table->sessionBits) - 1;
+    int i = session_slot(table, client->session);
+
+    while (table->bySession[i] != NULL) {
+        i = (i + 1) & mask;
+    }
+
+    table->bySession[i] = client;
+}
+
+//Shifts the rest of the probe run back into the hole instead of leaving a tombstone, so lookups never slow down.
+void session_delete(ClientTable *table, unsigned session) {
+    int mask = (1 << table->sessionBits) - 1;
+    int hole = session_slot(table, session);
+
+    while (table->bySession[hole] != NULL && table->bySession[hole]->session != session) {
+        hole = (hole + 1) & mask;
+    }
+
+    if (table->bySession[hole] == NULL) {
+        return;
+    }
+
+    for (int i = (hole + 1) & mask; table->bySession[i] != NULL; i = (i + 1) & mask) {
+        int home = session_slot(table, table->bySession[i]->session);
+
+        //An entry can move back to the hole unless its home lies after the hole in the run.
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            table->bySession[hole] = table->bySession[i];
+            hole = i;
+        }
+    }
+
+    table->bySession[hole] = NULL;
+}
@@ -0,0 +1,30 @@
+#ifndef CHATSERVER_CLIENT_TABLE_H
+#define CHATSERVER_CLIENT_TABLE_H
+
+#include "client.h"
+
+//Clients indexed by file descriptor and by session ID for O(1) lookup, plus a dense array for iterating over everyone.
+typedef struct client_table {
+    Client **byFd;
+    int fdCapacity;
+    //Open addressing with linear probing, a power of two slots kept at most half full
+    Client **bySession;
+    int sessionBits;
+    Client **clients;
+    int size;
+    int capacity;
+} ClientTable;
+
+ClientTable *client_table_create(int capacity);
+
+int client_table_add(ClientTable *table, Client *client);
+
+Client *client_table_get(ClientTable *table, int fd);
+
+Client *client_table_remove(ClientTable *table, int fd);
+
+Client *client_table_get_session(ClientTable *table, unsigned session);
+
+void client_table_free(ClientTable *table, void (*free_value)(Client *));
+
+#endif //CHATSERVER_CLIENT_TABLE_H
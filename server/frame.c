@@ -0,0 +1,85 @@
+#include <memory.h>
+#include <malloc.h>
+#include <stdio.h>
+#include "../packet.h"
+#include "frame.h"
+
+//Frames of any fixed size packet come from one pool, bigger ones from malloc.
+__thread Pool frame_pool = POOL_INITIALIZER("frame", sizeof(Frame) + PACKET_MAX_SIZE, 256);
+
+//A frame of length bytes for the caller to fill in.
+Frame *frame_alloc(int length) {
+    Frame *frame;
+
+    if (length <= PACKET_MAX_SIZE) {
+        frame = pool_alloc(&frame_pool);
+        frame->pool = &frame_pool;
+    } else {
+        frame = malloc(sizeof(Frame) + length * sizeof(Byte));
+        frame->pool = NULL;
+    }
+
+    frame->refs = 1;
+    frame->length = length;
+    frame->framed = NULL;
+    frame->session = NULL;
+    frame->presence = NULL;
+    frame->release = NULL;
+    frame->owner = NULL;
+    frame->data = (Byte *) (frame + 1);
+    return frame;
+}
+
+//A frame of length bytes at data, which stay the owner's and aren't copied. release(owner) is called once the frame
+//is freed, so the owner can keep the bytes around until then.
+Frame *frame_wrap(Byte *data, int length, void (*release)(void *), void *owner) {
+    Frame *frame = frame_alloc(0);
+    frame->length = length;
+    frame->release = release;
+    frame->owner = owner;
+    frame->data = data;
+    return frame;
+}
+
+Frame *frame_create(Buffer *packet) {
+    int length = packet->limit - packet->position;
+    Frame *frame = frame_alloc(length);
+    memcpy(frame->data, packet->buffer + packet->position, length * sizeof(Byte));
+    return frame;
+}
+
+Frame *frame_retain(Frame *frame) {
+    __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+    return frame;
+}
+
+void frame_release(Frame *frame) {
+    if (frame == NULL) {
+        fprintf(stderr, "Passed in frame was NULL (frame_release).\n");
+        return;
+    }
+
+    if (__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (frame->framed != NULL) {
+            frame_release(frame->framed);
+        }
+
+        if (frame->session != NULL) {
+            frame_release(frame->session);
+        }
+
+        if (frame->presence != NULL) {
+            frame_release(frame->presence);
+        }
+
+        if (frame->release != NULL) {
+            frame->release(frame->owner);
+        }
+
+        if (frame->pool != NULL) {
+            pool_free(frame->pool, frame);
+        } else {
+            free(frame);
+        }
+    }
+}
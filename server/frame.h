@@ -0,0 +1,36 @@
+#ifndef CHATSERVER_FRAME_H
+#define CHATSERVER_FRAME_H
+
+#include "../buffer.h"
+#include "../pool.h"
+
+//An encoded packet that is shared, read only, by every write queue it is on, possibly across shards.
+typedef struct frame {
+    int refs;
+    int length;
+    //Owning pool, NULL if the frame came from malloc
+    Pool *pool;
+    //The same chat message as a framed chat packet, for clients that negotiated it. Owned by this frame.
+    struct frame *framed;
+    //The same packet naming clients by session ID, for clients that negotiated sessions. Owned by this frame.
+    struct frame *session;
+    //The same logins and logouts as presence packets, for clients that negotiated them. Owned by this frame.
+    struct frame *presence;
+    //Called with owner when the frame is freed if the bytes belong to someone else, see frame_wrap.
+    void (*release)(void *owner);
+    void *owner;
+    //The packet, right after the frame unless it was wrapped
+    Byte *data;
+} Frame;
+
+Frame *frame_alloc(int length);
+
+Frame *frame_wrap(Byte *data, int length, void (*release)(void *), void *owner);
+
+Frame *frame_create(Buffer *packet);
+
+Frame *frame_retain(Frame *frame);
+
+void frame_release(Frame *frame);
+
+#endif //CHATSERVER_FRAME_H
@@ -0,0 +1,479 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../packet.h"
+#include "handover.h"
+
+//Starts the stream so a successor started some other way doesn't mistake whatever it reads for a handover.
+#define HANDOVER_MAGIC 0x43484f31
+#define HANDOVER_HEADER_SIZE 12
+//Descriptors per message, the most the kernel takes in one SCM_RIGHTS message
+#define HANDOVER_FDS_PER_MESSAGE 253
+
+//Function Declarations
+int handover_reserve(Handover *handover, int length);
+
+int handover_write_all(int socket_fd, const Byte *data, int length);
+
+int handover_read_all(int socket_fd, Byte *data, int length);
+
+int handover_send_fds(int socket_fd, const int *fds, int count);
+
+int handover_receive_fds(int socket_fd, int *fds, int count);
+
+//Function Implementations
+void handover_init(Handover *handover) {
+    handover->data = NULL;
+    handover->length = 0;
+    handover->capacity = 0;
+    handover->position = 0;
+    handover->fds = NULL;
+    handover->fdCount = 0;
+    handover->fdCapacity = 0;
+}
+
+int handover_reserve(Handover *handover, int length) {
+    if (handover->length + length <= handover->capacity)
+        return 0;
+
+    int capacity = handover->capacity == 0 ? 4096 : handover->capacity;
+
+    while (capacity < handover->length + length) {
+        capacity *= 2;
+    }
+
+    Byte *data = realloc(handover->data, (size_t) capacity);
+
+    if (data == NULL) {
+        fprintf(stderr, "Could not grow the handover state (handover_reserve).\n");
+        return -1;
+    }
+
+    handover->data = data;
+    handover->capacity = capacity;
+    return 0;
+}
+
+int handover_put(Handover *handover, const void *data, int length) {
+    if (handover_reserve(handover, length) < 0)
+        return -1;
+
+    memcpy(handover->data + handover->length, data, (size_t) length);
+    handover->length += length;
+    return 0;
+}
+
+int handover_put_u32(Handover *handover, unsigned value) {
+    Byte bytes[4];
+    session_put(bytes, value);
+    return handover_put(handover, bytes, 4);
+}
+
+int handover_put_u64(Handover *handover, unsigned long value) {
+    Byte bytes[8];
+    u64_put(bytes, value);
+    return handover_put(handover, bytes, 8);
+}
+
+int handover_put_fd(Handover *handover, int fd) {
+    if (handover->fdCount == handover->fdCapacity) {
+        int capacity = handover->fdCapacity == 0 ? 64 : handover->fdCapacity * 2;
+        int *fds = realloc(handover->fds, capacity * sizeof(int));
+
+        if (fds == NULL) {
+            fprintf(stderr, "Could not grow the handover descriptors (handover_put_fd).\n");
+            return -1;
+        }
+
+        handover->fds = fds;
+        handover->fdCapacity = capacity;
+    }
+
+    handover->fds[handover->fdCount++] = fd;
+    return 0;
+}
+
+//Records the client and adds its descriptor, a successor pairs records with descriptors by their order. Frames are
+//saved as they would go out, compressed ones included, as the peer already expects them.
+int handover_put_client(Handover *handover, Client *client) {
+    Byte fields[2];
+    int failed = handover_put_fd(handover, client->id) < 0;
+
+    failed |= handover_put_u32(handover, (unsigned) client->id) < 0;
+    failed |= handover_put_u32(handover, client->session) < 0;
+    fields[0] = (Byte) client->channel;
+    failed |= handover_put(handover, fields, 1) < 0;
+    failed |= handover_put(handover, client->name, 15) < 0;
+    fields[1] = (Byte) client->features;
+    failed |= handover_put(handover, fields + 1, 1) < 0;
+    failed |= handover_put_u32(handover, (unsigned) client->readBuffer->position) < 0;
+    failed |= handover_put(handover, client->readBuffer->buffer, client->readBuffer->position) < 0;
+    failed |= handover_put_u32(handover, (unsigned) client->writeOffset) < 0;
+    failed |= handover_put_u32(handover, (unsigned) client->writeQueue->size) < 0;
+
+    for (int i = 0; i < client->writeQueue->size; i++) {
+        Frame *frame = deque_get(client->writeQueue, i);
+        failed |= handover_put_u32(handover, (unsigned) frame->length) < 0;
+        failed |= handover_put(handover, frame->data, frame->length) < 0;
+    }
+
+    return failed ? -1 : 0;
+}
+
+//Adds the other state's bytes and descriptors after this one's.
+int handover_append(Handover *handover, Handover *other) {
+    if (handover_put(handover, other->data, other->length) < 0)
+        return -1;
+
+    for (int i = 0; i < other->fdCount; i++) {
+        if (handover_put_fd(handover, other->fds[i]) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int handover_get_u32(Handover *handover, unsigned *value) {
+    if (handover->length - handover->position < 4)
+        return -1;
+
+    *value = session_get(handover->data + handover->position);
+    handover->position += 4;
+    return 0;
+}
+
+int handover_get_u64(Handover *handover, unsigned long *value) {
+    if (handover->length - handover->position < 8)
+        return -1;
+
+    *value = u64_get(handover->data + handover->position);
+    handover->position += 8;
+    return 0;
+}
+
+//Parses the next client record, -1 if the state is cut short or doesn't make sense.
+int handover_get_client(Handover *handover, HandoverClient *saved) {
+    unsigned fd, session, read_length, write_offset, write_count, length;
+
+    if (handover_get_u32(handover, &fd) < 0 || handover_get_u32(handover, &session) < 0 ||
+        handover->length - handover->position < 17) {
+        fprintf(stderr, "Handover state ends inside a client (handover_get_client).\n");
+        return -1;
+    }
+
+    Byte *data = handover->data + handover->position;
+    saved->fd = (int) fd;
+    saved->session = session;
+    saved->channel = (char) data[0];
+    memcpy(saved->name, data + 1, 15);
+    saved->name[15] = '\0';
+    saved->features = data[16];
+    handover->position += 17;
+
+    if (handover_get_u32(handover, &read_length) < 0 || read_length > CLIENT_READ_BUFFER_SIZE ||
+        handover->length - handover->position < (int) read_length) {
+        fprintf(stderr, "Handover state has a bad read buffer (handover_get_client).\n");
+        return -1;
+    }
+
+    saved->read = handover->data + handover->position;
+    saved->readLength = (int) read_length;
+    handover->position += read_length;
+
+    if (handover_get_u32(handover, &write_offset) < 0 || handover_get_u32(handover, &write_count) < 0) {
+        fprintf(stderr, "Handover state ends inside a client (handover_get_client).\n");
+        return -1;
+    }
+
+    saved->writes = handover->data + handover->position;
+    saved->writeCount = (int) write_count;
+    saved->writeOffset = (int) write_offset;
+
+    for (unsigned i = 0; i < write_count; i++) {
+        if (handover_get_u32(handover, &length) < 0 || length == 0 ||
+            handover->length - handover->position < (int) length || (i == 0 && write_offset >= length)) {
+            fprintf(stderr, "Handover state has a bad write queue (handover_get_client).\n");
+            return -1;
+        }
+
+        handover->position += length;
+    }
+
+    if (write_count == 0 && write_offset != 0) {
+        fprintf(stderr, "Handover state has a bad write queue (handover_get_client).\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+//Builds the client back up on the calling shard, its descriptor has to be at the saved number already. Compression
+//is turned off, the compressor's state stayed behind, queued frames that were compressed still go out as they were.
+Client *handover_client_restore(HandoverClient *saved) {
+    Client *client = client_create(saved->fd);
+    client->session = saved->session;
+    client->channel = saved->channel;
+    memcpy(client->name, saved->name, sizeof(client->name));
+    client->features = saved->features & ~FEATURE_COMPRESS;
+    memcpy(client->readBuffer->buffer, saved->read, (size_t) saved->readLength);
+    client->readBuffer->position = saved->readLength;
+
+    const Byte *data = saved->writes;
+
+    for (int i = 0; i < saved->writeCount; i++) {
+        int length = (int) session_get(data);
+        Frame *frame = frame_alloc(length);
+        memcpy(frame->data, data + 4, (size_t) length);
+        client_add_write(client, frame);
+        frame_release(frame);
+        data += 4 + length;
+    }
+
+    client->writeOffset = saved->writeOffset;
+    return client;
+}
+
+int handover_write_all(int socket_fd, const Byte *data, int length) {
+    while (length > 0) {
+        ssize_t written = send(socket_fd, data, (size_t) length, MSG_NOSIGNAL);
+
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        data += written;
+        length -= (int) written;
+    }
+
+    return 0;
+}
+
+int handover_read_all(int socket_fd, Byte *data, int length) {
+    while (length > 0) {
+        ssize_t got = recv(socket_fd, data, (size_t) length, 0);
+
+        if (got < 0 && errno == EINTR)
+            continue;
+
+        if (got <= 0)
+            return -1;
+
+        data += got;
+        length -= (int) got;
+    }
+
+    return 0;
+}
+
+//Descriptors travel as ancillary data on one byte each message, so no read picks up more of them than it expects.
+int handover_send_fds(int socket_fd, const int *fds, int count) {
+    union {
+        char buffer[CMSG_SPACE(HANDOVER_FDS_PER_MESSAGE * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    Byte byte = 0;
+    struct iovec iov = {&byte, 1};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+    memset(control.buffer, 0, sizeof(control.buffer));
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+
+    ssize_t sent;
+
+    do {
+        sent = sendmsg(socket_fd, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+
+    return sent == 1 ? 0 : -1;
+}
+
+int handover_receive_fds(int socket_fd, int *fds, int count) {
+    union {
+        char buffer[CMSG_SPACE(HANDOVER_FDS_PER_MESSAGE * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    Byte byte;
+    struct iovec iov = {&byte, 1};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    ssize_t got;
+
+    do {
+        got = recvmsg(socket_fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (got < 0 && errno == EINTR);
+
+    struct cmsghdr *cmsg = got == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        return -1;
+
+    int received = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    memcpy(fds, CMSG_DATA(cmsg), received * sizeof(int));
+
+    if (received != count || (msg.msg_flags & MSG_CTRUNC)) {
+        for (int i = 0; i < received; i++) {
+            close(fds[i]);
+        }
+
+        return -1;
+    }
+
+    return 0;
+}
+
+//Sends a header with the number of descriptors and bytes, the descriptors, then the bytes.
+int handover_send(int socket_fd, Handover *handover) {
+    Byte header[HANDOVER_HEADER_SIZE];
+    session_put(header, HANDOVER_MAGIC);
+    session_put(header + 4, (unsigned) handover->fdCount);
+    session_put(header + 8, (unsigned) handover->length);
+
+    if (handover_write_all(socket_fd, header, HANDOVER_HEADER_SIZE) < 0) {
+        fprintf(stderr, "Could not send the handover header (handover_send).\n");
+        return -1;
+    }
+
+    for (int sent = 0; sent < handover->fdCount; sent += HANDOVER_FDS_PER_MESSAGE) {
+        int count = handover->fdCount - sent;
+
+        if (count > HANDOVER_FDS_PER_MESSAGE) {
+            count = HANDOVER_FDS_PER_MESSAGE;
+        }
+
+        if (handover_send_fds(socket_fd, handover->fds + sent, count) < 0) {
+            fprintf(stderr, "Could not send the handover descriptors (handover_send).\n");
+            return -1;
+        }
+    }
+
+    if (handover_write_all(socket_fd, handover->data, handover->length) < 0) {
+        fprintf(stderr, "Could not send the handover state (handover_send).\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+//Receives what handover_send sent into an initialised handover, its descriptors are close on exec.
+int handover_receive(int socket_fd, Handover *handover) {
+    Byte header[HANDOVER_HEADER_SIZE];
+
+    if (handover_read_all(socket_fd, header, HANDOVER_HEADER_SIZE) < 0 || session_get(header) != HANDOVER_MAGIC) {
+        fprintf(stderr, "No handover header received (handover_receive).\n");
+        return -1;
+    }
+
+    int fd_count = (int) session_get(header + 4);
+    int length = (int) session_get(header + 8);
+
+    if (fd_count < 0 || length < 0) {
+        fprintf(stderr, "Handover header doesn't make sense (handover_receive).\n");
+        return -1;
+    }
+
+    handover->fds = malloc((fd_count == 0 ? 1 : fd_count) * sizeof(int));
+
+    if (handover->fds == NULL || handover_reserve(handover, length) < 0) {
+        fprintf(stderr, "Could not allocate the handover state (handover_receive).\n");
+        return -1;
+    }
+
+    handover->fdCapacity = fd_count == 0 ? 1 : fd_count;
+
+    while (handover->fdCount < fd_count) {
+        int count = fd_count - handover->fdCount;
+
+        if (count > HANDOVER_FDS_PER_MESSAGE) {
+            count = HANDOVER_FDS_PER_MESSAGE;
+        }
+
+        if (handover_receive_fds(socket_fd, handover->fds + handover->fdCount, count) < 0) {
+            fprintf(stderr, "Could not receive the handover descriptors (handover_receive).\n");
+            return -1;
+        }
+
+        handover->fdCount += count;
+    }
+
+    if (handover_read_all(socket_fd, handover->data, length) < 0) {
+        fprintf(stderr, "Could not receive the handover state (handover_receive).\n");
+        return -1;
+    }
+
+    handover->length = length;
+    handover->position = 0;
+    return 0;
+}
+
+//Moves each received descriptor to its target number, those with a negative target stay where they are. A received
+//descriptor in the way is moved aside first, anything else holding a target is an error.
+int handover_place_fds(int *fds, const int *targets, int count, int fd_limit) {
+    for (int i = 0; i < count; i++) {
+        int target = targets[i];
+
+        if (target < 0 || fds[i] == target)
+            continue;
+
+        if (target >= fd_limit) {
+            fprintf(stderr, "Descriptor %d is over the limit of %d (handover_place_fds).\n", target, fd_limit);
+            return -1;
+        }
+
+        for (int j = 0; j < count; j++) {
+            if (j == i || fds[j] != target)
+                continue;
+
+            int moved = fcntl(fds[j], F_DUPFD_CLOEXEC, 0);
+
+            if (moved < 0) {
+                perror("Could not move a descriptor aside (handover_place_fds)");
+                return -1;
+            }
+
+            close(fds[j]);
+            fds[j] = moved;
+        }
+
+        if (fcntl(target, F_GETFD) >= 0) {
+            fprintf(stderr, "Descriptor %d is already in use (handover_place_fds).\n", target);
+            return -1;
+        }
+
+        if (dup3(fds[i], target, O_CLOEXEC) < 0) {
+            perror("Could not place a descriptor (handover_place_fds)");
+            return -1;
+        }
+
+        close(fds[i]);
+        fds[i] = target;
+    }
+
+    return 0;
+}
+
+//Frees the buffers, the descriptors stay open.
+void handover_free(Handover *handover) {
+    free(handover->data);
+    free(handover->fds);
+    handover_init(handover);
+}
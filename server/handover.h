@@ -0,0 +1,69 @@
+#ifndef CHATSERVER_HANDOVER_H
+#define CHATSERVER_HANDOVER_H
+
+#include "client.h"
+
+//Environment variable naming the inherited descriptor a successor receives the handover on.
+#define HANDOVER_FD_ENV "CHATSERVER_HANDOVER_FD"
+
+//State one process hands to the next, the bytes and the descriptors they refer to in order. Numbers are big endian
+//so nothing depends on how either binary lays out its structs.
+typedef struct handover {
+    Byte *data;
+    int length;
+    int capacity;
+    //Where parsing has got to
+    int position;
+    int *fds;
+    int fdCount;
+    int fdCapacity;
+} Handover;
+
+//A client as it was handed over, the byte fields point into the handover's data.
+typedef struct handover_client {
+    //Descriptor number in the process that handed it over, also the one byte ID its peers know it by
+    int fd;
+    unsigned session;
+    char channel;
+    char name[16];
+    int features;
+    //The trailing partial packet of its read buffer
+    const Byte *read;
+    int readLength;
+    //Its queued frames, each as a 32 bit length and the packet, writeOffset bytes of the first are already sent
+    const Byte *writes;
+    int writeCount;
+    int writeOffset;
+} HandoverClient;
+
+void handover_init(Handover *handover);
+
+int handover_put(Handover *handover, const void *data, int length);
+
+int handover_put_u32(Handover *handover, unsigned value);
+
+int handover_put_u64(Handover *handover, unsigned long value);
+
+int handover_put_fd(Handover *handover, int fd);
+
+int handover_put_client(Handover *handover, Client *client);
+
+int handover_append(Handover *handover, Handover *other);
+
+int handover_get_u32(Handover *handover, unsigned *value);
+
+int handover_get_u64(Handover *handover, unsigned long *value);
+
+int handover_get_client(Handover *handover, HandoverClient *saved);
+
+Client *handover_client_restore(HandoverClient *saved);
+
+int handover_send(int socket_fd, Handover *handover);
+
+int handover_receive(int socket_fd, Handover *handover);
+
+int handover_place_fds(int *fds, const int *targets, int count, int fd_limit);
+
+void handover_free(Handover *handover);
+
+#endif //CHATSERVER_HANDOVER_H
@@ -0,0 +1,361 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../packet.h"
+#include "history.h"
+
+//New segments are this big, a channel keeps its newest HISTORY_SEGMENTS_KEPT and deletes the older ones.
+#define HISTORY_SEGMENT_SIZE (4 * 1024 * 1024)
+#define HISTORY_SEGMENTS_KEPT 8
+//Most bytes of records a replay hands out in one chunk
+#define HISTORY_CHUNK_MAX (64 * 1024)
+
+//A channel's segments, oldest first. Any shard appends to or replays from it under the lock, records are never
+//changed once written so chunks handed out are read without it.
+typedef struct history_log {
+    pthread_mutex_t lock;
+    unsigned long nextSeq;
+    int segments;
+    HistorySegment *oldest;
+    HistorySegment *newest;
+} HistoryLog;
+
+//Function Declarations
+char *history_segment_path(int channel, unsigned long first_seq);
+
+HistorySegment *history_segment_map(char *path, unsigned long first_seq, int create);
+
+int history_segment_add_offset(HistorySegment *segment, int offset);
+
+void history_segment_scan(HistorySegment *segment);
+
+void history_log_insert(HistoryLog *log, HistorySegment *segment);
+
+void history_log_trim(HistoryLog *log);
+
+HistorySegment *history_log_rotate(HistoryLog *log, int channel);
+
+static const char *log_dir;
+static HistoryLog logs[256];
+
+//Function Implementations
+char *history_segment_path(int channel, unsigned long first_seq) {
+    char *path = malloc(strlen(log_dir) + 32);
+
+    if (path != NULL) {
+        sprintf(path, "%s/%02x-%020lu.log", log_dir, channel, first_seq);
+    }
+
+    return path;
+}
+
+//Maps the segment file at path, which the segment takes, creating an empty one if create is set. Records already in
+//the file are indexed.
+HistorySegment *history_segment_map(char *path, unsigned long first_seq, int create) {
+    struct stat st;
+
+    int fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+
+    if (fd < 0) {
+        perror("open");
+        free(path);
+        return NULL;
+    }
+
+    if ((create && ftruncate(fd, HISTORY_SEGMENT_SIZE) < 0) || fstat(fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "Failed to size history segment %s (history_segment_map).\n", path);
+        close(fd);
+        free(path);
+        return NULL;
+    }
+
+    Byte *data = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        free(path);
+        return NULL;
+    }
+
+    HistorySegment *segment = calloc(1, sizeof(HistorySegment));
+
+    if (segment == NULL) {
+        fprintf(stderr, "Failed to allocate a history segment (history_segment_map).\n");
+        munmap(data, (size_t) st.st_size);
+        free(path);
+        return NULL;
+    }
+
+    segment->refs = 1;
+    segment->firstSeq = first_seq;
+    segment->size = (int) st.st_size;
+    segment->data = data;
+    segment->path = path;
+
+    if (!create) {
+        history_segment_scan(segment);
+    }
+
+    return segment;
+}
+
+int history_segment_add_offset(HistorySegment *segment, int offset) {
+    if (segment->count == segment->offsetsCapacity) {
+        int capacity = segment->offsetsCapacity == 0 ? 1024 : segment->offsetsCapacity * 2;
+        int *offsets = realloc(segment->offsets, capacity * sizeof(int));
+
+        if (offsets == NULL) {
+            fprintf(stderr, "Failed to grow a history index (history_segment_add_offset).\n");
+            return -1;
+        }
+
+        segment->offsets = offsets;
+        segment->offsetsCapacity = capacity;
+    }
+
+    segment->offsets[segment->count] = offset;
+    return 0;
+}
+
+//Indexes the records of a segment written by an earlier run. The file is zero past the last record, a record cut
+//short by a crash or out of sequence ends the segment.
+void history_segment_scan(HistorySegment *segment) {
+    unsigned length;
+    int offset = 0;
+
+    while (offset < segment->size && segment->data[offset] == HISTORY_PACKET) {
+        int size = packet_length(segment->data + offset, segment->size - offset);
+        int header = varint_get(segment->data + offset + 1, segment->size - offset - 1, &length);
+
+        if (size <= 0 || offset + size > segment->size || length < HISTORY_FIELDS ||
+            u64_get(segment->data + offset + 1 + header) != segment->firstSeq + segment->count ||
+            history_segment_add_offset(segment, offset) < 0) {
+            break;
+        }
+
+        segment->count++;
+        offset += size;
+    }
+
+    segment->used = offset;
+}
+
+HistorySegment *history_segment_retain(HistorySegment *segment) {
+    __atomic_add_fetch(&segment->refs, 1, __ATOMIC_RELAXED);
+    return segment;
+}
+
+//Unmaps the segment once the log and every frame sending from it are done with it.
+void history_segment_release(void *arg) {
+    HistorySegment *segment = arg;
+
+    if (__atomic_sub_fetch(&segment->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        munmap(segment->data, (size_t) segment->size);
+        free(segment->offsets);
+        free(segment->path);
+        free(segment);
+    }
+}
+
+void history_log_insert(HistoryLog *log, HistorySegment *segment) {
+    HistorySegment **link = &log->oldest;
+
+    while (*link != NULL && (*link)->firstSeq < segment->firstSeq) {
+        link = &(*link)->next;
+    }
+
+    segment->next = *link;
+    *link = segment;
+
+    if (segment->next == NULL) {
+        log->newest = segment;
+    }
+
+    log->segments++;
+}
+
+//Deletes the oldest segments past HISTORY_SEGMENTS_KEPT, replays still sending from them keep them mapped.
+void history_log_trim(HistoryLog *log) {
+    while (log->segments > HISTORY_SEGMENTS_KEPT) {
+        HistorySegment *segment = log->oldest;
+        log->oldest = segment->next;
+        log->segments--;
+
+        if (unlink(segment->path) < 0) {
+            perror("unlink");
+        }
+
+        history_segment_release(segment);
+    }
+}
+
+//Starts a new segment at the log's next sequence number.
+HistorySegment *history_log_rotate(HistoryLog *log, int channel) {
+    char *path = history_segment_path(channel, log->nextSeq);
+
+    if (path == NULL) {
+        return NULL;
+    }
+
+    HistorySegment *segment = history_segment_map(path, log->nextSeq, 1);
+
+    if (segment == NULL) {
+        return NULL;
+    }
+
+    history_log_insert(log, segment);
+    history_log_trim(log);
+    return segment;
+}
+
+//Keeps the logs in dir, which is created if needed, and picks up the segments an earlier run left there. Must be
+//called once before any shard starts.
+int history_open(const char *dir) {
+    struct dirent *entry;
+    unsigned channel;
+    unsigned long first_seq;
+    int end;
+
+    log_dir = dir;
+
+    for (int i = 0; i < 256; i++) {
+        pthread_mutex_init(&logs[i].lock, NULL);
+        logs[i].nextSeq = 1;
+    }
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror("mkdir");
+        return -1;
+    }
+
+    DIR *files = opendir(dir);
+
+    if (files == NULL) {
+        perror("opendir");
+        return -1;
+    }
+
+    while ((entry = readdir(files)) != NULL) {
+        end = 0;
+
+        if (sscanf(entry->d_name, "%2x-%lu.log%n", &channel, &first_seq, &end) != 2 ||
+            end != (int) strlen(entry->d_name)) {
+            continue;
+        }
+
+        char *path = history_segment_path((int) channel, first_seq);
+        HistorySegment *segment = path == NULL ? NULL : history_segment_map(path, first_seq, 0);
+
+        if (segment != NULL) {
+            history_log_insert(&logs[channel], segment);
+        }
+    }
+
+    closedir(files);
+
+    for (int i = 0; i < 256; i++) {
+        history_log_trim(&logs[i]);
+
+        if (logs[i].newest != NULL) {
+            logs[i].nextSeq = logs[i].newest->firstSeq + logs[i].newest->count;
+        }
+    }
+
+    return 0;
+}
+
+//Appends a session chat packet of length bytes to the channel's log, returns its sequence number or 0 if it couldn't
+//be logged.
+unsigned long history_append(char channel, const Byte *packet, int length) {
+    struct timespec ts;
+    HistoryLog *log = &logs[(Byte) channel];
+    int size = packet_history_size(length);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    unsigned long time = (unsigned long) ts.tv_sec * 1000 + (unsigned long) ts.tv_nsec / 1000000;
+
+    pthread_mutex_lock(&log->lock);
+    HistorySegment *segment = log->newest;
+
+    if (segment == NULL || segment->used + size > segment->size) {
+        segment = history_log_rotate(log, (Byte) channel);
+    }
+
+    if (segment == NULL || history_segment_add_offset(segment, segment->used) < 0) {
+        pthread_mutex_unlock(&log->lock);
+        return 0;
+    }
+
+    unsigned long seq = log->nextSeq++;
+    segment->used += packet_history_put(segment->data + segment->used, seq, time, packet, length);
+    segment->count++;
+    pthread_mutex_unlock(&log->lock);
+    return seq;
+}
+
+//Hands the channel's records from the one mode and value ask for to chunk, a segment reference with each run of up
+//to HISTORY_CHUNK_MAX bytes. Stops once the next record would take it past max_bytes, always sending at least one.
+//Returns 1 if it stopped early, 0 if it got to the end, either way *next is where to continue from.
+int history_replay(char channel, Byte mode, unsigned long value, int max_bytes, HistoryChunk chunk, void *arg,
+                   unsigned long *next) {
+    HistoryLog *log = &logs[(Byte) channel];
+    int sent = 0;
+
+    pthread_mutex_lock(&log->lock);
+
+    unsigned long seq = value;
+    if (mode == REPLAY_LAST) {
+        seq = value < log->nextSeq ? log->nextSeq - value : 1;
+    }
+
+    for (HistorySegment *segment = log->oldest; segment != NULL; segment = segment->next) {
+        if (segment->firstSeq + segment->count <= seq)
+            continue;
+
+        int index = seq > segment->firstSeq ? (int) (seq - segment->firstSeq) : 0;
+
+        while (index < segment->count) {
+            int begin = segment->offsets[index], end = begin, full = 0;
+
+            while (index < segment->count) {
+                int record_end = index + 1 < segment->count ? segment->offsets[index + 1] : segment->used;
+
+                if (sent + record_end - begin > max_bytes && sent + end - begin > 0) {
+                    full = 1;
+                    break;
+                }
+
+                if (record_end - begin > HISTORY_CHUNK_MAX)
+                    break;
+
+                end = record_end;
+                index++;
+            }
+
+            if (end > begin) {
+                chunk(history_segment_retain(segment), segment->data + begin, end - begin, arg);
+                sent += end - begin;
+            }
+
+            if (full) {
+                *next = segment->firstSeq + index;
+                pthread_mutex_unlock(&log->lock);
+                return 1;
+            }
+        }
+    }
+
+    *next = log->nextSeq;
+    pthread_mutex_unlock(&log->lock);
+    return 0;
+}
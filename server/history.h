@@ -0,0 +1,38 @@
+#ifndef CHATSERVER_HISTORY_H
+#define CHATSERVER_HISTORY_H
+
+#include "../buffer.h"
+
+//One file of a channel's log, mapped whole. It holds history packets back to back, so any run of them can be sent
+//as it is.
+typedef struct history_segment {
+    int refs;
+    //Sequence number of the first record, the file is named after it
+    unsigned long firstSeq;
+    int count;
+    //Bytes of records, the rest of the file is zero
+    int used;
+    int size;
+    //Where each record starts
+    int *offsets;
+    int offsetsCapacity;
+    Byte *data;
+    char *path;
+    struct history_segment *next;
+} HistorySegment;
+
+//Called for each run of records a replay sends, the segment stays mapped until it is released.
+typedef void (*HistoryChunk)(HistorySegment *segment, Byte *data, int length, void *arg);
+
+int history_open(const char *dir);
+
+unsigned long history_append(char channel, const Byte *packet, int length);
+
+int history_replay(char channel, Byte mode, unsigned long value, int max_bytes, HistoryChunk chunk, void *arg,
+                   unsigned long *next);
+
+HistorySegment *history_segment_retain(HistorySegment *segment);
+
+void history_segment_release(void *segment);
+
+#endif //CHATSERVER_HISTORY_H
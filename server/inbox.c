@@ -0,0 +1,85 @@
+#include <memory.h>
+#include <stdio.h>
+#include "inbox.h"
+
+//Function Declarations
+void inbox_link(Inbox *inbox, Message *message);
+
+__thread Pool message_pool = POOL_INITIALIZER("message", sizeof(Message), 256);
+
+//Function Implementations
+void inbox_init(Inbox *inbox) {
+    memset(inbox, 0, sizeof(Inbox));
+    inbox->head = &inbox->stub;
+    inbox->tail = &inbox->stub;
+}
+
+Message *message_create(int type) {
+    Message *message = pool_alloc(&message_pool);
+    memset(message, 0, sizeof(Message));
+    message->type = type;
+    message->pool = &message_pool;
+    return message;
+}
+
+void message_free(Message *message) {
+    if (message->frame != NULL) {
+        frame_release(message->frame);
+    }
+
+    pool_free(message->pool, message);
+}
+
+//Returns 1 if the consumer needs to be woken up.
+int inbox_push(Inbox *inbox, Message *message) {
+    inbox_link(inbox, message);
+    return __atomic_exchange_n(&inbox->signaled, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+//Only the consumer may pop. Returns NULL when empty or when a producer is halfway through a push,
+//that producer will signal again once it is done.
+Message *inbox_pop(Inbox *inbox) {
+    Message *tail = inbox->tail;
+    Message *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &inbox->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+
+        inbox->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next != NULL) {
+        inbox->tail = next;
+        return tail;
+    }
+
+    if (tail != __atomic_load_n(&inbox->head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    inbox_link(inbox, &inbox->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (next != NULL) {
+        inbox->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+//The consumer clears the signal before draining, so a push that it misses signals again.
+void inbox_clear_signal(Inbox *inbox) {
+    __atomic_store_n(&inbox->signaled, 0, __ATOMIC_SEQ_CST);
+}
+
+//"private" functions
+void inbox_link(Inbox *inbox, Message *message) {
+    __atomic_store_n(&message->next, NULL, __ATOMIC_RELAXED);
+    Message *prev = __atomic_exchange_n(&inbox->head, message, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, message, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,53 @@
+#ifndef CHATSERVER_INBOX_H
+#define CHATSERVER_INBOX_H
+
+#include "../pool.h"
+#include "frame.h"
+
+#define MESSAGE_BROADCAST 0
+#define MESSAGE_DIRECT 1
+#define MESSAGE_ROSTER 2
+#define MESSAGE_LIST 3
+#define MESSAGE_STATS 4
+#define MESSAGE_QUIT 5
+#define MESSAGE_SESSION 6
+#define MESSAGE_HANDOVER 7
+
+//Work handed from one shard to another.
+typedef struct message {
+    struct message *next;
+    int type;
+    Frame *frame;
+    //Recipient for direct messages, the client to skip for broadcasts
+    int clientId;
+    //Recipient of session messages and of roster and list replies
+    unsigned session;
+    //FEATURE_ bits of the client a roster is for
+    int features;
+    //0 for a broadcast to everyone
+    char channel;
+    int fromShard;
+    Pool *pool;
+} Message;
+
+//Lock free queue with many producers and a single consumer.
+typedef struct inbox {
+    Message *head;
+    Message *tail;
+    Message stub;
+    int signaled;
+} Inbox;
+
+void inbox_init(Inbox *inbox);
+
+Message *message_create(int type);
+
+void message_free(Message *message);
+
+int inbox_push(Inbox *inbox, Message *message);
+
+Message *inbox_pop(Inbox *inbox);
+
+void inbox_clear_signal(Inbox *inbox);
+
+#endif //CHATSERVER_INBOX_H
@@ -1,38 +1,266 @@
+#define _GNU_SOURCE
 #include <netinet/in.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 #include "../list.h"
+#include "../packet.h"
+#include "../pool.h"
 #include "client.h"
+#include "client_table.h"
+#include "channel.h"
+#include "handover.h"
+#include "history.h"
+#include "metrics.h"
+#include "presence.h"
+#include "shard.h"
+#include "timer.h"
+#include "uring.h"
+
+#define DEFAULT_MAX_CLIENTS 1024
+#define EPOLL_MAX_EVENTS 256
+#define WRITEV_MAX_FRAMES 256
+#define METRICS_REQUEST_SIZE 1024
+//Largest framed chat payload accepted by default, --max-message can raise it up to what fits a read buffer.
+#define DEFAULT_MAX_MESSAGE 1024
+//Feature bits this server accepts in a features packet
+#define SERVER_FEATURES (FEATURE_FRAMED | FEATURE_BATCH | FEATURE_COMPRESS | FEATURE_SESSIONS | FEATURE_ROSTER | \
+                         FEATURE_PRESENCE | FEATURE_HEARTBEAT)
+//Longest --presence-window, in milliseconds
+#define PRESENCE_WINDOW_MAX 10000
+//Seconds a connection gets to log in, 0 for as long as it likes
+#define DEFAULT_LOGIN_TIMEOUT 30
+//Seconds of quiet before a heartbeat client is pinged, 0 to never ping
+#define DEFAULT_HEARTBEAT 30
+//Milliseconds an upgrade waits for the new process to take over, and an io_uring shard for its canceled operations
+#define HANDOVER_ACK_WAIT 10000
+#define HANDOVER_CANCEL_WAIT 1000
+//Milliseconds before accepting again after running out of descriptors or memory
+#define ACCEPT_RETRY_WAIT 100
+//Packets smaller than this are sent uncompressed, interactive messages aren't worth the work
+#define DEFAULT_COMPRESS_THRESHOLD 256
+
+//What happens to chat frames for a client whose write queue is over the high watermark
+#define WRITE_POLICY_DROP 0 //Evict the oldest queued chat frames down to the high watermark
+#define WRITE_POLICY_CONFLATE 1 //Keep only the latest conflate_keep chat frames
+#define WRITE_POLICY_DISCONNECT 2 //Disconnect the client
+
+#define DEFAULT_HIGH_WATER_BYTES (64 * 1024)
+#define DEFAULT_LOW_WATER_BYTES (16 * 1024)
+#define DEFAULT_HIGH_WATER_FRAMES 2048
+#define DEFAULT_LOW_WATER_FRAMES 512
+#define DEFAULT_CONFLATE_KEEP 32
+//Other packets are never evicted, a client queueing this many times the high watermark is disconnected whatever the policy.
+#define WRITE_HARD_LIMIT_FACTOR 4
+
+#define IO_BACKEND_EPOLL 0
+#define IO_BACKEND_URING 1
+
+#define URING_ENTRIES 4096
+#define URING_BUFFERS 1024 //Must be a power of two
+#define URING_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+//Linked sends submitted at once for one client, each gathers up to WRITEV_MAX_FRAMES frames
+#define URING_SEND_CHAIN 4
+//Milliseconds before trying again to arm what couldn't get a submission entry
+#define URING_RETRY_WAIT 1
+
+//Operation in the top byte of io_uring user data, the rest is a descriptor and generation or a pointer.
+#define URING_OP_ACCEPT 1ULL
+#define URING_OP_WAKEUP 2ULL
+#define URING_OP_RECV 3ULL
+#define URING_OP_SEND 4ULL
+#define URING_OP_CANCEL 5ULL
+
+//A gathered send in flight, it holds its own frame references until the kernel is done with them.
+typedef struct uring_send {
+    int fd;
+    unsigned generation;
+    int count;
+    struct msghdr msg;
+    struct iovec iov[WRITEV_MAX_FRAMES];
+    Frame *frames[WRITEV_MAX_FRAMES];
+} UringSend;
+
+int max_clients = DEFAULT_MAX_CLIENTS, shard_count = 1, io_backend = IO_BACKEND_EPOLL, connected_clients,
+        fd_shard_capacity, metrics_port = 0, max_message = DEFAULT_MAX_MESSAGE,
+        compress_threshold = DEFAULT_COMPRESS_THRESHOLD, presence_window = 0;
+//In seconds, 0 turns each off
+int login_timeout = DEFAULT_LOGIN_TIMEOUT, idle_timeout = 0, heartbeat = DEFAULT_HEARTBEAT;
+int write_policy = WRITE_POLICY_DROP, high_water_bytes = DEFAULT_HIGH_WATER_BYTES,
+        low_water_bytes = DEFAULT_LOW_WATER_BYTES, high_water_frames = DEFAULT_HIGH_WATER_FRAMES,
+        low_water_frames = DEFAULT_LOW_WATER_FRAMES, conflate_keep = DEFAULT_CONFLATE_KEEP;
+//Where channel history is logged, NULL to keep none
+char *history_dir = NULL;
+//Shard index + 1 of the shard that owns each client descriptor, 0 when unused
+int *fd_shards;
+Shard *shards;
+//The binary and arguments this process was started with, an upgrade without a path runs them again
+char server_path[PATH_MAX];
+char **server_argv;
+//Lines the shards up while they hand their clients over, handover_busy is set by any that still had messages
+pthread_barrier_t handover_barrier;
+int handover_busy;
+//Lines the shards and the main thread up once the clients are saved, and again if the upgrade fails
+pthread_barrier_t upgrade_barrier;
+//What each shard saved for the successor, and the most sessions any shard handed out
+Handover *handovers;
+unsigned handover_sessions;
+//Clients handed to this process for the shards to adopt, the shards that haven't yet and the socket to tell the
+//old process on once they all have
+Handover handover_state;
+HandoverClient *handover_clients;
+int handover_client_count, handover_shards_left, handover_fd = -1;
+long handover_stopped;
+
+//Every shard runs the event loop on its own thread with its own copy of this state.
+__thread Shard *shard;
+__thread int epoll_fd, server_fd, running = 1;
+__thread Link pending_clients;
+__thread long write_syscalls, frames_written;
+//Frames thrown away with a disconnected slow client, chat frames evicted from a queue, clients disconnected for being slow
+__thread long frames_dropped, frames_evicted, slow_disconnects;
+__thread ClientTable *client_table;
+__thread Uring *ring;
+__thread unsigned next_generation;
+//Sessions handed out by this shard so far
+__thread unsigned sessions_allocated;
+//Login, idle and heartbeat deadlines of this shard's clients and its deferred work
+__thread TimerWheel *timers;
+//Millisecond the current loop iteration woke up at
+__thread long loop_now;
+//Runs out at the end of a presence window, publishing its logins and logouts
+__thread Timer presence_timer;
+//Set once the shard is asked to hand its clients over, it takes no more input after that
+__thread int handing_over;
+//A multishot io_uring accept is armed
+__thread int accepting;
+//The multishot io_uring poll on the shard's eventfd is armed
+__thread int waking;
+//Something couldn't get an io_uring submission entry, uring_rearm tries again
+__thread int uring_starved;
+//Accepting ran out of descriptors or memory, the timer tries again as the listener won't report the backlog again
+__thread int accept_starved;
+__thread Timer accept_timer;
 
-#define MAX_SERVER_SIZE 10
+void usage(const char *prog);
 
-#define CHAT_PACKET 0x00
-#define LOGIN_PACKET 0x01
-#define LOGOUT_PACKET 0x02
-#define COMMAND_PACKET 0x03
-#define NID_PACKET 0x04
+int listen_socket_create(uint32_t address, uint16_t port, int flags);
 
-#define SWITCH_COMMAND 0x00
-#define LIST_COMMAND 0x01
+long now_us();
 
-int max_set_size, server_fd, running = 1;
-fd_set rfd, wfd;
-List *client_list;
+long now_ms();
+
+void *shard_run(void *arg);
+
+int loop_timeout();
+
+void presence_schedule();
+
+void presence_expired(Timer *timer);
+
+void accept_retry(int error);
+
+void accept_expired(Timer *timer);
+
+void client_timer_update(Client *client);
+
+void client_timer_expired(Timer *timer);
+
+void shard_loop_epoll();
+
+void shard_loop_uring();
+
+void uring_process_cqe(struct io_uring_cqe *cqe);
+
+void uring_arm_accept();
+
+void uring_arm_wakeup();
+
+void uring_arm_recv(Client *client);
+
+int uring_cancel(unsigned long long user_data, int fd);
+
+void uring_rearm();
+
+void uring_stop_input();
+
+void uring_write(Client *client);
+
+void uring_send_complete(UringSend *send, int result);
+
+int shard_drain_inbox();
+
+void shard_process_message(Message *message);
+
+void shard_post_all(Message *message);
+
+void shard_handover();
+
+void shard_resume();
+
+void shard_adopt();
+
+void handle_input(char *input);
+
+void server_upgrade(char *path);
+
+int handover_load();
+
+int handover_resume(int socket_fd, int fd_limit);
+
+void print_stats();
+
+void metrics_snapshot(Metrics *total);
+
+void *metrics_run(void *arg);
+
+void metrics_serve(int socket_fd);
+
+void raise_fd_limit(int wanted);
+
+void flush_pending();
+
+void write_coalesce(Client *client);
+
+void write_compress(Client *client);
+
+int write_over_high_water(Client *client);
+
+int write_over_hard_limit(Client *client);
+
+void write_apply_policy(Client *client, int blocked);
+
+void write_check_low_water(Client *client);
 
 void do_accept(int socket_fd);
 
+Client *client_accept(int client_fd);
+
+void client_reject(int client_fd);
+
+int client_receive(Client *client, Byte *data, int length);
+
 void do_read(int socket_fd);
 
 void do_write(int socket_fd);
 
-void packet_write(int socket_fd, Buffer *packet);
+int packet_write(int socket_fd, Buffer *packet);
 
-void packet_read(int socket_fd, Buffer *packet);
-
-Buffer *packet_buffer_create(Byte packetId);
+int packet_parse(Client *client);
 
 void packet_process(Client *client);
 
@@ -46,14 +274,30 @@ void packet_process_command(Client *client);
 
 void packet_process_nid(Client *client);
 
-Buffer *packet_client_logout_create(int client_id);
+void packet_process_features(Client *client);
+
+void packet_process_replay(Client *client);
+
+void packet_process_ping(Client *client);
 
-Buffer *packet_server_message_create(const char *msg);
+void history_chunk_write(HistorySegment *segment, Byte *data, int length, void *arg);
+
+Frame *chat_frame_create(char channel, Client *from, Byte to, unsigned to_session, const char *msg, int length);
+
+Frame *session_frame_create(Buffer *packet, Buffer *session_packet);
+
+Buffer *packet_client_logout_create(int client_id);
 
 Buffer *packet_server_logout_create();
 
 void client_write(Client *client, Buffer *packet);
 
+void client_write_frame(Client *client, Frame *frame);
+
+void client_direct_write(int client_id, Frame *frame);
+
+void client_session_write(unsigned session, Frame *frame);
+
 void client_all_write(Buffer *packet);
 
 void client_all_write_except(Buffer *packet, int client_id_except);
@@ -62,153 +306,1740 @@ void client_channel_write(Buffer *buffer, char channel);
 
 void client_channel_write_except(Buffer *buffer, char channel, int client_id_except);
 
+void broadcast_frame(Frame *frame, char channel, int client_id_except);
+
+void broadcast_deliver(Frame *frame, char channel, int client_id_except);
+
+int channel_members_write(Channel *channel, Frame *frame, int client_id_except);
+
+void roster_send(unsigned session, int features);
+
+void roster_snapshot_send(unsigned session);
+
+void roster_frame_send(unsigned session, const Byte *entries, int length);
+
+void list_send(unsigned session, char channel);
+
+void list_entry_send(unsigned session, Client *c);
+
 void client_disconnect(Client *client);
 
 Client *client_get(int socket_fd);
 
-int client_equals(Client *client, int *id);
+int client_shard_get(int client_id);
+
+unsigned session_allocate();
 
-Buffer *packet_nid_create(Client *client) ;
+Client *client_session_get(unsigned session);
 
-void client_list_free(Client *client) ;
+int session_shard(unsigned session);
 
 int main(int argc, char **argv) {
-    fd_set copy_rfd, copy_wfd;
-    int selected;
+    struct rlimit limit;
+    char input[256];
+    int opt, listeners = 0;
     uint16_t port;
-    struct sockaddr_in server_addr;
 
-    if (argc < 2) {
+    static struct option long_options[] = {
+            {"max-clients", required_argument, NULL, 'm'},
+            {"threads",     required_argument, NULL, 't'},
+            {"io",          required_argument, NULL, 'i'},
+            {"write-policy", required_argument, NULL, 'p'},
+            {"high-water",  required_argument, NULL, 'H'},
+            {"low-water",   required_argument, NULL, 'L'},
+            {"high-frames", required_argument, NULL, 'F'},
+            {"low-frames",  required_argument, NULL, 'f'},
+            {"conflate",    required_argument, NULL, 'c'},
+            {"metrics-port", required_argument, NULL, 'M'},
+            {"max-message", required_argument, NULL, 'x'},
+            {"compress-threshold", required_argument, NULL, 'z'},
+            {"presence-window", required_argument, NULL, 'w'},
+            {"history-dir", required_argument, NULL, 'd'},
+            {"login-timeout", required_argument, NULL, 'l'},
+            {"idle-timeout", required_argument, NULL, 'I'},
+            {"heartbeat",   required_argument, NULL, 'b'},
+            {"help",        no_argument,       NULL, 'h'},
+            {NULL, 0,                          NULL, 0}
+    };
+
+    //Kept before getopt reorders them, and the path before an upgrade can replace the file.
+    server_argv = calloc((size_t) argc + 1, sizeof(char *));
+    memcpy(server_argv, argv, argc * sizeof(char *));
+    ssize_t path_length = readlink("/proc/self/exe", server_path, sizeof(server_path) - 1);
+    server_path[path_length < 0 ? 0 : path_length] = '\0';
+
+    while ((opt = getopt_long(argc, argv, "m:t:i:p:H:L:F:f:c:M:x:z:w:d:l:I:b:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'm':
+                max_clients = atoi(optarg);
+                if (max_clients <= 0) {
+                    fprintf(stderr, "Please input a valid client limit.\n");
+                    exit(0);
+                }
+                break;
+            case 't':
+                shard_count = atoi(optarg);
+                if (shard_count <= 0) {
+                    fprintf(stderr, "Please input a valid thread count.\n");
+                    exit(0);
+                }
+                break;
+            case 'i':
+                if (strcmp(optarg, "epoll") == 0) {
+                    io_backend = IO_BACKEND_EPOLL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    io_backend = IO_BACKEND_URING;
+                } else {
+                    fprintf(stderr, "Please input epoll or uring as the I/O backend.\n");
+                    exit(0);
+                }
+                break;
+            case 'p':
+                if (strcmp(optarg, "drop") == 0) {
+                    write_policy = WRITE_POLICY_DROP;
+                } else if (strcmp(optarg, "conflate") == 0) {
+                    write_policy = WRITE_POLICY_CONFLATE;
+                } else if (strcmp(optarg, "disconnect") == 0) {
+                    write_policy = WRITE_POLICY_DISCONNECT;
+                } else {
+                    fprintf(stderr, "Please input drop, conflate or disconnect as the write policy.\n");
+                    exit(0);
+                }
+                break;
+            case 'H':
+                high_water_bytes = atoi(optarg);
+                break;
+            case 'L':
+                low_water_bytes = atoi(optarg);
+                break;
+            case 'F':
+                high_water_frames = atoi(optarg);
+                break;
+            case 'f':
+                low_water_frames = atoi(optarg);
+                break;
+            case 'c':
+                conflate_keep = atoi(optarg);
+                if (conflate_keep <= 0) {
+                    fprintf(stderr, "Please input a valid number of chat frames to keep.\n");
+                    exit(0);
+                }
+                break;
+            case 'M':
+                metrics_port = atoi(optarg);
+                if (metrics_port <= 0 || metrics_port > 65535) {
+                    fprintf(stderr, "Please input a valid metrics port.\n");
+                    exit(0);
+                }
+                break;
+            case 'x':
+                max_message = atoi(optarg);
+                //A whole packet has to fit the client's read buffer, session chats have the larger header.
+                if (max_message < 0 || max_message > CLIENT_READ_BUFFER_SIZE - SESSION_CHAT_HEADER_MAX) {
+                    fprintf(stderr, "Please input a message limit between 0 and %d bytes.\n",
+                            CLIENT_READ_BUFFER_SIZE - SESSION_CHAT_HEADER_MAX);
+                    exit(0);
+                }
+                break;
+            case 'z':
+                compress_threshold = atoi(optarg);
+                //0 turns compression off.
+                if (compress_threshold < 0 || compress_threshold > COMPRESS_MAX_CONTENTS) {
+                    fprintf(stderr, "Please input a compression threshold between 0 and %d bytes.\n",
+                            COMPRESS_MAX_CONTENTS);
+                    exit(0);
+                }
+                break;
+            case 'w':
+                presence_window = atoi(optarg);
+                //0 sends every login and logout on its own right away.
+                if (presence_window < 0 || presence_window > PRESENCE_WINDOW_MAX) {
+                    fprintf(stderr, "Please input a presence window between 0 and %d milliseconds.\n",
+                            PRESENCE_WINDOW_MAX);
+                    exit(0);
+                }
+                break;
+            case 'd':
+                history_dir = optarg;
+                break;
+            case 'l':
+                login_timeout = atoi(optarg);
+                if (login_timeout < 0) {
+                    fprintf(stderr, "Please input a valid login timeout.\n");
+                    exit(0);
+                }
+                break;
+            case 'I':
+                idle_timeout = atoi(optarg);
+                if (idle_timeout < 0) {
+                    fprintf(stderr, "Please input a valid idle timeout.\n");
+                    exit(0);
+                }
+                break;
+            case 'b':
+                heartbeat = atoi(optarg);
+                if (heartbeat < 0) {
+                    fprintf(stderr, "Please input a valid heartbeat interval.\n");
+                    exit(0);
+                }
+                break;
+            default:
+                usage(argv[0]);
+                exit(0);
+        }
+    }
+
+    if (optind >= argc) {
         fprintf(stderr, "Please input a port number.\n");
+        usage(argv[0]);
         exit(0);
     }
 
-    port = (uint16_t) atoi(argv[1]);
+    port = (uint16_t) atoi(argv[optind]);
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        perror("socket");
+    if (high_water_bytes <= 0 || high_water_frames <= 0 || low_water_bytes < 0 || low_water_frames < 0 ||
+        low_water_bytes > high_water_bytes || low_water_frames > high_water_frames) {
+        fprintf(stderr, "Please input watermarks with 0 <= low <= high and high > 0.\n");
+        exit(0);
+    }
+
+    //A peer that closes its end must not kill the server through a write, errors are handled per client instead.
+    signal(SIGPIPE, SIG_IGN);
+
+    //Listeners, epoll and event descriptors and stdin/stdout/stderr need descriptors on top of the clients.
+    raise_fd_limit(max_clients + 3 * shard_count + 16);
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        perror("getrlimit");
+        exit(EXIT_FAILURE);
+    }
+
+    //Started by an upgrade, the clients have to get their descriptor numbers back before anything else is opened.
+    char *handover_env = getenv(HANDOVER_FD_ENV);
+
+    if (handover_env != NULL) {
+        unsetenv(HANDOVER_FD_ENV);
+        listeners = handover_resume(atoi(handover_env), (int) limit.rlim_cur);
+
+        if (listeners < 0) {
+            fprintf(stderr, "Failed to take over from the old process.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (history_dir != NULL && history_open(history_dir) < 0) {
+        fprintf(stderr, "Failed to open the history in %s.\n", history_dir);
         exit(EXIT_FAILURE);
     }
 
+    fd_shard_capacity = (int) limit.rlim_cur;
+    fd_shards = calloc((size_t) fd_shard_capacity, sizeof(int));
+    shards = calloc((size_t) shard_count, sizeof(Shard));
+
+    //Every shard listens on its own SO_REUSEPORT socket and the kernel spreads connections between them. Sockets
+    //handed over keep the connections waiting in their backlog.
+    for (int i = 0; i < shard_count; i++) {
+        int listen_fd = i < listeners ? handover_state.fds[i] : listen_socket_create(INADDR_ANY, port, SOCK_NONBLOCK);
+
+        if (listen_fd < 0 || shard_init(&shards[i], i, listen_fd) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = shard_count; i < listeners; i++) {
+        close(handover_state.fds[i]);
+    }
+
+    printf("Running server on port %d (max %d clients, %d threads, %s).\n", port, max_clients, shard_count,
+           io_backend == IO_BACKEND_URING ? "io_uring" : "epoll");
+    printf("Server started!\nWaiting for client...\n");
+    fflush(stdout);
+
+    for (int i = 0; i < shard_count; i++) {
+        if (pthread_create(&shards[i].thread, NULL, &shard_run, &shards[i]) != 0) {
+            fprintf(stderr, "Failed to start thread %d.\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    //Scrapes are served from their own thread and only read the shards' counters.
+    if (metrics_port != 0) {
+        pthread_t metrics_thread;
+        int metrics_fd = listen_socket_create(INADDR_LOOPBACK, (uint16_t) metrics_port, 0);
+
+        if (metrics_fd < 0 ||
+            pthread_create(&metrics_thread, NULL, &metrics_run, (void *) (intptr_t) metrics_fd) != 0) {
+            fprintf(stderr, "Failed to start the metrics endpoint.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        pthread_detach(metrics_thread);
+        printf("Serving metrics on http://127.0.0.1:%d/metrics\n", metrics_port);
+        fflush(stdout);
+    }
+
+    //The main thread only handles server commands.
+    while (fgets(input, 256, stdin) != NULL) {
+        handle_input(input);
+    }
+
+    for (int i = 0; i < shard_count; i++) {
+        pthread_join(shards[i].thread, NULL);
+    }
+
+    return 0;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--max-clients n] [--threads n] [--io epoll|uring]\n"
+                    "       [--write-policy drop|conflate|disconnect] [--high-water bytes] [--low-water bytes]\n"
+                    "       [--high-frames n] [--low-frames n] [--conflate n] [--metrics-port port]\n"
+                    "       [--max-message bytes] [--compress-threshold bytes] [--presence-window ms]\n"
+                    "       [--history-dir path] [--login-timeout s] [--idle-timeout s] [--heartbeat s] <port>\n",
+            prog);
+}
+
+int listen_socket_create(uint32_t address, uint16_t port, int flags) {
+    struct sockaddr_in server_addr;
+    int one = 1;
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | flags, 0);
+    if (listen_fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("setsockopt");
+        close(listen_fd);
+        return -1;
+    }
+
     memset(&server_addr, 0, sizeof(struct sockaddr_in));
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(port);
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    server_addr.sin_addr.s_addr = htonl(address);
 
-    if (bind(server_fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
+    if (bind(listen_fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
         perror("bind");
+        close(listen_fd);
+        return -1;
+    }
+
+    if (listen(listen_fd, SOMAXCONN) < 0) {
+        perror("listen");
+        close(listen_fd);
+        return -1;
+    }
+
+    return listen_fd;
+}
+
+long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+long now_ms() {
+    return now_us() / 1000;
+}
+
+//Milliseconds the loop may sleep until the next timer is due, -1 to sleep until something happens. Quitting and
+//everything else another thread asks for wakes the loop through the inbox.
+int loop_timeout() {
+    long next = timer_wheel_next(timers);
+
+    if (next < 0) {
+        return -1;
+    }
+
+    long remaining = next - now_ms();
+    return remaining <= 0 ? 0 : (int) remaining;
+}
+
+//Starts a presence window with the first login or logout since the last one ended.
+void presence_schedule() {
+    if (!timer_pending(&presence_timer)) {
+        timer_schedule(timers, &presence_timer, now_ms() + presence_window);
+    }
+}
+
+//Publishes this shard's logins and logouts of an ended window to everyone, one frame for all of them.
+void presence_expired(Timer *timer) {
+    Frame *frame = presence_frame_create();
+
+    //They may all have cancelled out.
+    if (frame != NULL) {
+        broadcast_frame(frame, 0, -1);
+        frame_release(frame);
+    }
+}
+
+//Accepting ran out of descriptors or memory with connections left in the backlog. Nothing reports them again, so
+//accepting is tried again after ACCEPT_RETRY_WAIT, only the first failure in a row is reported.
+void accept_retry(int error) {
+    if (!accept_starved) {
+        fprintf(stderr, "accept: %s\n", strerror(error));
+    }
+
+    accept_starved = 1;
+
+    if (!timer_pending(&accept_timer)) {
+        timer_schedule(timers, &accept_timer, now_ms() + ACCEPT_RETRY_WAIT);
+    }
+}
+
+void accept_expired(Timer *timer) {
+    if (handing_over)
+        return;
+
+    if (io_backend == IO_BACKEND_URING) {
+        if (!accepting) {
+            uring_arm_accept();
+        }
+    } else {
+        do_accept(server_fd);
+    }
+}
+
+void *shard_run(void *arg) {
+    Uring shard_ring;
+    TimerWheel shard_timers;
+
+    shard = arg;
+    metrics = &shard->metrics;
+    server_fd = shard->listenFd;
+    client_table = client_table_create(max_clients / shard_count);
+    link_init(&pending_clients);
+    loop_now = now_ms();
+    timer_wheel_init(&shard_timers, loop_now);
+    timers = &shard_timers;
+    timer_init(&presence_timer, &presence_expired);
+    timer_init(&accept_timer, &accept_expired);
+
+    if (io_backend == IO_BACKEND_URING) {
+        if (uring_init(&shard_ring, URING_ENTRIES) < 0 ||
+            uring_setup_buffers(&shard_ring, URING_BUFFERS, URING_BUFFER_SIZE, URING_BUFFER_GROUP) < 0) {
+            fprintf(stderr, "io_uring is not available.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        ring = &shard_ring;
+        shard_loop_uring();
+        uring_free(ring);
+    } else {
+        shard_loop_epoll();
+    }
+
+    client_table_free(client_table, &client_free);
+    return NULL;
+}
+
+void shard_loop_epoll() {
+    struct epoll_event event, events[EPOLL_MAX_EVENTS];
+    int selected;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = server_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &event) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    event.events = EPOLLIN;
+    event.data.fd = shard->eventFd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, shard->eventFd, &event) < 0) {
+        perror("epoll_ctl");
         exit(EXIT_FAILURE);
     }
 
-    printf("Running server on port %d.\n", port);
+    shard_adopt();
+
+    while (running) {
+        selected = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, loop_timeout());
+
+        if (selected < 0) {
+            if (errno == EINTR)
+                continue;
+
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+
+        long start = now_us();
+        loop_now = start / 1000;
+
+        //Only the descriptors that are ready get dispatched. Those left when a handover starts stay ready for the
+        //successor, see shard_resume if there turns out to be none.
+        for (int i = 0; i < selected && !handing_over; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == server_fd) {
+                do_accept(server_fd);
+                continue;
+            }
+
+            if (fd == shard->eventFd) {
+                shard_drain_inbox();
+                continue;
+            }
+
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                do_read(fd);
+            }
+
+            //The client may have been disconnected by the read. Writes that weren't blocked are left to
+            //flush_pending, which may coalesce them with the rest of this iteration's.
+            if (events[i].events & EPOLLOUT) {
+                Client *client = client_get(fd);
+                if (client && client->writeBlocked) {
+                    client->writeBlocked = 0;
+                    do_write(fd);
+                }
+            }
+        }
+
+        if (handing_over) {
+            shard_handover();
+        }
+
+        timer_wheel_advance(timers, now_ms());
+        flush_pending();
+
+        //Timeouts with nothing to do would only pull the distribution towards zero.
+        if (selected > 0) {
+            histogram_observe(&metrics->loopTime, now_us() - start);
+        }
+    }//End while running
+
+    close(epoll_fd);
+}
+
+//Completion driven loop, every submission made while handling completions goes out with the next wait.
+void shard_loop_uring() {
+    struct io_uring_cqe *cqe;
+    int handled;
+
+    uring_arm_accept();
+    uring_arm_wakeup();
+    shard_adopt();
+
+    while (running) {
+        int timeout = loop_timeout();
+
+        if (uring_starved && (timeout < 0 || timeout > URING_RETRY_WAIT)) {
+            timeout = URING_RETRY_WAIT;
+        }
+
+        if (uring_submit_and_wait(ring, timeout) < 0) {
+            exit(EXIT_FAILURE);
+        }
+
+        long start = now_us();
+        loop_now = start / 1000;
+        handled = 0;
+
+        while (!handing_over && (cqe = uring_peek_cqe(ring)) != NULL) {
+            struct io_uring_cqe copy = *cqe;
+            uring_cqe_seen(ring);
+            uring_process_cqe(&copy);
+            handled++;
+        }
+
+        if (handing_over) {
+            shard_handover();
+        }
+
+        if (uring_starved) {
+            uring_rearm();
+        }
+
+        timer_wheel_advance(timers, now_ms());
+        flush_pending();
+
+        if (handled > 0) {
+            histogram_observe(&metrics->loopTime, now_us() - start);
+        }
+    }//End while running
+}
+
+void uring_process_cqe(struct io_uring_cqe *cqe) {
+    unsigned long long op = cqe->user_data >> 56;
+    int fd = (int) (cqe->user_data & 0xFFFFFFFF);
+    unsigned generation = (unsigned) ((cqe->user_data >> 32) & 0xFFFFFF);
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    Client *client;
+
+    switch (op) {
+        case URING_OP_ACCEPT:
+            if (!more)
+                accepting = 0;
+
+            //Connections accepted while handing over are handed over before they send anything.
+            if (cqe->res >= 0) {
+                accept_starved = 0;
+                client = client_accept(cqe->res);
+                if (client && !handing_over) {
+                    uring_arm_recv(client);
+                }
+            } else if (cqe->res == -EMFILE || cqe->res == -ENFILE || cqe->res == -ENOBUFS || cqe->res == -ENOMEM) {
+                accept_retry(-cqe->res);
+            } else if (cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECANCELED) {
+                fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+            }
+
+            if (!more && running && !handing_over && !timer_pending(&accept_timer))
+                uring_arm_accept();
+            break;
+        case URING_OP_WAKEUP:
+            if (!more)
+                waking = 0;
+
+            shard_drain_inbox();
+
+            if (!more && running)
+                uring_arm_wakeup();
+            break;
+        case URING_OP_RECV:
+            client = client_get(fd);
+
+            if (client == NULL || client->generation != generation) {
+                //Completion for a client that is already gone.
+                if (cqe->flags & IORING_CQE_F_BUFFER)
+                    uring_recycle_buffer(ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                break;
+            }
+
+            if (!more)
+                client->receiving = 0;
+
+            if (cqe->res > 0) {
+                int id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                METRIC_ADD(metrics->bytesIn, cqe->res);
+                int connected = client_receive(client, uring_buffer(ring, id), cqe->res);
+                uring_recycle_buffer(ring, id);
+
+                if (connected < 0)
+                    break;
+
+                if (!more && !handing_over)
+                    uring_arm_recv(client);
+                break;
+            }
+
+            //Out of provided buffers, they come back as completions are handled.
+            if (cqe->res == -ENOBUFS) {
+                if (!more && !handing_over)
+                    uring_arm_recv(client);
+                break;
+            }
+
+            //Stopped to hand the socket over, the client stays connected.
+            if (cqe->res == -ECANCELED && handing_over)
+                break;
+
+            if (cqe->res < 0 && cqe->res != -ECANCELED) {
+                fprintf(stderr, "recv: %s\n", strerror(-cqe->res));
+            }
+
+            client_disconnect(client);
+            break;
+        case URING_OP_SEND:
+            uring_send_complete((UringSend *) (uintptr_t) (cqe->user_data & 0x00FFFFFFFFFFFFFFULL), cqe->res);
+            break;
+        default:
+            break;
+    }
+}
+
+void uring_arm_accept() {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+    if (sqe == NULL) {
+        uring_starved = 1;
+        return;
+    }
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = URING_OP_ACCEPT << 56;
+    accepting = 1;
+}
+
+void uring_arm_wakeup() {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+    if (sqe == NULL) {
+        uring_starved = 1;
+        return;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = shard->eventFd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_OP_WAKEUP << 56;
+    waking = 1;
+}
+
+//Multishot receive into the provided buffers, completions keep coming until it is canceled or fails.
+void uring_arm_recv(Client *client) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+    if (sqe == NULL) {
+        uring_starved = 1;
+        return;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->id;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = URING_OP_RECV << 56 | (unsigned long long) (client->generation & 0xFFFFFF) << 32 |
+                     (unsigned) client->id;
+    client->receiving = 1;
+}
+
+//Cancels the operation submitted with user_data, or with fd >= 0 every operation on that descriptor. Their
+//completions come with -ECANCELED, a send that got part of the way reports the bytes it sent instead. Returns -1 if
+//the ring had no room for the cancel.
+int uring_cancel(unsigned long long user_data, int fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+    if (sqe == NULL) {
+        fprintf(stderr, "No room in the ring to cancel (uring_cancel).\n");
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->user_data = URING_OP_CANCEL << 56;
+
+    if (fd >= 0) {
+        sqe->fd = fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    } else {
+        sqe->fd = -1;
+        sqe->addr = user_data;
+    }
+
+    return 0;
+}
+
+//Arms what couldn't get a submission entry or was stopped for a handover again: the accept, the wakeup and the
+//receives, and queues the writes of clients with nothing in flight.
+void uring_rearm() {
+    uring_starved = 0;
+
+    if (!accepting && !timer_pending(&accept_timer)) {
+        uring_arm_accept();
+    }
+
+    if (!waking) {
+        uring_arm_wakeup();
+    }
+
+    for (int i = 0; i < client_table->size; i++) {
+        Client *client = client_table->clients[i];
+
+        if (!client->receiving) {
+            uring_arm_recv(client);
+        }
+
+        if (client->sendsInFlight == 0 && client->writeQueue->size != 0 && !link_is_linked(&client->pendingLink)) {
+            link_add_tail(&pending_clients, &client->pendingLink);
+        }
+    }
+}
+
+//Cancels the accept and everything in flight on the clients and waits for their completions, so the kernel is done
+//with the sockets and every write offset is exact before another process takes them. Clients whose operations
+//haven't completed after HANDOVER_CANCEL_WAIT are disconnected.
+void uring_stop_input() {
+    struct io_uring_cqe *cqe;
+    long deadline = now_ms() + HANDOVER_CANCEL_WAIT;
+
+    if (accepting) {
+        uring_cancel(URING_OP_ACCEPT << 56, -1);
+    }
+
+    for (int i = 0; i < client_table->size; i++) {
+        Client *client = client_table->clients[i];
+
+        if (client->receiving || client->sendsInFlight != 0) {
+            uring_cancel(0, client->id);
+        }
+    }
+
+    while (1) {
+        int busy = accepting;
+
+        for (int i = 0; i < client_table->size && !busy; i++) {
+            busy = client_table->clients[i]->receiving || client_table->clients[i]->sendsInFlight != 0;
+        }
+
+        long remaining = deadline - now_ms();
+
+        if (!busy || remaining <= 0)
+            break;
+
+        if (uring_submit_and_wait(ring, (int) remaining) < 0) {
+            exit(EXIT_FAILURE);
+        }
+
+        loop_now = now_ms();
+
+        while ((cqe = uring_peek_cqe(ring)) != NULL) {
+            struct io_uring_cqe copy = *cqe;
+            uring_cqe_seen(ring);
+            uring_process_cqe(&copy);
+        }
+    }
+
+    //Disconnecting moves the last client into the hole.
+    for (int i = client_table->size - 1; i >= 0; i--) {
+        Client *client = client_table->clients[i];
+
+        if (client->receiving || client->sendsInFlight != 0) {
+            printf("Client %d could not be handed over.\n", client->id);
+            client_disconnect(client);
+        }
+    }
+}
+
+//Submits the client's queue as a chain of linked gathered sends, MSG_WAITALL makes a short send break the chain
+//so later sends never skip bytes. A chain has to go out in one submission, so it is cut short to the room in the ring.
+void uring_write(Client *client) {
+    int first = 0;
+    int room = uring_sq_space(ring);
+
+    if (room == 0 && uring_submit(ring) >= 0) {
+        room = uring_sq_space(ring);
+    }
+
+    if (room == 0) {
+        uring_starved = 1;
+        return;
+    }
+
+    for (int i = 0; i < URING_SEND_CHAIN && i < room && first < client->writeQueue->size; i++) {
+        UringSend *send = malloc(sizeof(UringSend));
+        send->fd = client->id;
+        send->generation = client->generation;
+        send->count = client_gather_write(client, first, send->iov, WRITEV_MAX_FRAMES);
+
+        for (int j = 0; j < send->count; j++) {
+            send->frames[j] = frame_retain(deque_get(client->writeQueue, first + j));
+        }
+
+        memset(&send->msg, 0, sizeof(send->msg));
+        send->msg.msg_iov = send->iov;
+        send->msg.msg_iovlen = (size_t) send->count;
+        first += send->count;
+
+        struct io_uring_sqe *sqe = uring_get_sqe(ring);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = client->id;
+        sqe->addr = (unsigned long) &send->msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->user_data = URING_OP_SEND << 56 | (uintptr_t) send;
+
+        if (i + 1 < URING_SEND_CHAIN && i + 1 < room && first < client->writeQueue->size) {
+            sqe->flags = IOSQE_IO_LINK;
+        }
+
+        client->sendsInFlight++;
+        write_syscalls++;
+    }
+
+    client->sendingFrames = first;
+}
+
+void uring_send_complete(UringSend *send, int result) {
+    Client *client = client_get(send->fd);
+
+    if (client != NULL && client->generation == send->generation) {
+        client->sendsInFlight--;
+
+        if (result > 0) {
+            METRIC_ADD(metrics->bytesOut, result);
+            frames_written += client_advance_write(client, result);
+            write_check_low_water(client);
+        }
+
+        if (client->sendsInFlight == 0) {
+            client->sendingFrames = 0;
+        }
+
+        if (result < 0 && result != -ECANCELED) {
+            fprintf(stderr, "sendmsg: %s\n", strerror(-result));
+            client_disconnect(client);
+        } else if (client->sendsInFlight == 0 && client->writeQueue->size != 0 &&
+                   !link_is_linked(&client->pendingLink)) {
+            link_add_tail(&pending_clients, &client->pendingLink);
+        }
+    }
+
+    for (int i = 0; i < send->count; i++) {
+        frame_release(send->frames[i]);
+    }
+
+    free(send);
+}
+
+//Processes every message in the inbox, returns how many there were.
+int shard_drain_inbox() {
+    Message *message;
+    int count = 0;
+
+    shard_clear_wakeup(shard);
+
+    while ((message = inbox_pop(&shard->inbox)) != NULL) {
+        shard_process_message(message);
+        message_free(message);
+        count++;
+    }
+
+    return count;
+}
+
+void shard_process_message(Message *message) {
+    Client *client;
+
+    switch (message->type) {
+        case MESSAGE_BROADCAST:
+            broadcast_deliver(message->frame, message->channel, message->clientId);
+            break;
+        case MESSAGE_DIRECT:
+            client = client_get(message->clientId);
+            if (client) {
+                client_write_frame(client, message->frame);
+            }
+            break;
+        case MESSAGE_SESSION:
+            client = client_session_get(message->session);
+            if (client) {
+                client_write_frame(client, message->frame);
+            }
+            break;
+        case MESSAGE_ROSTER:
+            roster_send(message->session, message->features);
+            break;
+        case MESSAGE_LIST:
+            list_send(message->session, message->channel);
+            break;
+        case MESSAGE_STATS:
+            print_stats();
+            break;
+        case MESSAGE_QUIT:
+            running = 0;
+            break;
+        case MESSAGE_HANDOVER:
+            //The loop hands over once it is done with what it is handling.
+            handing_over = 1;
+            break;
+        default:
+            break;
+    }
+}
+
+//Sends a copy of the message to every shard but the calling one, the original is freed.
+void shard_post_all(Message *message) {
+    for (int i = 0; i < shard_count; i++) {
+        if (shard != NULL && i == shard->index)
+            continue;
+
+        Message *copy = message_create(message->type);
+        copy->frame = message->frame != NULL ? frame_retain(message->frame) : NULL;
+        copy->clientId = message->clientId;
+        copy->session = message->session;
+        copy->features = message->features;
+        copy->channel = message->channel;
+        copy->fromShard = message->fromShard;
+        shard_send(&shards[i], copy);
+    }
+
+    message_free(message);
+}
+
+//Saves this shard's clients for the process taking over, see server_upgrade. Every shard runs this at the same time
+//and reads nothing more from its clients, it only returns if the new process failed to take over.
+void shard_handover() {
+    int busy;
+
+    if (io_backend == IO_BACKEND_URING) {
+        uring_stop_input();
+    }
+
+    //Logins and logouts waiting for the end of their window are published now, the successor knows nothing of them.
+    if (timer_pending(&presence_timer)) {
+        timer_cancel(timers, &presence_timer);
+        presence_expired(&presence_timer);
+    }
+
+    //Messages between shards can make more of them, drain every inbox until a round in which none had any.
+    do {
+        pthread_barrier_wait(&handover_barrier);
+
+        if (shard_drain_inbox() > 0) {
+            __atomic_store_n(&handover_busy, 1, __ATOMIC_RELAXED);
+        }
+
+        pthread_barrier_wait(&handover_barrier);
+        busy = __atomic_load_n(&handover_busy, __ATOMIC_RELAXED);
+
+        if (pthread_barrier_wait(&handover_barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+            __atomic_store_n(&handover_busy, 0, __ATOMIC_RELAXED);
+        }
+    } while (busy);
+
+    Handover *saved = &handovers[shard->index];
+    handover_init(saved);
+
+    for (int i = 0; i < client_table->size; i++) {
+        Client *client = client_table->clients[i];
+
+        if (handover_put_client(saved, client) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    unsigned sessions = __atomic_load_n(&handover_sessions, __ATOMIC_RELAXED);
+
+    while (sessions < sessions_allocated &&
+           !__atomic_compare_exchange_n(&handover_sessions, &sessions, sessions_allocated, 0, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+    }
+
+    //Saved, then wait for the outcome. The process exits once the new one has taken over, so getting past the second
+    //wait means it didn't and this shard carries on with the clients it still has.
+    pthread_barrier_wait(&upgrade_barrier);
+    pthread_barrier_wait(&upgrade_barrier);
+    shard_resume();
+}
+
+//Starts the input stopped for a handover again. Readiness epoll reported while handing over wasn't dispatched and
+//won't be reported again, so every socket is tried once by hand.
+void shard_resume() {
+    handing_over = 0;
+
+    if (io_backend == IO_BACKEND_URING) {
+        uring_rearm();
+        return;
+    }
+
+    do_accept(server_fd);
+
+    //A read may disconnect the client, which moves the last client into the hole.
+    for (int i = client_table->size - 1; i >= 0; i--) {
+        Client *client = client_table->clients[i];
+        client->writeBlocked = 0;
+
+        if (client->writeQueue->size != 0 && !link_is_linked(&client->pendingLink)) {
+            link_add_tail(&pending_clients, &client->pendingLink);
+        }
+
+        do_read(client->id);
+    }
+}
+
+//Takes over the clients handed to this process that belong to this shard. Their descriptors are already at the
+//numbers their peers know them by, only the shard's own state has to be built up again.
+void shard_adopt() {
+    struct epoll_event event;
+
+    if (handover_clients == NULL)
+        return;
+
+    //Sessions handed out before keep meaning the same clients.
+    sessions_allocated = handover_sessions;
+
+    for (int i = 0; i < handover_client_count; i++) {
+        if (session_shard(handover_clients[i].session) != shard->index)
+            continue;
+
+        Client *client = handover_client_restore(&handover_clients[i]);
+        client->generation = ++next_generation;
+
+        if (client_table_add(client_table, client) < 0) {
+            close(client->id);
+            client_free(client);
+            continue;
+        }
+
+        __atomic_store_n(&fd_shards[client->id], shard->index + 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&connected_clients, 1, __ATOMIC_RELAXED);
+
+        if (strlen(client->name) != 0) {
+            channel_join(client, client->channel);
+        }
+
+        client->acceptedAt = loop_now;
+        client->lastActive = loop_now;
+        timer_init(&client->timer, &client_timer_expired);
+        client_timer_update(client);
+
+        if (io_backend == IO_BACKEND_URING) {
+            uring_arm_recv(client);
+        } else {
+            memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            event.data.fd = client->id;
+
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->id, &event) < 0) {
+                perror("epoll_ctl");
+                client_disconnect(client);
+                continue;
+            }
+        }
+
+        //What the old process had queued goes out with the first flush.
+        if (client->writeQueue->size != 0) {
+            link_add_tail(&pending_clients, &client->pendingLink);
+        }
+    }
+
+    //The last shard done tells the old process it can go.
+    if (__atomic_sub_fetch(&handover_shards_left, 1, __ATOMIC_ACQ_REL) == 0) {
+        printf("Resumed %d clients %.1f ms after they stopped being served.\n", handover_client_count,
+               (now_us() - handover_stopped) / 1000.0);
+        fflush(stdout);
+
+        if (handover_fd >= 0) {
+            Byte ack = 1;
+
+            if (write(handover_fd, &ack, 1) < 0) {
+                perror("write");
+            }
+
+            close(handover_fd);
+            handover_fd = -1;
+        }
+
+        free(handover_clients);
+        handover_clients = NULL;
+        handover_client_count = 0;
+        handover_free(&handover_state);
+    }
+
+    flush_pending();
+}
+
+void handle_input(char *input) {
+    printf("Received input\n");
+
+    if (strcmp("stats\n", input) == 0) {
+        Metrics total;
+
+        printf("Clients: %d\n", __atomic_load_n(&connected_clients, __ATOMIC_RELAXED));
+        metrics_snapshot(&total);
+        metrics_print(stdout, &total);
+        shard_post_all(message_create(MESSAGE_STATS));
+        return;
+    }
+
+    if (strcmp("quit\n", input) == 0) {
+        printf("Quiting...\n");
+        shard_post_all(message_create(MESSAGE_QUIT));
+
+        for (int i = 0; i < shard_count; i++) {
+            pthread_join(shards[i].thread, NULL);
+        }
+
+        exit(0);
+    }
+
+    if (strncmp("upgrade", input, 7) == 0 && (input[7] == '\n' || input[7] == ' ')) {
+        char *path = strtok(input + 7, " \n");
+        server_upgrade(path != NULL ? path : server_path);
+    }
+}
+
+//Starts path with this process's arguments and hands it the listening sockets and every client over a Unix socket,
+//the shards stop taking input and save their clients first. Clients keep their connections, descriptor IDs and
+//sessions and don't notice. If the new process doesn't confirm it took over, this one kills it and the shards carry
+//on with the clients they kept.
+void server_upgrade(char *path) {
+    int pair[2], client_count = 0;
+    char fd_env[16];
+    Handover state;
+    Byte ack;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        perror("socketpair");
+        return;
+    }
+
+    printf("Upgrading to %s...\n", path);
+    fflush(stdout);
+    snprintf(fd_env, sizeof(fd_env), "%d", pair[1]);
+    setenv(HANDOVER_FD_ENV, fd_env, 1);
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        fcntl(pair[1], F_SETFD, 0);
+        execv(path, server_argv);
+        _exit(127);
+    }
+
+    unsetenv(HANDOVER_FD_ENV);
+    close(pair[1]);
+
+    if (pid < 0) {
+        perror("fork");
+        close(pair[0]);
+        return;
+    }
+
+    long stopped = now_us();
+    handovers = calloc((size_t) shard_count, sizeof(Handover));
+    handover_sessions = 0;
+    pthread_barrier_init(&handover_barrier, NULL, (unsigned) shard_count);
+    pthread_barrier_init(&upgrade_barrier, NULL, (unsigned) shard_count + 1);
+    shard_post_all(message_create(MESSAGE_HANDOVER));
+    pthread_barrier_wait(&upgrade_barrier);
+
+    for (int i = 0; i < shard_count; i++) {
+        client_count += handovers[i].fdCount;
+    }
+
+    //A header, the listening sockets in shard order, then every shard's clients.
+    handover_init(&state);
+    handover_put_u32(&state, (unsigned) shard_count);
+    handover_put_u32(&state, handover_sessions);
+    handover_put_u64(&state, (unsigned long) stopped);
+    handover_put_u32(&state, (unsigned) client_count);
+
+    for (int i = 0; i < shard_count; i++) {
+        handover_put_fd(&state, shards[i].listenFd);
+    }
+
+    for (int i = 0; i < shard_count; i++) {
+        handover_append(&state, &handovers[i]);
+        handover_free(&handovers[i]);
+    }
+
+    free(handovers);
+    handovers = NULL;
+
+    struct pollfd reply = {pair[0], POLLIN, 0};
+
+    if (handover_send(pair[0], &state) == 0 && poll(&reply, 1, HANDOVER_ACK_WAIT) == 1 &&
+        read(pair[0], &ack, 1) == 1) {
+        printf("Handed %d clients (%d bytes) to process %d in %.1f ms.\n", client_count, state.length, pid,
+               (now_us() - stopped) / 1000.0);
+        exit(0);
+    }
+
+    fprintf(stderr, "%s did not take over, resuming (server_upgrade).\n", path);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(pair[0]);
+    handover_free(&state);
+
+    //Lets the shards go on, both barriers are destroyed once every shard has left them.
+    pthread_barrier_wait(&upgrade_barrier);
+    pthread_barrier_destroy(&upgrade_barrier);
+    pthread_barrier_destroy(&handover_barrier);
+    printf("Resumed %d clients %.1f ms after they stopped being served.\n", client_count,
+           (now_us() - stopped) / 1000.0);
+}
+
+//Parses handover_state into handover_clients for the shards to adopt, returns the number of listening sockets at the
+//front of its descriptors or -1 if it doesn't make sense.
+int handover_load() {
+    unsigned listeners, sessions, count;
+    unsigned long stopped;
+
+    handover_state.position = 0;
+
+    if (handover_get_u32(&handover_state, &listeners) < 0 || handover_get_u32(&handover_state, &sessions) < 0 ||
+        handover_get_u64(&handover_state, &stopped) < 0 || handover_get_u32(&handover_state, &count) < 0 ||
+        (long) listeners + count != handover_state.fdCount) {
+        fprintf(stderr, "Handover state has a bad header (handover_load).\n");
+        return -1;
+    }
+
+    handover_clients = calloc(count == 0 ? 1 : count, sizeof(HandoverClient));
+
+    for (unsigned i = 0; i < count; i++) {
+        if (handover_get_client(&handover_state, &handover_clients[i]) < 0)
+            return -1;
+    }
+
+    handover_client_count = (int) count;
+    handover_sessions = sessions;
+    handover_stopped = (long) stopped;
+    handover_shards_left = shard_count;
+    return (int) listeners;
+}
+
+//Receives the old process's state on socket_fd and puts every client descriptor back at its old number, returns the
+//number of listening sockets handed over or -1. The old process is told once the shards have adopted the clients.
+int handover_resume(int socket_fd, int fd_limit) {
+    handover_init(&handover_state);
+
+    if (handover_receive(socket_fd, &handover_state) < 0)
+        return -1;
+
+    int listeners = handover_load();
+
+    if (listeners < 0)
+        return -1;
+
+    int *targets = malloc((handover_state.fdCount + 1) * sizeof(int));
+
+    for (int i = 0; i < handover_state.fdCount; i++) {
+        targets[i] = i < listeners ? -1 : handover_clients[i - listeners].fd;
+    }
+
+    int placed = handover_place_fds(handover_state.fds, targets, handover_state.fdCount, fd_limit);
+    free(targets);
+
+    if (placed < 0)
+        return -1;
+
+    handover_fd = socket_fd;
+    fcntl(handover_fd, F_SETFD, FD_CLOEXEC);
+    return listeners;
+}
+
+void print_stats() {
+    //Keep a shard's lines together when several shards print at once.
+    flockfile(stdout);
+    printf("Shard %d clients: %d, timers: %d\n", shard->index, client_table->size, timers->count);
+    printf("Shard %d write syscalls: %ld, frames written: %ld, syscalls per frame: %.3f\n", shard->index,
+           write_syscalls, frames_written, frames_written == 0 ? 0.0 : (double) write_syscalls / frames_written);
+    printf("Shard %d frames dropped: %ld, frames evicted: %ld, slow consumers disconnected: %ld\n", shard->index,
+           frames_dropped, frames_evicted, slow_disconnects);
+    if (io_backend == IO_BACKEND_URING) {
+        printf("Shard %d io_uring enters: %ld\n", shard->index, ring->enters);
+    }
+    pool_print_stats(stdout);
+    fflush(stdout);
+    funlockfile(stdout);
+}
+
+//Sums every shard's metrics, safe to call from any thread.
+void metrics_snapshot(Metrics *total) {
+    memset(total, 0, sizeof(Metrics));
+
+    for (int i = 0; i < shard_count; i++) {
+        metrics_merge(total, &shards[i].metrics);
+    }
+}
+
+//Loopback HTTP endpoint in the Prometheus text format, one scrape at a time.
+void *metrics_run(void *arg) {
+    int listen_fd = (int) (intptr_t) arg;
+
+    while (1) {
+        int socket_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+        if (socket_fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                perror("accept");
+
+            continue;
+        }
+
+        metrics_serve(socket_fd);
+    }
+
+    return NULL;
+}
+
+void metrics_serve(int socket_fd) {
+    char request[METRICS_REQUEST_SIZE];
+    struct timeval timeout = {2, 0};
+    Metrics total;
+
+    //A scraper that connects and sends nothing must not hold up the next one.
+    setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    int read_bytes = (int) read(socket_fd, request, sizeof(request) - 1);
+
+    FILE *out = fdopen(socket_fd, "w");
+    if (out == NULL) {
+        close(socket_fd);
+        return;
+    }
+
+    if (read_bytes <= 0) {
+        fclose(out);
+        return;
+    }
+
+    request[read_bytes] = 0;
+
+    if (strncmp(request, "GET /metrics ", 13) != 0 && strncmp(request, "GET / ", 6) != 0) {
+        fprintf(out, "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\nNot Found\n");
+        fclose(out);
+        return;
+    }
+
+    metrics_snapshot(&total);
+    fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+    metrics_write_prometheus(out, &total, __atomic_load_n(&connected_clients, __ATOMIC_RELAXED));
+    fclose(out);
+}
+
+void raise_fd_limit(int wanted) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        perror("getrlimit");
+        return;
+    }
+
+    if (limit.rlim_cur >= (rlim_t) wanted)
+        return;
+
+    limit.rlim_cur = limit.rlim_max < (rlim_t) wanted ? limit.rlim_max : (rlim_t) wanted;
+
+    if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        perror("setrlimit");
+        return;
+    }
+
+    if (limit.rlim_cur < (rlim_t) wanted) {
+        fprintf(stderr, "File descriptor limit is %d, fewer than %d clients may connect.\n", (int) limit.rlim_cur,
+                max_clients);
+    }
+}
+
+void flush_pending() {
+    while (link_is_linked(&pending_clients)) {
+        Client *client = link_entry(pending_clients.next, Client, pendingLink);
+        link_remove(&client->pendingLink);
+
+        histogram_observe(&metrics->writeQueueDepth, client->writeQueue->size);
+        if (client->writeQueue->size > metrics->writeQueueMax) {
+            METRIC_SET(metrics->writeQueueMax, client->writeQueue->size);
+        }
+
+        if (client->writeState != WRITE_CLOSING) {
+            //Sends still in flight from the last iteration mean the socket did not take everything then.
+            int blocked = client->sendsInFlight != 0;
+
+            if (io_backend == IO_BACKEND_URING) {
+                //A completing send queues the client again if there is more to write.
+                if (client->sendsInFlight == 0) {
+                    write_coalesce(client);
+                    write_compress(client);
+                    uring_write(client);
+                }
+            } else {
+                if (!client->writeBlocked) {
+                    write_coalesce(client);
+                    write_compress(client);
+                    do_write(client->id);
+                }
+
+                blocked = client->writeBlocked;
+            }
+
+            write_apply_policy(client, blocked);
+        }
+
+        //Slow consumers are disconnected here rather than while a broadcast is walking the member lists.
+        if (client->writeState == WRITE_CLOSING) {
+            frames_dropped += client->writeQueue->size;
+            client_disconnect(client);
+        }
+    }
+}
+
+//Packs what a client that asked for batches was sent during this iteration into batch packets. A blocked client is
+//left alone, its queue is what the slow consumer policy evicts from.
+void write_coalesce(Client *client) {
+    if (!(client->features & FEATURE_BATCH) || client->writeQueue->size < 2)
+        return;
+
+    int frames = client->writeQueue->size;
+    int batches = client_coalesce_write(client, BATCH_MAX_CONTENTS);
+
+    METRIC_ADD(metrics->packetsOut[BATCH_PACKET], batches);
+    METRIC_ADD(metrics->framesBatched, frames - client->writeQueue->size + batches);
+}
+
+//Compresses the unsent packets of a client that asked for it, from compress_threshold bytes up. Packets already
+//compressed by an earlier flush are still waiting in order and are left alone.
+void write_compress(Client *client) {
+    struct timespec start, end;
+    Byte out[COMPRESS_BOUND];
+
+    if (!(client->features & FEATURE_COMPRESS))
+        return;
+
+    for (int i = client_unsent_index(client); i < client->writeQueue->size; i++) {
+        Frame *frame = deque_get(client->writeQueue, i);
+
+        if (frame->length < compress_threshold || frame->length > COMPRESS_MAX_CONTENTS ||
+            frame->data[0] == COMPRESSED_PACKET)
+            continue;
+
+        if (client->compressor == NULL) {
+            client->compressor = compressor_create();
+
+            if (client->compressor == NULL) {
+                client->features &= ~FEATURE_COMPRESS;
+                return;
+            }
+        }
+
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+        int length = compressor_compress(client->compressor, frame->data, frame->length, out, sizeof(out));
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+        METRIC_ADD(metrics->compressNanos, (end.tv_sec - start.tv_sec) * 1000000000L + end.tv_nsec - start.tv_nsec);
+
+        //The stream is out of step with the client's now, so nothing more can be compressed for it.
+        if (length < 0) {
+            client->features &= ~FEATURE_COMPRESS;
+            return;
+        }
+
+        Byte header[1 + VARINT_MAX_BYTES];
+        header[0] = COMPRESSED_PACKET;
+        int header_length = 1 + varint_put(header + 1, (unsigned) length);
+
+        Frame *compressed = frame_alloc(header_length + length);
+        memcpy(compressed->data, header, (size_t) header_length);
+        memcpy(compressed->data + header_length, out, (size_t) length);
+
+        METRIC_ADD(metrics->compressIn, frame->length);
+        METRIC_ADD(metrics->compressOut, compressed->length);
+        METRIC_ADD(metrics->packetsOut[COMPRESSED_PACKET], 1);
+        client_replace_write(client, i, compressed);
+    }
+}
+
+int write_over_high_water(Client *client) {
+    return client->writeBytes >= high_water_bytes || client->writeQueue->size >= high_water_frames;
+}
+
+int write_over_hard_limit(Client *client) {
+    return client->writeBytes >= WRITE_HARD_LIMIT_FACTOR * high_water_bytes ||
+           client->writeQueue->size >= WRITE_HARD_LIMIT_FACTOR * high_water_frames;
+}
+
+//A client is slow once its queue is over the high watermark while the socket is not taking any more, it stays
+//slow until it drains below the low watermark. A burst that the socket absorbs is never treated as slow.
+void write_apply_policy(Client *client, int blocked) {
+    if (client->writeState == WRITE_HEALTHY && blocked && write_over_high_water(client)) {
+        client->writeState = WRITE_SLOW;
+    }
+
+    if (client->writeState != WRITE_SLOW)
+        return;
+
+    if (write_policy == WRITE_POLICY_CONFLATE) {
+        while (client->writeChatFrames > conflate_keep && client_evict_write(client)) {
+            frames_evicted++;
+        }
+    } else if (write_policy == WRITE_POLICY_DROP) {
+        while (write_over_high_water(client) && client_evict_write(client)) {
+            frames_evicted++;
+        }
+    }
+
+    //Only chat frames can be evicted, a queue of other packets past the hard limit is not going to recover.
+    if (write_policy == WRITE_POLICY_DISCONNECT || write_over_hard_limit(client)) {
+        printf("Client %d is not reading, disconnecting.\n", client->id);
+        slow_disconnects++;
+        client->writeState = WRITE_CLOSING;
+    }
+}
+
+//Called after frames were written, a slow client that caught up is treated normally again.
+void write_check_low_water(Client *client) {
+    if (client->writeState == WRITE_SLOW && client->writeBytes <= low_water_bytes &&
+        client->writeQueue->size <= low_water_frames) {
+        client->writeState = WRITE_HEALTHY;
+    }
+}
+
+void do_accept(int socket_fd) {
+    struct epoll_event event;
+
+    //Edge-triggered, so accept until the backlog is drained.
+    while (1) {
+        int client_fd = accept4(socket_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                accept_retry(errno);
+                return;
+            }
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+
+            return;
+        }
+
+        accept_starved = 0;
+        Client *client = client_accept(client_fd);
+
+        if (client == NULL)
+            continue;
+
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.fd = client_fd;
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event) < 0) {
+            perror("epoll_ctl");
+            client_disconnect(client);
+        }
+    }
+}
 
-    FD_ZERO(&rfd);
-    FD_ZERO(&wfd);
-    FD_SET(0, &rfd);
-    FD_SET(server_fd, &rfd);
-    max_set_size = server_fd;
-    client_list = list_create();
+//Registers a newly accepted connection with this shard, returns NULL if it was turned away.
+Client *client_accept(int client_fd) {
+    //If server full, the limit is shared by every shard.
+    if (__atomic_add_fetch(&connected_clients, 1, __ATOMIC_RELAXED) > max_clients || client_fd >= fd_shard_capacity) {
+        client_reject(client_fd);
+        return NULL;
+    }//End if server full
 
-    listen(server_fd, 5);
+    Client *client = client_create(client_fd);
+    client->generation = ++next_generation;
+    client->session = session_allocate();
 
-    printf("Server started!\nWaiting for client...\n");
+    //The table couldn't make room for it, which is as full as this shard gets.
+    if (client_table_add(client_table, client) < 0) {
+        client_free(client);
+        client_reject(client_fd);
+        return NULL;
+    }
 
-    while (running) {
-        copy_rfd = rfd;
-        copy_wfd = wfd;
-        struct timeval timeout = {0, 500000}; //500 Milliseconds
-        selected = select(max_set_size + 1, &copy_rfd, &copy_wfd, NULL, &timeout);
+    METRIC_ADD(metrics->accepts, 1);
+    __atomic_store_n(&fd_shards[client_fd], shard->index + 1, __ATOMIC_RELEASE);
 
-        if(selected == 0)
-            continue;
+    client->acceptedAt = loop_now;
+    client->lastActive = loop_now;
+    timer_init(&client->timer, &client_timer_expired);
+    client_timer_update(client);
 
-        if (selected < 0) {
-            perror("select");
-            exit(EXIT_FAILURE);
-        }
+    printf("Client %d established connection. Waiting for login packet...\n", client_fd);
+    return client;
+}
 
-        //STDIN Read
-        if (FD_ISSET(0, &copy_rfd)) {
-            printf("Received input\n");
-            char input[256];
-            fgets(input, 256, stdin);
+//Tells a connection the server is full and closes it, it was already counted in connected_clients.
+void client_reject(int client_fd) {
+    __atomic_sub_fetch(&connected_clients, 1, __ATOMIC_RELAXED);
+    METRIC_ADD(metrics->rejects, 1);
+    Buffer *msg_packet = packet_server_message_create("Server is full.");
+    Buffer *logout_packet = packet_server_logout_create();
+    packet_write(client_fd, msg_packet);
+    packet_write(client_fd, logout_packet);
+    buffer_free(msg_packet);
+    buffer_free(logout_packet);
+    close(client_fd);
+    printf("Client tried to connect but server is full.\n");
+}
 
+//Schedules the client's timer for the first of its deadlines: logging in, being pinged after a heartbeat interval of
+//quiet and being disconnected for staying quiet. Receiving anything only moves lastActive, a timer that runs out
+//early finds the client active again and is scheduled anew.
+void client_timer_update(Client *client) {
+    long due = -1;
 
-            if (strcmp("quit\n", input) == 0) {
-                printf("Quiting...\n");
-                list_free(client_list, (void (*)(void *)) &client_list_free);
-                exit(0);
-            }
-        }//End STDIN read
+    if (login_timeout > 0 && strlen(client->name) == 0) {
+        due = client->acceptedAt + login_timeout * 1000L;
+    }
 
-        //Server Accept
-        if (FD_ISSET(server_fd, &copy_rfd)) {
-            do_accept(server_fd);
-        }
+    if (idle_timeout > 0 && (due < 0 || client->lastActive + idle_timeout * 1000L < due)) {
+        due = client->lastActive + idle_timeout * 1000L;
+    }
 
-        //Client Read
-        for (int i = 3; i <= max_set_size; i++) {
-            if (i == server_fd)
-                continue;
+    //A pinged client gets another interval to answer.
+    if (heartbeat > 0 && (client->features & FEATURE_HEARTBEAT)) {
+        long beat = client->lastActive + heartbeat * 1000L * (client->pinged ? 2 : 1);
 
-            if (FD_ISSET(i, &copy_rfd)) {
-                do_read(i);
-            }
-        }//End for loop
+        if (due < 0 || beat < due) {
+            due = beat;
+        }
+    }
 
-        //Client Write
-        for (int i = 3; i <= max_set_size; i++) {
-            if (FD_ISSET(i, &copy_wfd)) {
-                do_write(i);
-            }
-        }//End for loop
-    }//End while running
+    if (due < 0) {
+        timer_cancel(timers, &client->timer);
+    } else {
+        timer_schedule(timers, &client->timer, due);
+    }
 }
 
-void do_accept(int socket_fd) {
-    int client_fd = accept(socket_fd, NULL, NULL);
+void client_timer_expired(Timer *timer) {
+    Client *client = link_entry(timer, Client, timer);
+    long quiet = timers->now - client->lastActive;
 
-    if (client_fd < 0) {
-        perror("accept");
-        exit(EXIT_FAILURE);
+    if (login_timeout > 0 && strlen(client->name) == 0 && timers->now - client->acceptedAt >= login_timeout * 1000L) {
+        printf("Client %d did not log in in time.\n", client->id);
+        METRIC_ADD(metrics->loginTimeouts, 1);
+        client_disconnect(client);
+        return;
     }
 
-    //If server full
-    if (client_fd >= MAX_SERVER_SIZE) {
-        Buffer *msg_packet = packet_server_message_create("Server is full.");
-        Buffer *logout_packet = packet_server_logout_create();
-        packet_write(socket_fd, msg_packet);
-        packet_write(socket_fd, logout_packet);
-        buffer_free(msg_packet);
-        buffer_free(logout_packet);
-        close(client_fd);
-        printf("Client tried to connect but server is full.\n");
+    if ((idle_timeout > 0 && quiet >= idle_timeout * 1000L) ||
+        (heartbeat > 0 && client->pinged && quiet >= heartbeat * 2000L)) {
+        printf("Client %d was quiet for %ld seconds.\n", client->id, quiet / 1000);
+        METRIC_ADD(metrics->idleTimeouts, 1);
+        client_disconnect(client);
         return;
-    }//End if server full
-
-    if (max_set_size < client_fd) {
-        max_set_size = client_fd;
     }
 
-    FD_SET(client_fd, &rfd);
-    Client *client = client_create(client_fd);
-    list_add(client_list, client);
+    if (heartbeat > 0 && (client->features & FEATURE_HEARTBEAT) && !client->pinged &&
+        quiet >= heartbeat * 1000L) {
+        Buffer *packet = packet_ping_create();
+        client_write(client, packet);
+        buffer_free(packet);
+        client->pinged = 1;
+    }
 
-    printf("Client %d established connection. Waiting for login packet...\n", client_fd);
+    client_timer_update(client);
 }
 
 void do_read(int socket_fd) {
-    int read_bytes;
     Client *client = client_get(socket_fd);
+    Buffer *readBuffer = client->readBuffer;
+
+    //Edge-triggered, so keep reading until the socket is drained.
+    while (1) {
+        int space = readBuffer->size - readBuffer->position;
+
+        //A read of nothing would look like the peer closing, the limits are meant to make this impossible.
+        if (space == 0) {
+            fprintf(stderr, "Client %d filled its read buffer without completing a packet.\n", socket_fd);
+            client_disconnect(client);
+            return;
+        }
 
-    if (client->readPacket == NULL) {
-        Byte packetId = 0x00;
-        read_bytes = (int) read(socket_fd, &packetId, sizeof(Byte));
+        int read_bytes = (int) read(socket_fd, readBuffer->buffer + readBuffer->position, (size_t) space);
 
         if (read_bytes < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+
             perror("read");
-            exit(EXIT_FAILURE);
+            client_disconnect(client);
+            return;
         }
 
         if (read_bytes == 0) {
@@ -216,109 +2047,160 @@ void do_read(int socket_fd) {
             return;
         }
 
-        //If client doesn't have name and packetId is not login packet
-        if (strlen(client->name) == 0 && packetId != LOGIN_PACKET) {
-            Buffer *packet = packet_server_message_create("Send Login Packet");
-            packet_write(socket_fd, packet);
-            buffer_free(packet);
-        }
+        readBuffer->position += read_bytes;
+        METRIC_ADD(metrics->bytesIn, read_bytes);
 
-        client->readPacket = packet_buffer_create(packetId);
+        if (packet_parse(client) < 0)
+            return;
 
-        if(client->readPacket == NULL)
+        //A short read means the socket has nothing left for now.
+        if (read_bytes < space)
             return;
     }
+}
+
+//Feeds bytes received elsewhere (io_uring) through the client's read buffer, returns -1 if the client disconnected.
+int client_receive(Client *client, Byte *data, int length) {
+    Buffer *readBuffer = client->readBuffer;
+
+    while (length > 0) {
+        int chunk = readBuffer->size - readBuffer->position;
+
+        //Nothing more would ever fit, the limits are meant to make this impossible.
+        if (chunk == 0) {
+            fprintf(stderr, "Client %d filled its read buffer without completing a packet.\n", client->id);
+            client_disconnect(client);
+            return -1;
+        }
+
+        if (chunk > length)
+            chunk = length;
+
+        memcpy(readBuffer->buffer + readBuffer->position, data, (size_t) chunk);
+        readBuffer->position += chunk;
+        data += chunk;
+        length -= chunk;
+
+        if (packet_parse(client) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+//Processes every complete packet in the client's read buffer in place, returns -1 if the client disconnected.
+int packet_parse(Client *client) {
+    Buffer *readBuffer = client->readBuffer;
+    int socket_fd = client->id;
+    int offset = 0;
+
+    //Anything received shows the client is still there.
+    client->lastActive = loop_now;
+    client->pinged = 0;
+
+    while (offset < readBuffer->position) {
+        Byte packetId = readBuffer->buffer[offset];
+        int size = packet_length(readBuffer->buffer + offset, readBuffer->position - offset);
+
+        //Skip bytes that don't start a known packet, batches, compressed packets, rosters and history only go from
+        //the server to clients.
+        if (size < 0 || packetId == BATCH_PACKET || packetId == COMPRESSED_PACKET || packetId == ROSTER_PACKET ||
+            packetId == PRESENCE_PACKET || packetId == HISTORY_PACKET) {
+            offset++;
+            continue;
+        }
+
+        if ((packetId == FRAMED_CHAT_PACKET && size > packet_framed_chat_size(max_message)) ||
+            (packetId == SESSION_CHAT_PACKET && size > packet_session_chat_size(max_message))) {
+            fprintf(stderr, "Client %d sent a %d byte message, more than the %d allowed.\n", socket_fd, size,
+                    max_message);
+            client_disconnect(client);
+            return -1;
+        }
 
-    packet_read(socket_fd, client->readPacket);
+        if (size == 0 || readBuffer->position - offset < size)
+            break;
+
+        METRIC_ADD(metrics->packetsIn[packetId], 1);
 
-    if (client->readPacket->position == client->readPacket->limit) {
         //Don't Process packet unless it is a login packet or the client's name isn't empty.
-        if(buffer_get_at(client->readPacket, 0) == LOGIN_PACKET || strlen(client->name) != 0) {
-            buffer_flip(client->readPacket);
+        if (packetId == LOGIN_PACKET || packetId == FEATURES_PACKET || packetId == PING_PACKET ||
+            strlen(client->name) != 0) {
+            Buffer packet = {size, readBuffer->buffer + offset, 0, size};
+            client->readPacket = &packet;
             packet_process(client);
+
+            //Processing may have disconnected the client (logout).
+            if (client_get(socket_fd) == NULL)
+                return -1;
+
+            client->readPacket = NULL;
+        } else {
+            Buffer *packet = packet_server_message_create("Send Login Packet");
+            client_write(client, packet);
+            buffer_free(packet);
         }
 
-        buffer_free(client->readPacket);
-        client->readPacket = NULL;
+        offset += size;
     }
+
+    //Carry the trailing partial packet over to the front of the buffer.
+    memmove(readBuffer->buffer, readBuffer->buffer + offset, (size_t) (readBuffer->position - offset));
+    readBuffer->position -= offset;
+    return 0;
 }
 
 void do_write(int socket_fd) {
+    struct iovec iov[WRITEV_MAX_FRAMES];
     Client *client = client_get(socket_fd);
 
-    if (client->writeQueue->size == 0) {
-        FD_CLR(socket_fd, &wfd);
-        return;
-    }
+    //Edge-triggered, so keep writing until the queue is empty or the socket would block.
+    while (client->writeQueue->size != 0 && client->writeState != WRITE_CLOSING) {
+        int count = client_gather_write(client, 0, iov, WRITEV_MAX_FRAMES);
+        int write_bytes = (int) writev(socket_fd, iov, count);
+        write_syscalls++;
 
-    Buffer *packet = client_peek_write(client);
-    packet_write(socket_fd, packet);
-
-    if (packet->position == packet->limit) {
-        buffer_free(client_poll_write(client));
-    }
-}
+        if (write_bytes < 0) {
+            if (errno == EINTR)
+                continue;
 
-void packet_read(int socket_fd, Buffer *packet) {
-    int read_bytes;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                client->writeBlocked = 1;
+                return;
+            }
 
-    read_bytes = (int) read(socket_fd, packet->buffer + packet->position, (size_t) (packet->limit - packet->position));
+            //The peer is gone, flush_pending disconnects it.
+            if (errno != EPIPE && errno != ECONNRESET)
+                perror("writev");
 
-    if (read_bytes < 0) {
-        perror("read");
-        exit(EXIT_FAILURE);
-    }
+            client->writeState = WRITE_CLOSING;
+            if (!link_is_linked(&client->pendingLink)) {
+                link_add_tail(&pending_clients, &client->pendingLink);
+            }
+            return;
+        }
 
-    if (read_bytes == 0 && packet->limit != packet->position) {
-        client_disconnect(client_get(socket_fd));
+        METRIC_ADD(metrics->bytesOut, write_bytes);
+        frames_written += client_advance_write(client, write_bytes);
+        write_check_low_water(client);
     }
-
-    packet->position += read_bytes;
 }
 
-void packet_write(int socket_fd, Buffer *packet) {
+int packet_write(int socket_fd, Buffer *packet) {
     int write_bytes;
 
-    write_bytes = (int) write(socket_fd, packet->buffer + packet->position,
-                              (size_t) (packet->limit - packet->position));
+    write_bytes = (int) send(socket_fd, packet->buffer + packet->position,
+                             (size_t) (packet->limit - packet->position), MSG_NOSIGNAL);
 
     if (write_bytes < 0) {
-        perror("write");
-        exit(EXIT_FAILURE);
-    }
-
-    packet->position += write_bytes;
-}
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EPIPE && errno != ECONNRESET)
+            perror("send");
 
-Buffer *packet_buffer_create(Byte packetId) {
-    Buffer *result;
-
-    switch (packetId) {
-        case CHAT_PACKET: //Chat Message
-            result = buffer_create(44);
-            buffer_put(result, packetId);
-            return result;
-        case LOGIN_PACKET: //Login
-            result = buffer_create(17);
-            buffer_put(result, packetId);
-            return result;
-        case LOGOUT_PACKET: //Logout
-            result = buffer_create(2);
-            buffer_put(result, packetId);
-            return result;
-        case COMMAND_PACKET: //Command
-            result = buffer_create(3);
-            buffer_put(result, packetId);
-            return result;
-        case NID_PACKET: //Name/ID Request/Reply
-            result = buffer_create(17);
-            buffer_put(result, packetId);
-            return result;
-        default:
-            return NULL;
+        return -1;
     }
 
-    return NULL;
+    packet->position += write_bytes;
+    return write_bytes;
 }
 
 void packet_process(Client *client) {
@@ -326,6 +2208,8 @@ void packet_process(Client *client) {
 
     switch (packetId) {
         case CHAT_PACKET:
+        case FRAMED_CHAT_PACKET:
+        case SESSION_CHAT_PACKET:
             packet_process_chat(client);
             break;
         case LOGIN_PACKET:
@@ -340,64 +2224,136 @@ void packet_process(Client *client) {
         case NID_PACKET:
             packet_process_nid(client);
             break;
+        case FEATURES_PACKET:
+            packet_process_features(client);
+            break;
+        case REPLAY_PACKET:
+            packet_process_replay(client);
+            break;
+        case PING_PACKET:
+            packet_process_ping(client);
+            break;
         default:
             break;
     }
 }
 
+//Handles fixed size, framed and session chat packets alike.
 void packet_process_chat(Client *client) {
     Buffer *packet = client->readPacket;
+    int sessions = buffer_get_at(packet, 0) == SESSION_CHAT_PACKET;
+    int offset, message;
+    Client *toClient = NULL;
 
-    char channel = buffer_get_at(packet, 1);
-    buffer_set(packet, 2, (Byte) client->id);//Set FromID
-    char *msg = (char *) (packet->buffer + 4);
+    int length = packet_chat_fields(packet->buffer, &offset, &message);
+    char channel = buffer_get_at(packet, offset);
+    Byte toId = sessions ? 0xFF : buffer_get_at(packet, offset + 2);
+    unsigned toSession = sessions ? session_get(packet->buffer + offset + 5) : SESSION_SERVER;
+    char *msg = (char *) (packet->buffer + message);
+
+    if (channel == SERVER_CHANNEL) {
+        printf("%s->Server : %.*s\n", client->name, length, msg);
+        return;
+    }
 
     if (channel == PRIVATE_CHANNEL) {
-        Byte toId = buffer_get_at(packet, 3);
-        Client *toClient = client_get(toId);
+        toClient = sessions ? client_session_get(toSession) : client_get(toId);
+
+        //The other encodings can only name the recipient when it is on this shard.
         if (toClient) {
-            client_write(toClient, packet);
-            printf("%s->%s: %s\n", client->name, toClient->name, msg);
+            toId = (Byte) toClient->id;
+            toSession = toClient->session;
         }
-        return;
     }
 
-    if (channel == GLOBAL_CHANNEL) {
-        client_all_write_except(packet, client->id);
-        printf("[Global] %s: %s\n", client->name, msg);
-        return;
-    }
+    Frame *frame = chat_frame_create(channel, client, toId, toSession, msg, length);
 
-    if (channel == SERVER_CHANNEL) {
-        printf("%s->Server : %s\n", client->name, msg);
-        return;
+    //Channel messages are logged as their session chat packet, private ones are not kept.
+    if (history_dir != NULL && channel != PRIVATE_CHANNEL &&
+        history_append(channel, frame->session->data, frame->session->length) != 0) {
+        METRIC_ADD(metrics->historyAppended, 1);
     }
 
-    client_channel_write_except(packet, channel, client->id);
+    if (channel == PRIVATE_CHANNEL) {
+        if (toClient) {
+            client_write_frame(toClient, frame);
+            printf("%s->%s: %.*s\n", client->name, toClient->name, length, msg);
+        } else if (sessions && toSession != SESSION_SERVER && session_shard(toSession) != shard->index) {
+            client_session_write(toSession, frame);
+            printf("%s->%u: %.*s\n", client->name, toSession, length, msg);
+        } else if (!sessions && client_shard_get(toId) >= 0) {
+            client_direct_write(toId, frame);
+            printf("%s->%d: %.*s\n", client->name, toId, length, msg);
+        }
+    } else if (channel == GLOBAL_CHANNEL) {
+        broadcast_frame(frame, 0, client->id);
+        printf("[Global] %s: %.*s\n", client->name, length, msg);
+    } else {
+        broadcast_frame(frame, channel, client->id);
 
-    if(channel == IOS_CHANNEL) {
-        printf("[iOS] %s: %s\n", client->name, msg);
-    } else if(channel == ANDROID_CHANNEL) {
-        printf("[Android] %s: %s\n", client->name, msg);
+        if(channel == IOS_CHANNEL) {
+            printf("[iOS] %s: %.*s\n", client->name, length, msg);
+        } else if(channel == ANDROID_CHANNEL) {
+            printf("[Android] %s: %.*s\n", client->name, length, msg);
+        }
     }
+
+    frame_release(frame);
+}
+
+//Encodes a chat message every way a client can receive it, client_write_frame picks the one each recipient
+//negotiated. Clients that didn't negotiate framing get long messages cut short.
+Frame *chat_frame_create(char channel, Client *from, Byte to, unsigned to_session, const char *msg, int length) {
+    Frame *frame = frame_alloc(PACKET_MAX_SIZE);
+    packet_chat_encode(frame->data, channel, (Byte) from->id, to, msg, length);
+
+    frame->framed = frame_alloc(packet_framed_chat_size(length));
+    packet_framed_chat_encode(frame->framed->data, channel, (Byte) from->id, to, msg, length);
+
+    frame->session = frame_alloc(packet_session_chat_size(length));
+    packet_session_chat_encode(frame->session->data, channel, from->session, to_session, msg, length);
+    return frame;
+}
+
+//A frame of packet with session_packet as its session twin, frees neither buffer.
+Frame *session_frame_create(Buffer *packet, Buffer *session_packet) {
+    Frame *frame = frame_create(packet);
+    frame->session = frame_create(session_packet);
+    return frame;
 }
 
 void packet_process_login(Client *client) {
     buffer_set(client->readPacket, 1, (Byte) client->id); //Set Client ID
-    char *name = (char *) (client->readPacket->buffer + 2);
+    //The name field isn't terminated when it is all 15 characters, the next packet follows right after it.
+    char name[16];
+    int length = (int) strnlen((char *) (client->readPacket->buffer + 2), 15);
+    memcpy(name, client->readPacket->buffer + 2, (size_t) length);
+    name[length] = '\0';
     client_set_name(client, name);
-    client_all_write(client->readPacket);
+    channel_join(client, client->channel);
 
-    //Sends data about each connected client to the newly logged in client for caching.
-    for(int i = 0; i < client_list->size; i++) {
-        Client *c = list_get(client_list, i);
-        if(c->id != client->id) {
-            Buffer *packet = packet_nid_create(c);
-            client_write(client, packet);
-            buffer_free(packet);
-        }
+    //The new client learns its own session from the copy it gets.
+    if (presence_window > 0) {
+        presence_login(client);
+        presence_schedule();
+    } else {
+        Buffer *session_packet = packet_session_id_create(SESSION_LOGIN_PACKET, client->session, client->name);
+        Frame *frame = session_frame_create(client->readPacket, session_packet);
+        broadcast_frame(frame, 0, -1);
+        frame_release(frame);
+        buffer_free(session_packet);
     }
 
+    //The login deadline is met.
+    client_timer_update(client);
+
+    //Sends data about each connected client to the newly logged in client for caching, every shard sends its own.
+    roster_send(client->session, client->features);
+    Message *message = message_create(MESSAGE_ROSTER);
+    message->session = client->session;
+    message->features = client->features;
+    shard_post_all(message);
+
     printf("[NOTICE] %s logged in.\n", client->name);
 }
 
@@ -408,24 +2364,26 @@ void packet_process_logout(Client *client) {
 void packet_process_command(Client *client) {
     Byte commandId = buffer_get_at(client->readPacket, 1);
     Byte channel = buffer_get_at(client->readPacket, 2);
-    int i;
-    Client *c;
+    Message *message;
+    Buffer *packet;
     char msg[41];
 
     switch(commandId) {
         case SWITCH_COMMAND:
-            client->channel = channel;
+            channel_join(client, channel);
             break;
         case LIST_COMMAND:
             snprintf(msg, 41, "List for channel %c", channel);
-            client_write(client, packet_server_message_create(msg));
-            for(i = 0; i < client_list->size; i++) {
-                c = list_get(client_list, i);
-                if(c->id != client->id && (c->channel == channel || channel == GLOBAL_CHANNEL) && c->name != NULL) {
-                    snprintf(msg, 41, "%s : %d", c->name, c->id);
-                    client_write(client, packet_server_message_create(msg));
-                }
-            }
+            packet = packet_server_message_create(msg);
+            client_write(client, packet);
+            buffer_free(packet);
+
+            //Every shard lists its own clients.
+            list_send(client->session, channel);
+            message = message_create(MESSAGE_LIST);
+            message->session = client->session;
+            message->channel = channel;
+            shard_post_all(message);
             break;
         default:
             break;
@@ -436,138 +2394,387 @@ void packet_process_nid(Client *client) {
 
 }
 
-Buffer *packet_client_logout_create(int client_id) {
-    Buffer *packet = packet_buffer_create(LOGOUT_PACKET);
-    buffer_put(packet, (Byte) client_id); //Client ID
-    buffer_flip(packet);
-    return packet;
+//Accepts the features this server supports and tells the client which ones those are.
+void packet_process_features(Client *client) {
+    client->features = buffer_get_at(client->readPacket, 1) & SERVER_FEATURES;
+
+    //Compression needs zlib and can be turned off.
+    if (!compress_available() || compress_threshold == 0) {
+        client->features &= ~FEATURE_COMPRESS;
+    }
+
+    Buffer *packet = packet_features_create((Byte) client->features, max_message);
+    client_write(client, packet);
+    buffer_free(packet);
+
+    //Heartbeats may be due before the login deadline.
+    client_timer_update(client);
 }
 
-Buffer *packet_server_message_create(const char *msg) {
-    char packet_msg[40];
-    memset(packet_msg, 0, 40);
+//Sends the channel history the client asked for straight from the log's mapped segments, at most a high watermark's
+//worth so a replay alone never makes the client slow. The client asks again from where the server says to go on.
+void packet_process_replay(Client *client) {
+    char channel = buffer_get_at(client->readPacket, 1);
+    Byte mode = buffer_get_at(client->readPacket, 2);
+    unsigned long value = u64_get(client->readPacket->buffer + 3);
+    unsigned long next;
+    Buffer *packet = NULL;
+    char msg[41];
 
-    strncpy(packet_msg, msg, 40);
+    if (history_dir == NULL || channel == PRIVATE_CHANNEL || channel == SERVER_CHANNEL) {
+        packet = packet_server_message_create("No history is kept for that channel.");
+    } else if (history_replay(channel, mode, value, high_water_bytes, &history_chunk_write, client, &next)) {
+        snprintf(msg, 41, "More history from #%lu", next);
+        packet = packet_server_message_create(msg);
+    }
 
-    if (strlen(msg) > 40) {
-        fprintf(stderr, "Message was truncated. Was: %s | Now: %s | (packet_server_message_create)\n", msg, packet_msg);
+    if (packet != NULL) {
+        client_write(client, packet);
+        buffer_free(packet);
     }
+}
 
-    Buffer *packet = packet_buffer_create(CHAT_PACKET);
-    buffer_put(packet, SERVER_CHANNEL); //Channel
-    buffer_put(packet, 0xFF); //From
-    buffer_put(packet, 0xFF); //To
+//A client answering a ping, receiving it already counted as activity.
+void packet_process_ping(Client *client) {
 
-    for (int i = 0; i < 40; i++) {
-        buffer_put(packet, (Byte) packet_msg[i]); //Message
-    }
+}
 
-    buffer_flip(packet); //Flip for writing
+//Queues a run of history packets without copying them, the frame keeps the segment mapped until it is written.
+void history_chunk_write(HistorySegment *segment, Byte *data, int length, void *arg) {
+    Frame *frame = frame_wrap(data, length, &history_segment_release, segment);
+    client_write_frame(arg, frame);
+    frame_release(frame);
+    METRIC_ADD(metrics->historyReplayed, length);
+}
+
+Buffer *packet_client_logout_create(int client_id) {
+    Buffer *packet = packet_buffer_create(LOGOUT_PACKET);
+    buffer_put(packet, (Byte) client_id); //Client ID
+    buffer_flip(packet);
     return packet;
 }
 
 Buffer *packet_server_logout_create() {
-    Buffer *packet = buffer_create(LOGOUT_PACKET);
+    Buffer *packet = packet_buffer_create(LOGOUT_PACKET);
     buffer_put(packet, 0xFF); //Client ID
     buffer_flip(packet); //Flip for writing
     return packet;
 }
 
-Buffer *packet_nid_create(Client *client) {
-    Buffer *packet = packet_buffer_create(NID_PACKET);
-    buffer_put(packet, (Byte) client->id);
+void client_write(Client *client, Buffer *packet) {
+    Frame *frame = frame_create(packet);
+    client_write_frame(client, frame);
+    frame_release(frame);
+}
+
+void client_write_frame(Client *client, Frame *frame) {
+    //Already waiting to be disconnected in flush_pending.
+    if (client->writeState == WRITE_CLOSING) {
+        frames_dropped++;
+        return;
+    }
+
+    if (frame->presence != NULL && (client->features & FEATURE_PRESENCE)) {
+        frame = frame->presence;
+    } else if (frame->session != NULL && (client->features & FEATURE_SESSIONS)) {
+        frame = frame->session;
+    } else if (frame->framed != NULL && (client->features & FEATURE_FRAMED)) {
+        frame = frame->framed;
+    }
 
-    int name_len = (int) strlen(client->name);
+    client_add_write(client, frame);
 
-    for(int i = 0; i < name_len; i++) {
-        buffer_put(packet, (Byte) client->name[i]);
+    if (frame->data[0] < METRICS_PACKET_TYPES) {
+        METRIC_ADD(metrics->packetsOut[frame->data[0]], 1);
     }
 
-    if(name_len < 15) {
-        for(int i = name_len; i < 15; i++) {
-            buffer_put(packet, 0x00);
-        }
+    //Writes are flushed once per loop iteration in flush_pending.
+    if (!link_is_linked(&client->pendingLink)) {
+        link_add_tail(&pending_clients, &client->pendingLink);
     }
+}
 
-    buffer_flip(packet);
-    return packet;
+//Writes to a client of any shard.
+void client_direct_write(int client_id, Frame *frame) {
+    Client *client = client_get(client_id);
+
+    if (client) {
+        client_write_frame(client, frame);
+        return;
+    }
+
+    int owner = client_shard_get(client_id);
+
+    if (owner < 0 || owner == shard->index)
+        return;
+
+    Message *message = message_create(MESSAGE_DIRECT);
+    message->frame = frame_retain(frame);
+    message->clientId = client_id;
+    shard_send(&shards[owner], message);
 }
 
-void client_write(Client *client, Buffer *packet) {
-    client_add_write(client, packet);
-    if (!FD_ISSET(client->id, &wfd)) {
-        FD_SET(client->id, &wfd);
+//Writes to the client with a session, on any shard.
+void client_session_write(unsigned session, Frame *frame) {
+    int owner = session_shard(session);
+
+    if (owner == shard->index) {
+        Client *client = client_session_get(session);
+
+        if (client) {
+            client_write_frame(client, frame);
+        }
+        return;
     }
+
+    Message *message = message_create(MESSAGE_SESSION);
+    message->frame = frame_retain(frame);
+    message->session = session;
+    shard_send(&shards[owner], message);
 }
 
+//The broadcasts encode the packet into one frame that every recipient's queue shares.
 void client_all_write(Buffer *buffer) {
-    for(int i = 0; i < client_list->size; i++) {
-        Client *c = list_get(client_list, i);
-        client_write(c, buffer);
-    }
+    client_all_write_except(buffer, -1);
 }
 
 void client_all_write_except(Buffer *buffer, int client_id_except) {
-    for(int i = 0; i < client_list->size; i++) {
-        Client *c = list_get(client_list, i);
-        if(c->id != client_id_except) {
-            client_write(c, buffer);
+    Frame *frame = frame_create(buffer);
+    broadcast_frame(frame, 0, client_id_except);
+    frame_release(frame);
+}
+
+void client_channel_write(Buffer *buffer, char channel) {
+    client_channel_write_except(buffer, channel, -1);
+}
+
+void client_channel_write_except(Buffer *buffer, char channel, int client_id_except) {
+    Frame *frame = frame_create(buffer);
+    broadcast_frame(frame, channel, client_id_except);
+    frame_release(frame);
+}
+
+//Delivers to this shard's clients and hands the frame to every other shard, channel 0 reaches everyone.
+void broadcast_frame(Frame *frame, char channel, int client_id_except) {
+    if (shard_count > 1) {
+        Message *message = message_create(MESSAGE_BROADCAST);
+        message->frame = frame_retain(frame);
+        message->channel = channel;
+        message->clientId = client_id_except;
+        shard_post_all(message);
+    }
+
+    broadcast_deliver(frame, channel, client_id_except);
+}
+
+//A channel reaches its members plus the global channel's members, who listen to every channel.
+void broadcast_deliver(Frame *frame, char channel, int client_id_except) {
+    int recipients = 0;
+
+    if (channel == 0) {
+        for (int i = 0; i < client_table->size; i++) {
+            Client *c = client_table->clients[i];
+            if (c->id != client_id_except) {
+                client_write_frame(c, frame);
+                recipients++;
+            }
+        }
+    } else {
+        recipients = channel_members_write(channel_get(channel), frame, client_id_except);
+        if (channel != GLOBAL_CHANNEL) {
+            recipients += channel_members_write(channel_get(GLOBAL_CHANNEL), frame, client_id_except);
         }
     }
+
+    histogram_observe(&metrics->fanout, recipients);
 }
 
-void client_channel_write(Buffer *buffer, char channel) {
-    for(int i = 0; i < client_list->size; i++) {
-        Client *c = list_get(client_list, i);
-        if(c->channel == channel || c->channel == GLOBAL_CHANNEL) {
-            client_write(c, buffer);
+//Returns the number of members written to.
+int channel_members_write(Channel *channel, Frame *frame, int client_id_except) {
+    int recipients = 0;
+    Link *cur;
+
+    link_for_each(cur, &channel->members) {
+        Client *c = link_entry(cur, Client, channelLink);
+        if (c->id != client_id_except) {
+            client_write_frame(c, frame);
+            recipients++;
         }
     }
+
+    return recipients;
 }
 
-void client_channel_write_except(Buffer *buffer, char channel, int client_id_except) {
-    for(int i = 0; i < client_list->size; i++) {
-        Client *c = list_get(client_list, i);
-        if((c->channel == channel || c->channel == GLOBAL_CHANNEL) && c->id != client_id_except) {
-            client_write(c, buffer);
+//Sends this shard's clients to session, as a roster snapshot if it negotiated one and a NID packet per client if not.
+//Clients whose login is still in the presence window are left out, their login comes later.
+void roster_send(unsigned session, int features) {
+    if (features & FEATURE_ROSTER) {
+        roster_snapshot_send(session);
+        return;
+    }
+
+    for (int i = 0; i < client_table->size; i++) {
+        Client *c = client_table->clients[i];
+        if (c->session != session && c->presenceIndex < 0) {
+            Buffer *packet = packet_nid_create((Byte) c->id, c->name);
+            Buffer *session_packet = packet_session_id_create(SESSION_NID_PACKET, c->session, c->name);
+            Frame *frame = session_frame_create(packet, session_packet);
+            client_session_write(session, frame);
+            frame_release(frame);
+            buffer_free(session_packet);
+            buffer_free(packet);
+        }
+    }
+}
+
+//Packs the entries into as few roster packets as they fit, one frame each. Clients that haven't logged in yet or
+//whose login is still in the presence window are left out, their login comes later.
+void roster_snapshot_send(unsigned session) {
+    Byte entries[ROSTER_MAX_CONTENTS];
+    int length = 0;
+
+    for (int i = 0; i < client_table->size; i++) {
+        Client *c = client_table->clients[i];
+
+        if (c->session == session || strlen(c->name) == 0 || c->presenceIndex >= 0)
+            continue;
+
+        if (length + ROSTER_ENTRY_MAX > ROSTER_MAX_CONTENTS) {
+            roster_frame_send(session, entries, length);
+            length = 0;
+        }
+
+        length += packet_roster_entry_put(entries + length, c->session, (Byte) c->id, c->name);
+    }
+
+    if (length != 0) {
+        roster_frame_send(session, entries, length);
+    }
+}
+
+void roster_frame_send(unsigned session, const Byte *entries, int length) {
+    Byte header[ROSTER_HEADER_MAX];
+    header[0] = ROSTER_PACKET;
+    int header_length = 1 + varint_put(header + 1, (unsigned) length);
+
+    Frame *frame = frame_alloc(header_length + length);
+    memcpy(frame->data, header, (size_t) header_length);
+    memcpy(frame->data + header_length, entries, (size_t) length);
+    client_session_write(session, frame);
+    frame_release(frame);
+}
+
+//Sends this shard's part of a LIST_COMMAND reply to session. Clients that negotiated sessions see session IDs, the
+//ones they address private messages to.
+void list_send(unsigned session, char channel) {
+    Link *cur;
+
+    if (channel == GLOBAL_CHANNEL) {
+        for (int i = 0; i < client_table->size; i++) {
+            Client *c = client_table->clients[i];
+            if (c->session != session && strlen(c->name) != 0) {
+                list_entry_send(session, c);
+            }
+        }
+        return;
+    }
+
+    link_for_each(cur, &channel_get(channel)->members) {
+        Client *c = link_entry(cur, Client, channelLink);
+        if (c->session != session) {
+            list_entry_send(session, c);
         }
     }
 }
 
+//One line of a list reply, naming c by the kind of ID the recipient uses.
+void list_entry_send(unsigned session, Client *c) {
+    char msg[41];
+
+    snprintf(msg, 41, "%s : %d", c->name, c->id);
+    Buffer *packet = packet_server_message_create(msg);
+    snprintf(msg, 41, "%s : %u", c->name, c->session);
+    Buffer *session_packet = packet_server_message_create(msg);
+
+    Frame *frame = session_frame_create(packet, session_packet);
+    client_session_write(session, frame);
+    frame_release(frame);
+    buffer_free(session_packet);
+    buffer_free(packet);
+}
+
 void client_disconnect(Client *client) {
-    FD_CLR(client->id, &rfd);
-    FD_CLR(client->id, &wfd);
+    //Unroute the descriptor before closing it, another shard may accept the same number right after.
+    __atomic_store_n(&fd_shards[client->id], 0, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&connected_clients, 1, __ATOMIC_RELAXED);
+
+    //Outstanding io_uring operations hold the socket open, cancel them before the descriptor can be reused.
+    if (io_backend == IO_BACKEND_URING) {
+        //Without a cancel shutting the socket down still ends them.
+        if (uring_cancel(0, client->id) < 0) {
+            shutdown(client->id, SHUT_RDWR);
+        }
+
+        uring_submit(ring);
+    }
+
+    //Closing the descriptor also removes it from the epoll set.
     close(client->id);
+    link_remove(&client->pendingLink);
+    timer_cancel(timers, &client->timer);
+    channel_leave(client);
 
-    Buffer *logout = packet_client_logout_create(client->id);
+    client_table_remove(client_table, client->id);
 
-    list_remove_value(client_list, &client->id, (int (*)(void *, void *)) &client_equals);
-    client_all_write(logout);
+    //Clients that never logged in were never announced when logins wait for the presence window.
+    if (presence_window > 0) {
+        if (strlen(client->name) != 0) {
+            presence_logout(client);
+            presence_schedule();
+        }
+    } else {
+        Buffer *logout = packet_client_logout_create(client->id);
+        Buffer *session_logout = packet_session_logout_create(client->session);
+        Frame *frame = session_frame_create(logout, session_logout);
+        broadcast_frame(frame, 0, -1);
+        frame_release(frame);
+        buffer_free(session_logout);
+        buffer_free(logout);
+    }
 
     printf("Client %d disconnected.\n", client->id);
-
-    buffer_free(logout);
     client_free(client);
 }
 
 Client *client_get(int socket_fd) {
-    int index = list_contains(client_list, (void *) &socket_fd, (int (*)(void *, void *)) &client_equals);
+    return client_table_get(client_table, socket_fd);
+}
 
-    if (index == -1) {
-        return NULL;
+//Index of the shard that owns client_id, -1 if nobody does.
+int client_shard_get(int client_id) {
+    if (client_id < 0 || client_id >= fd_shard_capacity) {
+        return -1;
     }
 
-    return list_get(client_list, index);
+    return __atomic_load_n(&fd_shards[client_id], __ATOMIC_ACQUIRE) - 1;
 }
 
-int client_equals(Client *client, int *id) {
-    if (client->id == *id) {
-        return 1;
-    } else {
-        return 0;
-    }
+//Sessions are spread over the shards so any shard can tell which one owns a session without asking. 0 and
+//SESSION_SERVER are never handed out.
+unsigned session_allocate() {
+    unsigned session;
+
+    do {
+        session = ++sessions_allocated * (unsigned) shard_count + (unsigned) shard->index;
+    } while (session == 0 || session == SESSION_SERVER || session % (unsigned) shard_count != (unsigned) shard->index);
+
+    return session;
 }
 
-void client_list_free(Client *client) {
-    client_free(client);
-}
\ No newline at end of file
+Client *client_session_get(unsigned session) {
+    return client_table_get_session(client_table, session);
+}
+
+int session_shard(unsigned session) {
+    return (int) (session % (unsigned) shard_count);
+}
@@ -0,0 +1,247 @@
+#include <ctype.h>
+#include "../packet.h"
+#include "metrics.h"
+
+#define METRIC_LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+//Function Declarations
+void histogram_merge(Histogram *total, Histogram *shard);
+
+void histogram_write_prometheus(FILE *out, const char *name, const char *help, Histogram *histogram);
+
+const char *channel_label(int channel, char *label);
+
+__thread Metrics *metrics = NULL;
+
+const char *packet_type_names[METRICS_PACKET_TYPES] = {"chat", "login", "logout", "command", "nid", "features",
+                                                          "framed_chat", "batch", "compressed", "session_chat",
+                                                          "session_login", "session_nid", "session_logout", "roster",
+                                                          "presence", "history", "replay", "ping"};
+
+//Function Implementations
+void histogram_observe(Histogram *histogram, long value) {
+    int bucket = value <= 0 ? 0 : 64 - __builtin_clzl((unsigned long) value);
+
+    if (bucket >= HISTOGRAM_BUCKETS) {
+        bucket = HISTOGRAM_BUCKETS - 1;
+    }
+
+    METRIC_ADD(histogram->buckets[bucket], 1);
+    METRIC_ADD(histogram->sum, value);
+}
+
+long histogram_count(Histogram *histogram) {
+    long count = 0;
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        count += histogram->buckets[i];
+    }
+
+    return count;
+}
+
+//Upper bound of the bucket the percentile (0 to 1) falls in.
+long histogram_percentile(Histogram *histogram, double percentile) {
+    long count = histogram_count(histogram);
+    long seen = 0;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+
+        if (seen >= percentile * count) {
+            return (1L << i) - 1;
+        }
+    }
+
+    return (1L << (HISTOGRAM_BUCKETS - 1)) - 1;
+}
+
+void histogram_merge(Histogram *total, Histogram *shard) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        total->buckets[i] += METRIC_LOAD(shard->buckets[i]);
+    }
+
+    total->sum += METRIC_LOAD(shard->sum);
+}
+
+//Adds a shard's metrics, which may be changing under us, to total.
+void metrics_merge(Metrics *total, Metrics *shard) {
+    for (int i = 0; i < METRICS_PACKET_TYPES; i++) {
+        total->packetsIn[i] += METRIC_LOAD(shard->packetsIn[i]);
+        total->packetsOut[i] += METRIC_LOAD(shard->packetsOut[i]);
+    }
+
+    total->bytesIn += METRIC_LOAD(shard->bytesIn);
+    total->bytesOut += METRIC_LOAD(shard->bytesOut);
+    total->accepts += METRIC_LOAD(shard->accepts);
+    total->rejects += METRIC_LOAD(shard->rejects);
+
+    total->framesBatched += METRIC_LOAD(shard->framesBatched);
+    total->compressIn += METRIC_LOAD(shard->compressIn);
+    total->compressOut += METRIC_LOAD(shard->compressOut);
+    total->compressNanos += METRIC_LOAD(shard->compressNanos);
+    total->presenceEvents += METRIC_LOAD(shard->presenceEvents);
+    total->presenceCancelled += METRIC_LOAD(shard->presenceCancelled);
+    total->historyAppended += METRIC_LOAD(shard->historyAppended);
+    total->historyReplayed += METRIC_LOAD(shard->historyReplayed);
+    total->loginTimeouts += METRIC_LOAD(shard->loginTimeouts);
+    total->idleTimeouts += METRIC_LOAD(shard->idleTimeouts);
+
+    long writeQueueMax = METRIC_LOAD(shard->writeQueueMax);
+    if (writeQueueMax > total->writeQueueMax) {
+        total->writeQueueMax = writeQueueMax;
+    }
+
+    for (int i = 0; i < 256; i++) {
+        total->channelClients[i] += METRIC_LOAD(shard->channelClients[i]);
+    }
+
+    histogram_merge(&total->fanout, &shard->fanout);
+    histogram_merge(&total->writeQueueDepth, &shard->writeQueueDepth);
+    histogram_merge(&total->loopTime, &shard->loopTime);
+}
+
+//Clients pick channel bytes freely, anything but a letter or digit is written in hex so labels stay valid.
+const char *channel_label(int channel, char *label) {
+    if (isalnum(channel)) {
+        snprintf(label, 8, "%c", channel);
+    } else {
+        snprintf(label, 8, "0x%02x", channel);
+    }
+
+    return label;
+}
+
+//Human readable summary for the stats command.
+void metrics_print(FILE *out, Metrics *total) {
+    char label[8];
+
+    flockfile(out);
+
+    for (int i = 0; i < METRICS_PACKET_TYPES; i++) {
+        fprintf(out, "Packets %s: %ld in, %ld out\n", packet_type_names[i], total->packetsIn[i],
+                total->packetsOut[i]);
+    }
+
+    fprintf(out, "Bytes: %ld in, %ld out\n", total->bytesIn, total->bytesOut);
+    fprintf(out, "Accepted: %ld, rejected: %ld\n", total->accepts, total->rejects);
+    fprintf(out, "Batched packets: %ld in %ld batches\n", total->framesBatched, total->packetsOut[BATCH_PACKET]);
+    fprintf(out, "Compressed: %ld bytes to %ld, %ld saved, %.3f ms CPU\n", total->compressIn, total->compressOut,
+            total->compressIn - total->compressOut, total->compressNanos / 1e6);
+    fprintf(out, "Presence: %ld logins and logouts published, %ld cancelled out\n", total->presenceEvents,
+            total->presenceCancelled);
+    fprintf(out, "History: %ld messages logged, %ld bytes replayed\n", total->historyAppended,
+            total->historyReplayed);
+    fprintf(out, "Timed out: %ld before logging in, %ld idle\n", total->loginTimeouts, total->idleTimeouts);
+
+    for (int i = 0; i < 256; i++) {
+        if (total->channelClients[i] != 0) {
+            fprintf(out, "Channel %s clients: %ld\n", channel_label(i, label), total->channelClients[i]);
+        }
+    }
+
+    fprintf(out, "Broadcast fan-out: p50 %ld, p99 %ld, count %ld\n", histogram_percentile(&total->fanout, 0.5),
+            histogram_percentile(&total->fanout, 0.99), histogram_count(&total->fanout));
+    fprintf(out, "Write queue depth: p50 %ld, p99 %ld, max %ld\n", histogram_percentile(&total->writeQueueDepth, 0.5),
+            histogram_percentile(&total->writeQueueDepth, 0.99), total->writeQueueMax);
+    fprintf(out, "Loop iteration us: p50 %ld, p99 %ld, p99.9 %ld, count %ld\n",
+            histogram_percentile(&total->loopTime, 0.5), histogram_percentile(&total->loopTime, 0.99),
+            histogram_percentile(&total->loopTime, 0.999), histogram_count(&total->loopTime));
+    fflush(out);
+    funlockfile(out);
+}
+
+void histogram_write_prometheus(FILE *out, const char *name, const char *help, Histogram *histogram) {
+    int last = 0;
+    long cumulative = 0;
+
+    //Leave out the empty buckets past the largest value, +Inf covers them.
+    for (int i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+        if (histogram->buckets[i] != 0) {
+            last = i;
+        }
+    }
+
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+    for (int i = 0; i <= last; i++) {
+        cumulative += histogram->buckets[i];
+        fprintf(out, "%s_bucket{le=\"%ld\"} %ld\n", name, (1L << i) - 1, cumulative);
+    }
+
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %ld\n", name, histogram_count(histogram));
+    fprintf(out, "%s_sum %ld\n%s_count %ld\n", name, histogram->sum, name, histogram_count(histogram));
+}
+
+//Prometheus text exposition format.
+void metrics_write_prometheus(FILE *out, Metrics *total, int clients) {
+    char label[8];
+
+    fprintf(out, "# HELP chat_packets_in_total Packets received, by type.\n# TYPE chat_packets_in_total counter\n");
+    for (int i = 0; i < METRICS_PACKET_TYPES; i++) {
+        fprintf(out, "chat_packets_in_total{type=\"%s\"} %ld\n", packet_type_names[i], total->packetsIn[i]);
+    }
+
+    fprintf(out, "# HELP chat_packets_out_total Packets queued to clients, by type.\n"
+                 "# TYPE chat_packets_out_total counter\n");
+    for (int i = 0; i < METRICS_PACKET_TYPES; i++) {
+        fprintf(out, "chat_packets_out_total{type=\"%s\"} %ld\n", packet_type_names[i], total->packetsOut[i]);
+    }
+
+    fprintf(out, "# HELP chat_bytes_in_total Bytes read from clients.\n# TYPE chat_bytes_in_total counter\n"
+                 "chat_bytes_in_total %ld\n", total->bytesIn);
+    fprintf(out, "# HELP chat_bytes_out_total Bytes written to clients.\n# TYPE chat_bytes_out_total counter\n"
+                 "chat_bytes_out_total %ld\n", total->bytesOut);
+    fprintf(out, "# HELP chat_accepts_total Connections accepted.\n# TYPE chat_accepts_total counter\n"
+                 "chat_accepts_total %ld\n", total->accepts);
+    fprintf(out, "# HELP chat_rejects_total Connections turned away because the server was full.\n"
+                 "# TYPE chat_rejects_total counter\nchat_rejects_total %ld\n", total->rejects);
+    fprintf(out, "# HELP chat_batched_packets_total Packets sent inside batch packets.\n"
+                 "# TYPE chat_batched_packets_total counter\nchat_batched_packets_total %ld\n", total->framesBatched);
+    fprintf(out, "# HELP chat_compress_in_bytes_total Bytes of packets before compression.\n"
+                 "# TYPE chat_compress_in_bytes_total counter\nchat_compress_in_bytes_total %ld\n", total->compressIn);
+    fprintf(out, "# HELP chat_compress_out_bytes_total Bytes of the compressed packets sent in their place.\n"
+                 "# TYPE chat_compress_out_bytes_total counter\nchat_compress_out_bytes_total %ld\n",
+            total->compressOut);
+    fprintf(out, "# HELP chat_compress_cpu_seconds_total Thread CPU time spent compressing.\n"
+                 "# TYPE chat_compress_cpu_seconds_total counter\nchat_compress_cpu_seconds_total %.6f\n",
+            total->compressNanos / 1e9);
+    fprintf(out, "# HELP chat_presence_events_total Logins and logouts published at the end of a presence window.\n"
+                 "# TYPE chat_presence_events_total counter\nchat_presence_events_total %ld\n", total->presenceEvents);
+    fprintf(out, "# HELP chat_presence_cancelled_total Logins and logouts that cancelled out in a presence window.\n"
+                 "# TYPE chat_presence_cancelled_total counter\nchat_presence_cancelled_total %ld\n",
+            total->presenceCancelled);
+    fprintf(out, "# HELP chat_history_appended_total Chat messages logged to channel history.\n"
+                 "# TYPE chat_history_appended_total counter\nchat_history_appended_total %ld\n",
+            total->historyAppended);
+    fprintf(out, "# HELP chat_history_replayed_bytes_total Bytes of history sent to clients that asked for it.\n"
+                 "# TYPE chat_history_replayed_bytes_total counter\nchat_history_replayed_bytes_total %ld\n",
+            total->historyReplayed);
+    fprintf(out, "# HELP chat_login_timeouts_total Clients disconnected for not logging in in time.\n"
+                 "# TYPE chat_login_timeouts_total counter\nchat_login_timeouts_total %ld\n", total->loginTimeouts);
+    fprintf(out, "# HELP chat_idle_timeouts_total Clients disconnected for staying quiet too long.\n"
+                 "# TYPE chat_idle_timeouts_total counter\nchat_idle_timeouts_total %ld\n", total->idleTimeouts);
+    fprintf(out, "# HELP chat_clients Connected clients.\n# TYPE chat_clients gauge\nchat_clients %d\n", clients);
+
+    fprintf(out, "# HELP chat_channel_clients Logged in clients, by channel.\n# TYPE chat_channel_clients gauge\n");
+    for (int i = 0; i < 256; i++) {
+        if (total->channelClients[i] != 0) {
+            fprintf(out, "chat_channel_clients{channel=\"%s\"} %ld\n", channel_label(i, label),
+                    total->channelClients[i]);
+        }
+    }
+
+    fprintf(out, "# HELP chat_write_queue_depth_max Deepest write queue seen at a flush.\n"
+                 "# TYPE chat_write_queue_depth_max gauge\nchat_write_queue_depth_max %ld\n", total->writeQueueMax);
+
+    histogram_write_prometheus(out, "chat_broadcast_fanout", "Recipients per broadcast on each shard.",
+                               &total->fanout);
+    histogram_write_prometheus(out, "chat_write_queue_depth", "Frames queued per client at each flush.",
+                               &total->writeQueueDepth);
+    histogram_write_prometheus(out, "chat_loop_iteration_microseconds", "Busy time of one event loop iteration.",
+                               &total->loopTime);
+}
@@ -0,0 +1,71 @@
+#ifndef CHATSERVER_METRICS_H
+#define CHATSERVER_METRICS_H
+
+#include <stdio.h>
+
+//Packet types counted separately, the packet ID is the index.
+#define METRICS_PACKET_TYPES 18
+//Bucket i counts values below 2^i, the last one takes everything larger.
+#define HISTOGRAM_BUCKETS 32
+
+//Counters are written only by the shard that owns them, with plain relaxed stores so collection costs no locked
+//instructions, and read by any thread with relaxed loads.
+#define METRIC_ADD(counter, n) __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+#define METRIC_SET(gauge, value) __atomic_store_n(&(gauge), (value), __ATOMIC_RELAXED)
+
+typedef struct histogram {
+    long buckets[HISTOGRAM_BUCKETS];
+    long sum;
+} Histogram;
+
+typedef struct metrics {
+    long packetsIn[METRICS_PACKET_TYPES];
+    //Packets queued to clients, a broadcast counts once per recipient
+    long packetsOut[METRICS_PACKET_TYPES];
+    long bytesIn;
+    long bytesOut;
+    long accepts;
+    long rejects;
+    //Deepest write queue seen at a flush
+    long writeQueueMax;
+    //Packets sent inside batch packets
+    long framesBatched;
+    //Bytes of the packets that were compressed, what they were sent as and the thread CPU time it took
+    long compressIn;
+    long compressOut;
+    long compressNanos;
+    //Logins and logouts published at the end of a presence window and those that cancelled out within one
+    long presenceEvents;
+    long presenceCancelled;
+    //Chat messages logged to channel history and bytes of history sent to clients that asked for it
+    long historyAppended;
+    long historyReplayed;
+    //Clients disconnected for not logging in in time, and for staying quiet past the idle timeout or a heartbeat
+    long loginTimeouts;
+    long idleTimeouts;
+    //Logged in clients per channel byte
+    long channelClients[256];
+    //Recipients per broadcast delivered by a shard
+    Histogram fanout;
+    //Queued frames of each client with something to flush, sampled once per loop iteration
+    Histogram writeQueueDepth;
+    //Microseconds from the loop waking up to the end of its flush
+    Histogram loopTime;
+} Metrics;
+
+//The calling shard's metrics, NULL on threads that aren't shards.
+extern __thread Metrics *metrics;
+
+void histogram_observe(Histogram *histogram, long value);
+
+long histogram_count(Histogram *histogram);
+
+long histogram_percentile(Histogram *histogram, double percentile);
+
+void metrics_merge(Metrics *total, Metrics *shard);
+
+void metrics_print(FILE *out, Metrics *total);
+
+void metrics_write_prometheus(FILE *out, Metrics *total, int clients);
+
+#endif //CHATSERVER_METRICS_H
@@ -0,0 +1,145 @@
+#include <memory.h>
+#include <malloc.h>
+#include <stdio.h>
+#include "../packet.h"
+#include "metrics.h"
+#include "presence.h"
+
+//Function Declarations
+PresenceEvent *presence_add(int online, Client *client);
+
+void presence_remove(int index);
+
+//Events of this shard's clients since the last publish, in the order they happened. Byte IDs are descriptors and
+//can be reused within a window, so a logout has to stay ahead of a later login with the same ID.
+__thread PresenceEvent *presence_events;
+__thread int presence_count, presence_capacity;
+
+//Function Implementations
+void presence_login(Client *client) {
+    //A second login packet only renames the pending event.
+    if (client->presenceIndex >= 0) {
+        memcpy(presence_events[client->presenceIndex].name, client->name, sizeof(client->name));
+        return;
+    }
+
+    PresenceEvent *event = presence_add(1, client);
+
+    if (event != NULL) {
+        event->client = client;
+        client->presenceIndex = presence_count - 1;
+    }
+}
+
+//Returns 1 if the client's login was still pending, then neither is published.
+int presence_logout(Client *client) {
+    if (client->presenceIndex >= 0) {
+        presence_remove(client->presenceIndex);
+        client->presenceIndex = -1;
+        METRIC_ADD(metrics->presenceCancelled, 2);
+        return 1;
+    }
+
+    presence_add(0, client);
+    return 0;
+}
+
+int presence_pending() {
+    return presence_count;
+}
+
+//Encodes the pending events and clears them, NULL if there are none. The frame itself holds login and logout
+//packets back to back, its session twin their session variants and its presence twin presence packets.
+Frame *presence_frame_create() {
+    Byte entries[PRESENCE_MAX_CONTENTS];
+    int length = 0;
+
+    if (presence_count == 0) {
+        return NULL;
+    }
+
+    //Sized for logins only and a presence packet per entry, then cut down to what was written.
+    Frame *frame = frame_alloc(presence_count * packet_size(LOGIN_PACKET));
+    frame->session = frame_alloc(presence_count * packet_size(SESSION_LOGIN_PACKET));
+    frame->presence = frame_alloc(presence_count * (PRESENCE_HEADER_MAX + PRESENCE_ENTRY_MAX));
+    Byte *out = frame->data;
+    Byte *session_out = frame->session->data;
+    Byte *presence_out = frame->presence->data;
+
+    for (int i = 0; i < presence_count; i++) {
+        PresenceEvent *event = &presence_events[i];
+
+        if (event->online) {
+            out[0] = LOGIN_PACKET;
+            out[1] = event->id;
+            memcpy(out + 2, event->name, 15);
+            session_out[0] = SESSION_LOGIN_PACKET;
+            session_put(session_out + 1, event->session);
+            memcpy(session_out + 5, event->name, 15);
+            event->client->presenceIndex = -1;
+        } else {
+            out[0] = LOGOUT_PACKET;
+            out[1] = event->id;
+            session_out[0] = SESSION_LOGOUT_PACKET;
+            session_put(session_out + 1, event->session);
+        }
+
+        out += packet_size(out[0]);
+        session_out += packet_size(session_out[0]);
+
+        if (length + PRESENCE_ENTRY_MAX > PRESENCE_MAX_CONTENTS) {
+            presence_out += packet_presence_put(presence_out, entries, length);
+            length = 0;
+        }
+
+        length += packet_presence_entry_put(entries + length, event->online, event->session, event->id,
+                                            event->name);
+    }
+
+    presence_out += packet_presence_put(presence_out, entries, length);
+
+    frame->length = (int) (out - frame->data);
+    frame->session->length = (int) (session_out - frame->session->data);
+    frame->presence->length = (int) (presence_out - frame->presence->data);
+
+    METRIC_ADD(metrics->presenceEvents, presence_count);
+    presence_count = 0;
+    return frame;
+}
+
+//"private" functions
+PresenceEvent *presence_add(int online, Client *client) {
+    if (presence_count == presence_capacity) {
+        int capacity = presence_capacity == 0 ? 64 : presence_capacity * 2;
+        PresenceEvent *events = realloc(presence_events, capacity * sizeof(PresenceEvent));
+
+        if (events == NULL) {
+            fprintf(stderr, "Out of memory (presence_add).\n");
+            return NULL;
+        }
+
+        presence_events = events;
+        presence_capacity = capacity;
+    }
+
+    PresenceEvent *event = &presence_events[presence_count++];
+    event->online = online;
+    event->session = client->session;
+    event->id = (Byte) client->id;
+    memcpy(event->name, client->name, sizeof(client->name));
+    event->client = NULL;
+    return event;
+}
+
+//Closes the hole keeping the order, the logins after it move down one.
+void presence_remove(int index) {
+    presence_count--;
+    memmove(&presence_events[index], &presence_events[index + 1],
+            (size_t) (presence_count - index) * sizeof(PresenceEvent));
+
+    for (int i = index; i < presence_count; i++) {
+        if (presence_events[i].client != NULL) {
+            presence_events[i].client->presenceIndex = i;
+        }
+    }
+}
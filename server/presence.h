@@ -0,0 +1,25 @@
+#ifndef CHATSERVER_PRESENCE_H
+#define CHATSERVER_PRESENCE_H
+
+#include "client.h"
+#include "frame.h"
+
+//A login or logout of one of this shard's clients that hasn't been published yet.
+typedef struct presence_event {
+    int online;
+    unsigned session;
+    Byte id;
+    char name[16];
+    //The client logging in, so its event can be found again, NULL for logouts
+    Client *client;
+} PresenceEvent;
+
+void presence_login(Client *client);
+
+int presence_logout(Client *client);
+
+int presence_pending();
+
+Frame *presence_frame_create();
+
+#endif //CHATSERVER_PRESENCE_H
@@ -0,0 +1,42 @@
+#include <sys/eventfd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include "shard.h"
+
+int shard_init(Shard *shard, int index, int listen_fd) {
+    shard->index = index;
+    shard->listenFd = listen_fd;
+    inbox_init(&shard->inbox);
+    shard->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (shard->eventFd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+
+    return 0;
+}
+
+//Hands the message to the shard's thread, only the first message since its last wakeup costs a syscall.
+void shard_send(Shard *shard, Message *message) {
+    if (inbox_push(&shard->inbox, message)) {
+        uint64_t one = 1;
+
+        if (write(shard->eventFd, &one, sizeof(one)) < 0) {
+            perror("write");
+        }
+    }
+}
+
+//Called by the shard's own thread before it drains the inbox.
+void shard_clear_wakeup(Shard *shard) {
+    uint64_t count;
+
+    if (read(shard->eventFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("read");
+    }
+
+    inbox_clear_signal(&shard->inbox);
+}
@@ -0,0 +1,25 @@
+#ifndef CHATSERVER_SHARD_H
+#define CHATSERVER_SHARD_H
+
+#include <pthread.h>
+#include "inbox.h"
+#include "metrics.h"
+
+//An event loop thread with its own listening socket and its own clients.
+typedef struct shard {
+    int index;
+    pthread_t thread;
+    int listenFd;
+    //Readable whenever the inbox was signaled
+    int eventFd;
+    Inbox inbox;
+    Metrics metrics;
+} Shard;
+
+int shard_init(Shard *shard, int index, int listen_fd);
+
+void shard_send(Shard *shard, Message *message);
+
+void shard_clear_wakeup(Shard *shard);
+
+#endif //CHATSERVER_SHARD_H
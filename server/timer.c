@@ -0,0 +1,157 @@
+#include "timer.h"
+
+#define TIMER_SLOT_MASK (TIMER_SLOTS - 1)
+
+//Function Declarations
+void timer_place(TimerWheel *wheel, Timer *timer, long expires);
+
+void timer_unlink(TimerWheel *wheel, Timer *timer);
+
+void timer_wheel_tick(TimerWheel *wheel);
+
+//Function Implementations
+void timer_wheel_init(TimerWheel *wheel, long now) {
+    wheel->now = now;
+    wheel->count = 0;
+
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        wheel->occupied[level] = 0;
+
+        for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+            link_init(&wheel->slots[level][slot]);
+        }
+    }
+}
+
+void timer_init(Timer *timer, void (*expired)(Timer *timer)) {
+    link_init(&timer->link);
+    timer->expires = 0;
+    timer->level = 0;
+    timer->slot = 0;
+    timer->expired = expired;
+}
+
+int timer_pending(Timer *timer) {
+    return link_is_linked(&timer->link);
+}
+
+//Puts the timer in the lowest level whose slots reach expires. Between ticks the current slot of every level is empty,
+//only a cascade places timers due within the current slot there, and they are handled later in the same tick.
+void timer_place(TimerWheel *wheel, Timer *timer, long expires) {
+    int level = 0;
+
+    while (level < TIMER_LEVELS - 1 &&
+           (expires >> (level * TIMER_LEVEL_BITS)) - (wheel->now >> (level * TIMER_LEVEL_BITS)) >= TIMER_SLOTS) {
+        level++;
+    }
+
+    int shift = level * TIMER_LEVEL_BITS;
+    long index = expires >> shift;
+
+    if (index - (wheel->now >> shift) >= TIMER_SLOTS) {
+        index = (wheel->now >> shift) + TIMER_SLOTS - 1;
+    }
+
+    timer->level = level;
+    timer->slot = (int) (index & TIMER_SLOT_MASK);
+    link_add_tail(&wheel->slots[level][timer->slot], &timer->link);
+    wheel->occupied[level] |= 1UL << timer->slot;
+    wheel->count++;
+}
+
+void timer_unlink(TimerWheel *wheel, Timer *timer) {
+    link_remove(&timer->link);
+    wheel->count--;
+
+    if (!link_is_linked(&wheel->slots[timer->level][timer->slot])) {
+        wheel->occupied[timer->level] &= ~(1UL << timer->slot);
+    }
+}
+
+//Schedules the timer for the given tick, moving it if it was already scheduled. Ticks that have passed fire on the
+//next one.
+void timer_schedule(TimerWheel *wheel, Timer *timer, long expires) {
+    if (timer_pending(timer)) {
+        timer_unlink(wheel, timer);
+    }
+
+    timer->expires = expires;
+    timer_place(wheel, timer, expires > wheel->now ? expires : wheel->now + 1);
+}
+
+void timer_cancel(TimerWheel *wheel, Timer *timer) {
+    if (timer_pending(timer)) {
+        timer_unlink(wheel, timer);
+    }
+}
+
+//Handles the tick now has just reached: the slots of the higher levels whose turn it is are spread over the levels
+//below, then the timers of the level 0 slot fire.
+void timer_wheel_tick(TimerWheel *wheel) {
+    for (int level = TIMER_LEVELS - 1; level > 0; level--) {
+        int shift = level * TIMER_LEVEL_BITS;
+
+        if ((wheel->now & ((1L << shift) - 1)) != 0)
+            continue;
+
+        Link *slot = &wheel->slots[level][(wheel->now >> shift) & TIMER_SLOT_MASK];
+
+        while (link_is_linked(slot)) {
+            Timer *timer = link_entry(slot->next, Timer, link);
+            timer_unlink(wheel, timer);
+            timer_place(wheel, timer, timer->expires > wheel->now ? timer->expires : wheel->now);
+        }
+    }
+
+    Link *slot = &wheel->slots[0][wheel->now & TIMER_SLOT_MASK];
+
+    while (link_is_linked(slot)) {
+        Timer *timer = link_entry(slot->next, Timer, link);
+        timer_unlink(wheel, timer);
+        timer->expired(timer);
+    }
+}
+
+//Fires every timer due by now, only visiting the ticks that have something to do.
+void timer_wheel_advance(TimerWheel *wheel, long now) {
+    long next;
+
+    while ((next = timer_wheel_next(wheel)) >= 0 && next <= now) {
+        wheel->now = next;
+        timer_wheel_tick(wheel);
+    }
+
+    if (now > wheel->now) {
+        wheel->now = now;
+    }
+}
+
+//The next tick with timers to fire or cascade, -1 if nothing is scheduled. A tick may only move timers down a level,
+//each timer is moved at most once per level.
+long timer_wheel_next(TimerWheel *wheel) {
+    long next = -1;
+
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        unsigned long occupied = wheel->occupied[level];
+
+        if (occupied == 0)
+            continue;
+
+        int shift = level * TIMER_LEVEL_BITS;
+        long index = wheel->now >> shift;
+        int first = (int) ((index + 1) & TIMER_SLOT_MASK);
+
+        //Rotate so bit 0 is the slot after the current one.
+        if (first != 0) {
+            occupied = (occupied >> first) | (occupied << (TIMER_SLOTS - first));
+        }
+
+        long tick = (index + 1 + __builtin_ctzl(occupied)) << shift;
+
+        if (next < 0 || tick < next) {
+            next = tick;
+        }
+    }
+
+    return next;
+}
@@ -0,0 +1,48 @@
+#ifndef CHATSERVER_TIMER_H
+#define CHATSERVER_TIMER_H
+
+#include "../list.h"
+
+//Levels of the wheel and slots per level, a slot of level n spans 64^n ticks of a millisecond. Timers further out
+//than the top level reaches (about 4.6 hours) wait in its last slot and are placed again when it comes round.
+#define TIMER_LEVELS 4
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+
+//Embed a Timer in whatever it is for and use link_entry on it in the callback.
+typedef struct timer {
+    //Linked into a slot while scheduled
+    Link link;
+    //Millisecond tick it is due at
+    long expires;
+    int level;
+    int slot;
+    //Called once the timer is due, it is no longer scheduled by then and may schedule itself again
+    void (*expired)(struct timer *timer);
+} Timer;
+
+//Hashed hierarchical timing wheel. Scheduling and cancelling are O(1), and advancing costs O(1) per tick that has a
+//slot to fire or cascade, the bitmaps of occupied slots let it jump straight over the empty ones.
+typedef struct timer_wheel {
+    //Last tick processed
+    long now;
+    int count;
+    unsigned long occupied[TIMER_LEVELS];
+    Link slots[TIMER_LEVELS][TIMER_SLOTS];
+} TimerWheel;
+
+void timer_wheel_init(TimerWheel *wheel, long now);
+
+void timer_init(Timer *timer, void (*expired)(Timer *timer));
+
+int timer_pending(Timer *timer);
+
+void timer_schedule(TimerWheel *wheel, Timer *timer, long expires);
+
+void timer_cancel(TimerWheel *wheel, Timer *timer);
+
+void timer_wheel_advance(TimerWheel *wheel, long now);
+
+long timer_wheel_next(TimerWheel *wheel);
+
+#endif //CHATSERVER_TIMER_H
@@ -0,0 +1,238 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <memory.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include "uring.h"
+
+//Function Declarations
+void *uring_map(int fd, size_t size, off_t offset);
+
+//Function Implementations
+int uring_init(Uring *ring, unsigned entries) {
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(Uring));
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+
+    if (ring->fd < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        fprintf(stderr, "io_uring is missing IORING_FEAT_EXT_ARG (uring_init).\n");
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->entries = params.sq_entries;
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sqRing = uring_map(ring->fd, ring->sqRingSize, IORING_OFF_SQ_RING);
+    ring->cqRing = uring_map(ring->fd, ring->cqRingSize, IORING_OFF_CQ_RING);
+    ring->sqes = uring_map(ring->fd, ring->sqesSize, IORING_OFF_SQES);
+
+    if (ring->sqRing == NULL || ring->cqRing == NULL || ring->sqes == NULL) {
+        uring_free(ring);
+        return -1;
+    }
+
+    ring->sqHead = (unsigned *) ((char *) ring->sqRing + params.sq_off.head);
+    ring->sqTail = (unsigned *) ((char *) ring->sqRing + params.sq_off.tail);
+    ring->sqMask = (unsigned *) ((char *) ring->sqRing + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *) ((char *) ring->sqRing + params.sq_off.array);
+    ring->sqLocalTail = *ring->sqTail;
+
+    ring->cqHead = (unsigned *) ((char *) ring->cqRing + params.cq_off.head);
+    ring->cqTail = (unsigned *) ((char *) ring->cqRing + params.cq_off.tail);
+    ring->cqMask = (unsigned *) ((char *) ring->cqRing + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cqRing + params.cq_off.cqes);
+    return 0;
+}
+
+//Returns a cleared submission entry, submitting what is queued first if the ring is full. Returns NULL if the kernel
+//didn't take enough of it to make room.
+struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+    if (uring_sq_space(ring) == 0) {
+        if (uring_submit(ring) < 0 || uring_sq_space(ring) == 0) {
+            return NULL;
+        }
+    }
+
+    unsigned index = ring->sqLocalTail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sqArray[index] = index;
+    ring->sqLocalTail++;
+    return sqe;
+}
+
+//Returns how many submission entries can be had without submitting.
+int uring_sq_space(Uring *ring) {
+    return (int) (ring->entries - (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE)));
+}
+
+//Submits every entry the kernel hasn't taken yet, including any left over from a submission it cut short.
+int uring_submit(Uring *ring) {
+    unsigned pending = ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+
+    if (pending == 0) {
+        return 0;
+    }
+
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+
+    while (1) {
+        int submitted = (int) syscall(__NR_io_uring_enter, ring->fd, pending, 0, 0, NULL, 0);
+        ring->enters++;
+
+        if (submitted < 0 && errno == EINTR)
+            continue;
+
+        if (submitted < 0) {
+            perror("io_uring_enter");
+        }
+
+        return submitted;
+    }
+}
+
+//Submits everything queued and waits for at least one completion, or until the timeout passes. A negative timeout
+//waits for a completion however long it takes.
+int uring_submit_and_wait(Uring *ring, int timeout_ms) {
+    struct __kernel_timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+    struct io_uring_getevents_arg arg;
+    unsigned pending = ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = timeout_ms < 0 ? 0 : (unsigned long) &ts;
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+
+    int result = (int) syscall(__NR_io_uring_enter, ring->fd, pending, 1,
+                               IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    ring->enters++;
+
+    if (result < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+        perror("io_uring_enter");
+        return -1;
+    }
+
+    return 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(Uring *ring) {
+    unsigned head = *ring->cqHead;
+
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    return &ring->cqes[head & *ring->cqMask];
+}
+
+void uring_cqe_seen(Uring *ring) {
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+//Registers count buffers of size bytes that receives pick from by group.
+int uring_setup_buffers(Uring *ring, int count, int size, int group) {
+    struct io_uring_buf_reg reg;
+
+    ring->bufRingSize = count * sizeof(struct io_uring_buf);
+    ring->bufRing = mmap(NULL, ring->bufRingSize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+
+    if (ring->bufRing == MAP_FAILED) {
+        perror("mmap");
+        ring->bufRing = NULL;
+        return -1;
+    }
+
+    ring->bufBase = mmap(NULL, (size_t) count * size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+
+    if (ring->bufBase == MAP_FAILED) {
+        perror("mmap");
+        ring->bufBase = NULL;
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) ring->bufRing;
+    reg.ring_entries = (unsigned) count;
+    reg.bgid = (unsigned short) group;
+
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring_register");
+        return -1;
+    }
+
+    ring->bufCount = count;
+    ring->bufSize = size;
+    ring->bufGroup = group;
+    ring->bufRing->tail = 0;
+
+    for (int i = 0; i < count; i++) {
+        uring_recycle_buffer(ring, i);
+    }
+
+    return 0;
+}
+
+Byte *uring_buffer(Uring *ring, int id) {
+    return ring->bufBase + (size_t) id * ring->bufSize;
+}
+
+//Hands a consumed receive buffer back to the kernel.
+void uring_recycle_buffer(Uring *ring, int id) {
+    unsigned short tail = ring->bufRing->tail;
+    struct io_uring_buf *buf = &ring->bufRing->bufs[tail & (ring->bufCount - 1)];
+
+    buf->addr = (unsigned long) uring_buffer(ring, id);
+    buf->len = (unsigned) ring->bufSize;
+    buf->bid = (unsigned short) id;
+    __atomic_store_n(&ring->bufRing->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
+
+void uring_free(Uring *ring) {
+    if (ring->bufBase != NULL) {
+        munmap(ring->bufBase, (size_t) ring->bufCount * ring->bufSize);
+    }
+
+    if (ring->bufRing != NULL) {
+        munmap(ring->bufRing, ring->bufRingSize);
+    }
+
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+
+    if (ring->cqRing != NULL) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+
+    if (ring->sqRing != NULL) {
+        munmap(ring->sqRing, ring->sqRingSize);
+    }
+
+    close(ring->fd);
+}
+
+//"private" functions
+void *uring_map(int fd, size_t size, off_t offset) {
+    void *result = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+
+    if (result == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+
+    return result;
+}
@@ -0,0 +1,63 @@
+#ifndef CHATSERVER_URING_H
+#define CHATSERVER_URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include "../buffer.h"
+
+//Minimal io_uring ring with one provided buffer group, driven through the raw system calls.
+typedef struct uring {
+    int fd;
+    unsigned entries;
+    //Submission queue
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned sqLocalTail;
+    struct io_uring_sqe *sqes;
+    //Completion queue
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+    //Mappings
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+    //Provided receive buffers
+    struct io_uring_buf_ring *bufRing;
+    size_t bufRingSize;
+    Byte *bufBase;
+    int bufCount;
+    int bufSize;
+    int bufGroup;
+    //Counters
+    long enters;
+} Uring;
+
+int uring_init(Uring *ring, unsigned entries);
+
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+
+int uring_sq_space(Uring *ring);
+
+int uring_submit(Uring *ring);
+
+int uring_submit_and_wait(Uring *ring, int timeout_ms);
+
+struct io_uring_cqe *uring_peek_cqe(Uring *ring);
+
+void uring_cqe_seen(Uring *ring);
+
+int uring_setup_buffers(Uring *ring, int count, int size, int group);
+
+Byte *uring_buffer(Uring *ring, int id);
+
+void uring_recycle_buffer(Uring *ring, int id);
+
+void uring_free(Uring *ring);
+
+#endif //CHATSERVER_URING_H